@@ -0,0 +1,104 @@
+#include "fs/kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures the throughput of the block kernels for each instruction set the
+ * processor supports, per buffer size, against plain memcpy/memset.
+ * Build together with fs/kernels.c, e.g.:
+ *   gcc -std=c17 -O2 -I. fs/kernels.c bench/block_kernels.c
+ */
+
+#define MIN_SIZE (64)
+#define MAX_SIZE (8 << 20)
+#define BYTES_PER_RUN (256 << 20) // bytes moved per measurement
+
+typedef enum { OP_COPY, OP_COPY_STREAM, OP_FILL } op_t;
+
+static char const *op_names[] = {"copy", "stream", "fill"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs an operation repeatedly over buffers of a given size.
+ * Inputs:
+ *  - the operation
+ *  - whether to use the libc functions instead of the kernels
+ *  - the buffers and their size
+ * Returns the throughput, in GB/s.
+ */
+static double measure(op_t op, int libc, char *dst, char const *src,
+                      size_t size) {
+    size_t runs = BYTES_PER_RUN / size;
+    double start = now();
+    for (size_t i = 0; i < runs; i++) {
+        switch (op) {
+        case OP_COPY:
+        case OP_COPY_STREAM:
+            if (libc) {
+                memcpy(dst, src, size);
+            } else if (op == OP_COPY) {
+                block_copy(dst, src, size);
+            } else {
+                block_copy_stream(dst, src, size);
+            }
+            break;
+        case OP_FILL:
+            if (libc) {
+                memset(dst, (int)i, size);
+            } else {
+                block_fill(dst, (int)i, size);
+            }
+            break;
+        }
+        /* Keep the compiler from dropping the stores */
+        __asm__ volatile("" : : "r"(dst) : "memory");
+    }
+    double elapsed = now() - start;
+
+    return (double)(runs * size) / elapsed / 1e9;
+}
+
+int main() {
+    char *src = aligned_alloc(64, MAX_SIZE);
+    char *dst = aligned_alloc(64, MAX_SIZE);
+    if (src == NULL || dst == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(src, 'x', MAX_SIZE);
+    memset(dst, 0, MAX_SIZE);
+
+    printf("%-8s %10s", "op", "size");
+    printf(" %9s", "libc");
+    for (int isa = KERNELS_GENERIC; isa <= KERNELS_AVX512; isa++) {
+        if (kernels_supported((kernels_isa_t)isa)) {
+            printf(" %9s", kernels_name((kernels_isa_t)isa));
+        }
+    }
+    printf("   (GB/s)\n");
+
+    for (int op = OP_COPY; op <= OP_FILL; op++) {
+        for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+            printf("%-8s %10zu", op_names[op], size);
+            printf(" %9.2f", measure((op_t)op, 1, dst, src, size));
+            for (int isa = KERNELS_GENERIC; isa <= KERNELS_AVX512; isa++) {
+                if (kernels_select((kernels_isa_t)isa) == 0) {
+                    printf(" %9.2f", measure((op_t)op, 0, dst, src, size));
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    free(src);
+    free(dst);
+
+    return EXIT_SUCCESS;
+}
@@ -5,12 +5,56 @@
 #define ROOT_DIR_INUM (0)
 
 #define BLOCK_SIZE (1024)
-#define DATA_BLOCKS (1024)
-#define INODE_TABLE_SIZE (50)
 #define INODE_DIRECT_REFS (10)
-#define MAX_OPEN_FILES (20)
 #define MAX_FILE_NAME (40)
 
+/* Default geometry (see tfs_params_init): data blocks, i-nodes, open files,
+ * and iterations simulating each storage access */
+#define DATA_BLOCKS (1024)
+#define INODE_TABLE_SIZE (50)
+#define MAX_OPEN_FILES (20)
 #define DELAY (5000)
 
+/* Size of the huge pages the state kept in memory can be in */
+#define IMAGE_HUGE_PAGE_SIZE (2 << 20)
+
+/* Readahead: blocks kept prefetched, maximum window and pending requests */
+#define BLOCK_CACHE_SIZE (64)
+#define READAHEAD_MIN_BLOCKS (2)
+#define READAHEAD_MAX_BLOCKS (16)
+#define READAHEAD_QUEUE_SIZE (32)
+
+/* Blocks of an image the readahead thread loads at a time when idle */
+#define IMAGE_PREFETCH_BLOCKS (16)
+
+/* Asynchronous queues: maximum requests in flight and worker threads */
+#define QUEUE_MAX_ENTRIES (256)
+#define QUEUE_MAX_WORKERS (16)
+
+/* Bulk operations (export, verification): maximum worker threads and bytes
+ * handled per task */
+#define BULK_MAX_THREADS (16)
+#define BULK_RANGE_SIZE (16 * BLOCK_SIZE)
+
+/* Block kernels: writes from which data is stored bypassing the caches (only
+ * worth it for writes larger than the processor's last level cache) */
+#define KERNELS_STREAM_MIN_SIZE (4 << 20)
+
+/* Compressed files: data blocks per chunk, the unit data is compressed in (a
+ * read decompresses the whole chunks it touches) */
+#define COMPRESS_CHUNK_BLOCKS (8)
+#define COMPRESS_CHUNK_SIZE (COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE)
+
+/* Block deduplication: mutexes guarding the index of blocks by contents,
+ * which has a bucket per data block (each guards every DEDUP_LOCKS-th
+ * bucket) */
+#define DEDUP_LOCKS (64)
+
+/* Journal of metadata changes (image files only): bytes of the image each
+ * change is tracked in, milliseconds between commits no one waits for, and
+ * size past which the journal is checkpointed into the image */
+#define JOURNAL_CELL_SIZE (64)
+#define JOURNAL_COMMIT_INTERVAL (50)
+#define JOURNAL_MAX_SIZE (1 << 20)
+
 #endif // CONFIG_H
@@ -0,0 +1,818 @@
+#include "journal.h"
+#include "config.h"
+#include "kernels.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Redo journal of the changes to an image's metadata: free maps, i-nodes,
+ * directory entries, indirect blocks, checksums and the deduplication index.
+ *
+ * The image is mapped privately, so the file only changes when the journal
+ * writes to it. Changes are tracked in cells of JOURNAL_CELL_SIZE bytes of the
+ * image. Operations run in handles (journal_start and journal_stop), and the
+ * operations running together make up a transaction, which a helper thread
+ * commits as a whole: new handles wait while no handle is open and the
+ * cells changed are copied out, and then start the next transaction while
+ * the commit is written. A commit writes the data cells changed in
+ * place first, so that metadata never refers to data not written, and then
+ * appends a record with the metadata cells to the journal, with one
+ * fdatasync each, which every thread waiting for its changes to be durable
+ * (journal_sync) shares. Metadata cells may become data once a block is freed
+ * and reused, so a record also lists (without their contents) the cells
+ * logged before that it wrote in place, which replay then leaves alone.
+ * When the journal grows past JOURNAL_MAX_SIZE, and when it is destroyed, the
+ * metadata cells are written into the image itself (a checkpoint) and the
+ * journal is emptied. On init, the records committed are replayed into the
+ * image, up to the first one a crash tore.
+ */
+
+#define JOURNAL_MAGIC (0x6c616e72756f6a74) // "tjournal", little-endian
+
+/* Commit record: a header, followed by the ranges of the image it changes */
+typedef struct {
+    uint64_t jh_magic;
+    uint64_t jh_seq;
+    uint64_t jh_len; // bytes of ranges following the header
+    uint32_t jh_crc; // CRC32C of those bytes
+    uint32_t jh_unused;
+} journal_header_t;
+
+/* Range of the image in a commit record, followed by its contents unless it
+ * is revoked: written in place, so older records' contents are not replayed */
+typedef struct {
+    uint64_t jr_offset;
+    uint64_t jr_len;
+    uint64_t jr_revoked;
+} journal_range_t;
+
+/* Journal of an image (one per file system instance) */
+struct journal {
+    int jn_fd;
+    int jn_image_fd;
+    size_t jn_image_size;
+    char *jn_image; // the mapped image, once journaling is enabled
+    bool jn_on;
+    size_t jn_length; // bytes of records in the journal
+    void (*jn_committed_hook)(void *arg, uint64_t seq);
+    void *jn_committed_arg;
+
+    /* Cells changed in the running transaction, as bitmaps: metadata, logged
+     * in the journal, and data, written in place. The transaction being
+     * committed has its own copy, and the metadata cells logged since the
+     * last checkpoint are kept too. */
+    size_t jn_words; // 64-bit words of each bitmap
+    _Atomic uint64_t *jn_logged;
+    _Atomic uint64_t *jn_written;
+    uint64_t *jn_commit_logged;
+    uint64_t *jn_commit_written;
+    uint64_t *jn_commit_revoked;
+    uint64_t *jn_unsynced;
+    atomic_bool jn_changed; // whether any cell changed
+    char *jn_buf;           // commit record being written
+    size_t jn_buf_size;
+    char *jn_data; // contents of the data cells being written in place
+    size_t jn_data_size;
+
+    /* Transactions: the running one, the last one committed, and the handles
+     * open in the running one (see journal_depth) */
+    _Atomic uint64_t jn_seq;
+    uint64_t jn_committed_seq;
+    int jn_handles;
+    bool jn_closing;  // new handles wait for the next transaction
+    bool jn_wanted;   // a thread waits for a commit
+    bool jn_stopping; // the helper thread is to stop
+    bool jn_failed;   // a commit failed: none is made anymore
+    pthread_t jn_tid;
+    pthread_mutex_t jn_mutex;
+    pthread_cond_t jn_idle;
+    pthread_cond_t jn_reopened;
+    pthread_cond_t jn_wakeup;
+    pthread_cond_t jn_done;
+};
+
+/* Handles the calling thread has open (see journal_start) */
+static _Thread_local int journal_depth;
+
+static int journal_pread(int fd, void *buf, size_t len, size_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t)offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= (size_t)n;
+        offset += (size_t)n;
+    }
+
+    return 0;
+}
+
+static int journal_pwrite(int fd, void const *buf, size_t len,
+                          size_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char const *)buf + n;
+        len -= (size_t)n;
+        offset += (size_t)n;
+    }
+
+    return 0;
+}
+
+/*
+ * Finds the next run of cells set in a bitmap.
+ * Inputs:
+ *  - the journal, and the bitmap
+ *  - cell to search from, advanced past the run found
+ *  - set to the offset and length in the image of the run
+ * Returns true if a run was found, false otherwise.
+ */
+static bool journal_next_run(journal_t *jn, uint64_t const *cells,
+                             size_t *cell, size_t *offset, size_t *len) {
+    size_t count = jn->jn_words * 64;
+    size_t first = *cell;
+    while (first < count && !(cells[first / 64] >> (first % 64) & 1)) {
+        first = cells[first / 64] >> (first % 64) == 0
+                    ? (first / 64 + 1) * 64
+                    : first + 1;
+    }
+
+    size_t end = first;
+    while (end < count && cells[end / 64] >> (end % 64) & 1) {
+        end++;
+    }
+
+    *cell = end;
+    if (first >= count) {
+        return false;
+    }
+
+    *offset = first * JOURNAL_CELL_SIZE;
+    *len = end * JOURNAL_CELL_SIZE < jn->jn_image_size
+               ? (end - first) * JOURNAL_CELL_SIZE
+               : jn->jn_image_size - *offset;
+    return true;
+}
+
+/*
+ * Goes through the ranges of a commit record.
+ * Inputs:
+ *  - the journal
+ *  - the ranges and their length in bytes
+ *  - sequence number of the record
+ *  - sequence number of the last record revoking each cell
+ *  - whether to note the cells revoked (first pass), or to write the contents
+ *    not revoked by a record as recent into the image file (second pass)
+ * Returns 0 if successful, -1 if they are malformed or cannot be written.
+ */
+static int journal_walk(journal_t *jn, char const *ranges, size_t len,
+                        uint64_t seq, uint64_t *revoked, bool apply) {
+    size_t pos = 0;
+    while (pos < len) {
+        journal_range_t range;
+        if (len - pos < sizeof(range)) {
+            return -1;
+        }
+        memcpy(&range, ranges + pos, sizeof(range));
+        pos += sizeof(range);
+
+        size_t contents = range.jr_revoked ? 0 : range.jr_len;
+        if (contents > len - pos || range.jr_offset > jn->jn_image_size ||
+            range.jr_len > jn->jn_image_size - range.jr_offset ||
+            range.jr_offset % JOURNAL_CELL_SIZE != 0) {
+            return -1;
+        }
+
+        size_t first = range.jr_offset / JOURNAL_CELL_SIZE;
+        size_t end = (range.jr_offset + range.jr_len + JOURNAL_CELL_SIZE - 1) /
+                     JOURNAL_CELL_SIZE;
+        for (size_t c = first; c < end && !apply && range.jr_revoked; c++) {
+            revoked[c] = seq;
+        }
+
+        /* Runs of cells not revoked since */
+        for (size_t c = first; c < end && apply && !range.jr_revoked;) {
+            size_t run = c;
+            while (run < end && revoked[run] < seq) {
+                run++;
+            }
+            if (run > c) {
+                size_t from = (c - first) * JOURNAL_CELL_SIZE;
+                size_t to = run == end ? range.jr_len
+                                       : (run - first) * JOURNAL_CELL_SIZE;
+                if (journal_pwrite(jn->jn_image_fd, ranges + pos + from,
+                                   to - from, range.jr_offset + from) == -1) {
+                    return -1;
+                }
+            }
+            c = run + 1;
+        }
+        pos += contents;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the next record committed to the journal.
+ * Inputs:
+ *  - the journal
+ *  - offset of the record, and size of the journal
+ *  - sequence number of the record before it (0 if none)
+ *  - set to its header, and to its ranges (to be freed)
+ * Returns 1 if a record was read, 0 if there is none (or a crash tore it),
+ * -1 if the journal cannot be read.
+ */
+static int journal_read(journal_t *jn, size_t offset, size_t size,
+                        uint64_t last_seq, journal_header_t *header,
+                        char **ranges) {
+    if (size - offset < sizeof(*header) ||
+        journal_pread(jn->jn_fd, header, sizeof(*header), offset) == -1) {
+        return size - offset < sizeof(*header) ? 0 : -1;
+    }
+
+    /* A record torn by a crash (and anything after it) never committed */
+    if (header->jh_magic != JOURNAL_MAGIC || header->jh_seq <= last_seq ||
+        header->jh_len > size - offset - sizeof(*header)) {
+        return 0;
+    }
+
+    *ranges = malloc(header->jh_len + 1);
+    if (*ranges == NULL ||
+        journal_pread(jn->jn_fd, *ranges, header->jh_len,
+                      offset + sizeof(*header)) == -1) {
+        free(*ranges);
+        return -1;
+    }
+
+    if (~block_crc32c(~0u, *ranges, header->jh_len) != header->jh_crc) {
+        free(*ranges);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Replays the records committed to the journal into the image file, and
+ * empties the journal: first noting the cells each record revokes, then
+ * writing the contents of the rest.
+ * Input:
+ *  - the journal
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_replay(journal_t *jn) {
+    struct stat st;
+    if (fstat(jn->jn_fd, &st) == -1) {
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    size_t cells = (jn->jn_image_size + JOURNAL_CELL_SIZE - 1) /
+                   JOURNAL_CELL_SIZE;
+    uint64_t *revoked = size > 0 ? calloc(cells, sizeof(uint64_t)) : NULL;
+    if (size > 0 && revoked == NULL) {
+        return -1;
+    }
+
+    size_t end = 0;
+    int result = 0;
+    for (int pass = 0; pass < 2 && result == 0; pass++) {
+        size_t offset = 0;
+        uint64_t last_seq = 0;
+        journal_header_t header;
+        char *ranges;
+        while (result == 0 && (pass == 0 || offset < end) &&
+               (result = journal_read(jn, offset, size, last_seq, &header,
+                                      &ranges)) == 1) {
+            result = journal_walk(jn, ranges, header.jh_len, header.jh_seq,
+                                  revoked, pass == 1);
+            free(ranges);
+            last_seq = header.jh_seq;
+            offset += sizeof(header) + header.jh_len;
+        }
+        end = offset;
+    }
+    free(revoked);
+
+    if (result == -1 || (end > 0 && fdatasync(jn->jn_image_fd) == -1) ||
+        ftruncate(jn->jn_fd, 0) == -1 || fdatasync(jn->jn_fd) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Builds the commit record of the transaction being committed: its metadata
+ * cells, copying their contents from the image, and the cells it revokes.
+ * Inputs:
+ *  - the journal
+ *  - the transaction's sequence number
+ * Returns the length of the record (0 if it is empty), or -1 if it cannot be
+ * built.
+ */
+static ssize_t journal_pack(journal_t *jn, uint64_t seq) {
+    size_t len = sizeof(journal_header_t);
+    size_t cell = 0;
+    size_t offset;
+    size_t run;
+    while (journal_next_run(jn, jn->jn_commit_logged, &cell, &offset, &run)) {
+        len += sizeof(journal_range_t) + run;
+    }
+    cell = 0;
+    while (journal_next_run(jn, jn->jn_commit_revoked, &cell, &offset, &run)) {
+        len += sizeof(journal_range_t);
+    }
+
+    if (len == sizeof(journal_header_t)) {
+        return 0;
+    }
+
+    if (len > jn->jn_buf_size) {
+        char *buf = realloc(jn->jn_buf, len);
+        if (buf == NULL) {
+            return -1;
+        }
+        jn->jn_buf = buf;
+        jn->jn_buf_size = len;
+    }
+
+    size_t pos = sizeof(journal_header_t);
+    cell = 0;
+    while (journal_next_run(jn, jn->jn_commit_logged, &cell, &offset, &run)) {
+        journal_range_t range = {
+            .jr_offset = offset, .jr_len = run, .jr_revoked = 0};
+        memcpy(jn->jn_buf + pos, &range, sizeof(range));
+        memcpy(jn->jn_buf + pos + sizeof(range), jn->jn_image + offset, run);
+        pos += sizeof(range) + run;
+    }
+    cell = 0;
+    while (journal_next_run(jn, jn->jn_commit_revoked, &cell, &offset, &run)) {
+        journal_range_t range = {
+            .jr_offset = offset, .jr_len = run, .jr_revoked = 1};
+        memcpy(jn->jn_buf + pos, &range, sizeof(range));
+        pos += sizeof(range);
+    }
+
+    size_t ranges_len = len - sizeof(journal_header_t);
+    journal_header_t header = {
+        .jh_magic = JOURNAL_MAGIC,
+        .jh_seq = seq,
+        .jh_len = ranges_len,
+        .jh_crc = ~block_crc32c(~0u, jn->jn_buf + sizeof(header), ranges_len),
+        .jh_unused = 0};
+    memcpy(jn->jn_buf, &header, sizeof(header));
+    return (ssize_t)len;
+}
+
+/*
+ * Copies out the contents of the data cells of the transaction being
+ * committed, as the next transaction may change them while they are written.
+ * Input:
+ *  - the journal
+ * Returns the number of bytes copied, or -1 if they cannot be copied.
+ */
+static ssize_t journal_copy_data(journal_t *jn) {
+    size_t len = 0;
+    size_t cell = 0;
+    size_t offset;
+    size_t run;
+    while (journal_next_run(jn, jn->jn_commit_written, &cell, &offset, &run)) {
+        len += run;
+    }
+
+    if (len > jn->jn_data_size) {
+        char *data = realloc(jn->jn_data, len);
+        if (data == NULL) {
+            return -1;
+        }
+        jn->jn_data = data;
+        jn->jn_data_size = len;
+    }
+
+    size_t pos = 0;
+    cell = 0;
+    while (journal_next_run(jn, jn->jn_commit_written, &cell, &offset, &run)) {
+        memcpy(jn->jn_data + pos, jn->jn_image + offset, run);
+        pos += run;
+    }
+
+    return (ssize_t)len;
+}
+
+/*
+ * Writes the metadata cells logged since the last checkpoint into the image
+ * file, and empties the journal. No handle may be open.
+ * Input:
+ *  - the journal
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_checkpoint(journal_t *jn) {
+    size_t cell = 0;
+    size_t offset;
+    size_t run;
+    while (journal_next_run(jn, jn->jn_unsynced, &cell, &offset, &run)) {
+        if (journal_pwrite(jn->jn_image_fd, jn->jn_image + offset, run,
+                           offset) == -1) {
+            return -1;
+        }
+    }
+
+    if (fdatasync(jn->jn_image_fd) == -1 || ftruncate(jn->jn_fd, 0) == -1 ||
+        fdatasync(jn->jn_fd) == -1) {
+        return -1;
+    }
+
+    memset(jn->jn_unsynced, 0, jn->jn_words * sizeof(uint64_t));
+    jn->jn_length = 0;
+    return 0;
+}
+
+/*
+ * Commits the running transaction, once its handles are closed, and starts
+ * the next one. Only one commit runs at a time.
+ * Inputs:
+ *  - the journal
+ *  - whether to checkpoint the journal too (new handles wait until done)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_commit(journal_t *jn, bool checkpoint) {
+    pthread_mutex_lock(&jn->jn_mutex);
+    if (jn->jn_failed) {
+        pthread_mutex_unlock(&jn->jn_mutex);
+        return -1;
+    }
+
+    jn->jn_closing = true;
+    while (jn->jn_handles > 0) {
+        pthread_cond_wait(&jn->jn_idle, &jn->jn_mutex);
+    }
+
+    uint64_t seq = atomic_fetch_add(&jn->jn_seq, 1);
+    atomic_store(&jn->jn_changed, false);
+    for (size_t i = 0; i < jn->jn_words; i++) {
+        jn->jn_commit_logged[i] = atomic_exchange_explicit(
+            &jn->jn_logged[i], 0, memory_order_relaxed);
+        jn->jn_commit_written[i] = atomic_exchange_explicit(
+            &jn->jn_written[i], 0, memory_order_relaxed);
+        /* Data written over metadata the journal holds revokes it */
+        jn->jn_commit_revoked[i] =
+            jn->jn_commit_written[i] & jn->jn_unsynced[i];
+        jn->jn_unsynced[i] = (jn->jn_unsynced[i] & ~jn->jn_commit_revoked[i]) |
+                             jn->jn_commit_logged[i];
+    }
+    ssize_t len = journal_pack(jn, seq);
+    ssize_t data = journal_copy_data(jn);
+
+    /* The next transaction runs while this one is written */
+    if (!checkpoint) {
+        jn->jn_closing = false;
+        pthread_cond_broadcast(&jn->jn_reopened);
+    }
+    pthread_mutex_unlock(&jn->jn_mutex);
+
+    /* Data first, then the metadata referring to it */
+    int result = len == -1 || data == -1 ? -1 : 0;
+    size_t pos = 0;
+    size_t cell = 0;
+    size_t offset;
+    size_t run;
+    while (result == 0 &&
+           journal_next_run(jn, jn->jn_commit_written, &cell, &offset, &run)) {
+        result = journal_pwrite(jn->jn_image_fd, jn->jn_data + pos, run,
+                                offset);
+        pos += run;
+    }
+    if (result == 0 && data > 0 && fdatasync(jn->jn_image_fd) == -1) {
+        result = -1;
+    }
+
+    if (result == 0 && len > 0) {
+        if (journal_pwrite(jn->jn_fd, jn->jn_buf, (size_t)len,
+                           jn->jn_length) == -1 ||
+            fdatasync(jn->jn_fd) == -1) {
+            result = -1;
+        } else {
+            jn->jn_length += (size_t)len;
+        }
+    }
+
+    if (result == 0 && jn->jn_committed_hook != NULL) {
+        jn->jn_committed_hook(jn->jn_committed_arg, seq);
+    }
+
+    if (result == 0 && checkpoint) {
+        result = journal_checkpoint(jn);
+    }
+
+    pthread_mutex_lock(&jn->jn_mutex);
+    if (result == -1) {
+        jn->jn_failed = true;
+    } else {
+        jn->jn_committed_seq = seq;
+    }
+    if (checkpoint) {
+        jn->jn_closing = false;
+        pthread_cond_broadcast(&jn->jn_reopened);
+    }
+    pthread_cond_broadcast(&jn->jn_done);
+    pthread_mutex_unlock(&jn->jn_mutex);
+
+    return result;
+}
+
+/*
+ * Helper thread committing transactions: when a thread waits for a commit,
+ * or every JOURNAL_COMMIT_INTERVAL milliseconds if anything changed.
+ */
+static void *journal_thread(void *arg) {
+    journal_t *jn = arg;
+    pthread_mutex_lock(&jn->jn_mutex);
+    while (!jn->jn_stopping) {
+        if (!jn->jn_wanted) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += JOURNAL_COMMIT_INTERVAL * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&jn->jn_wakeup, &jn->jn_mutex, &deadline);
+        }
+
+        bool due = jn->jn_wanted || atomic_load(&jn->jn_changed);
+        jn->jn_wanted = false;
+        if (jn->jn_stopping || !due) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&jn->jn_mutex);
+        journal_commit(jn, jn->jn_length > JOURNAL_MAX_SIZE);
+        pthread_mutex_lock(&jn->jn_mutex);
+    }
+    pthread_mutex_unlock(&jn->jn_mutex);
+
+    return NULL;
+}
+
+/*
+ * Opens the journal of an image file, replaying the records committed to it
+ * into the image. Changes are not journaled until journal_enable is called.
+ * Inputs:
+ *  - path of the journal on the host (created if it does not exist)
+ *  - the image file and its size
+ * Returns the journal if successful, NULL otherwise.
+ */
+journal_t *journal_init(char const *path, int image_fd, size_t image_size) {
+    journal_t *jn = calloc(1, sizeof(*jn));
+    if (jn == NULL) {
+        return NULL;
+    }
+
+    jn->jn_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (jn->jn_fd == -1) {
+        free(jn);
+        return NULL;
+    }
+
+    jn->jn_image_fd = image_fd;
+    jn->jn_image_size = image_size;
+    if (journal_replay(jn) == -1 || pthread_mutex_init(&jn->jn_mutex, NULL)) {
+        close(jn->jn_fd);
+        free(jn);
+        return NULL;
+    }
+    pthread_cond_init(&jn->jn_idle, NULL);
+    pthread_cond_init(&jn->jn_reopened, NULL);
+    pthread_cond_init(&jn->jn_wakeup, NULL);
+    pthread_cond_init(&jn->jn_done, NULL);
+
+    return jn;
+}
+
+/*
+ * Starts journaling the changes to the image, and the helper thread
+ * committing them.
+ * Inputs:
+ *  - the journal
+ *  - the image, mapped privately (see journal_init)
+ *  - function called (by the helper thread) with its argument and the
+ *    sequence number of each transaction once it is committed, or NULL
+ *  - the argument to call it with
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_enable(journal_t *jn, void *image,
+                   void (*committed)(void *arg, uint64_t seq), void *arg) {
+    jn->jn_image = image;
+    jn->jn_committed_hook = committed;
+    jn->jn_committed_arg = arg;
+    jn->jn_words = (jn->jn_image_size + 64 * JOURNAL_CELL_SIZE - 1) /
+                   (64 * JOURNAL_CELL_SIZE);
+    jn->jn_logged = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_written = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_commit_logged = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_commit_written = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_commit_revoked = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_unsynced = calloc(jn->jn_words, sizeof(uint64_t));
+    jn->jn_buf = NULL;
+    jn->jn_buf_size = 0;
+    jn->jn_data = NULL;
+    jn->jn_data_size = 0;
+    jn->jn_length = 0;
+    atomic_init(&jn->jn_changed, false);
+    atomic_init(&jn->jn_seq, 1);
+    jn->jn_committed_seq = 0;
+    jn->jn_handles = 0;
+    jn->jn_closing = false;
+    jn->jn_wanted = false;
+    jn->jn_stopping = false;
+    jn->jn_failed = false;
+
+    if (jn->jn_logged == NULL || jn->jn_written == NULL ||
+        jn->jn_commit_logged == NULL || jn->jn_commit_written == NULL ||
+        jn->jn_commit_revoked == NULL || jn->jn_unsynced == NULL ||
+        pthread_create(&jn->jn_tid, NULL, journal_thread, jn)) {
+        free(jn->jn_logged);
+        free(jn->jn_written);
+        free(jn->jn_commit_logged);
+        free(jn->jn_commit_written);
+        free(jn->jn_commit_revoked);
+        free(jn->jn_unsynced);
+        return -1;
+    }
+
+    jn->jn_on = true;
+    return 0;
+}
+
+/*
+ * Commits every change left, checkpoints the journal, closes it and frees it.
+ * Input:
+ *  - the journal (nothing is done if NULL)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_destroy(journal_t *jn) {
+    if (jn == NULL) {
+        return 0;
+    }
+
+    int result = 0;
+    if (jn->jn_on) {
+        pthread_mutex_lock(&jn->jn_mutex);
+        jn->jn_stopping = true;
+        pthread_cond_signal(&jn->jn_wakeup);
+        pthread_mutex_unlock(&jn->jn_mutex);
+        if (pthread_join(jn->jn_tid, NULL)) {
+            result = -1;
+        }
+
+        /* The hook of the first commit may still change metadata (see
+         * journal_enable), which the second one commits */
+        if (journal_commit(jn, false) == -1 || journal_commit(jn, true) == -1) {
+            result = -1;
+        }
+
+        jn->jn_on = false;
+        free(jn->jn_logged);
+        free(jn->jn_written);
+        free(jn->jn_commit_logged);
+        free(jn->jn_commit_written);
+        free(jn->jn_commit_revoked);
+        free(jn->jn_unsynced);
+        free(jn->jn_buf);
+        free(jn->jn_data);
+    }
+
+    if (close(jn->jn_fd) == -1) {
+        result = -1;
+    }
+    pthread_mutex_destroy(&jn->jn_mutex);
+    pthread_cond_destroy(&jn->jn_idle);
+    pthread_cond_destroy(&jn->jn_reopened);
+    pthread_cond_destroy(&jn->jn_wakeup);
+    pthread_cond_destroy(&jn->jn_done);
+    free(jn);
+    return result;
+}
+
+/*
+ * Opens a handle: the changes made until it is closed (journal_stop) are
+ * committed in the same transaction. Waits while a transaction is being
+ * closed, so it must be called before taking any lock. Handles nest.
+ * Input:
+ *  - the journal (nothing is done if NULL, as for the next functions)
+ */
+void journal_start(journal_t *jn) {
+    if (jn == NULL || !jn->jn_on || journal_depth++ > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&jn->jn_mutex);
+    while (jn->jn_closing) {
+        pthread_cond_wait(&jn->jn_reopened, &jn->jn_mutex);
+    }
+    jn->jn_handles++;
+    pthread_mutex_unlock(&jn->jn_mutex);
+}
+
+/* Closes a handle opened by journal_start */
+void journal_stop(journal_t *jn) {
+    if (jn == NULL || !jn->jn_on || --journal_depth > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&jn->jn_mutex);
+    jn->jn_handles--;
+    if (jn->jn_handles == 0 && jn->jn_closing) {
+        pthread_cond_signal(&jn->jn_idle);
+    }
+    pthread_mutex_unlock(&jn->jn_mutex);
+}
+
+/*
+ * Waits until the changes made by the calling thread are committed, sharing
+ * the commit with any other thread waiting meanwhile. Within a handle, it
+ * returns at once: the changes are committed when the outermost handle is
+ * closed and synced.
+ * Returns 0 if successful (or if nothing is journaled), -1 otherwise.
+ */
+int journal_sync(journal_t *jn) {
+    if (jn == NULL || !jn->jn_on || journal_depth > 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&jn->jn_mutex);
+    uint64_t seq = atomic_load(&jn->jn_seq);
+    jn->jn_wanted = true;
+    pthread_cond_signal(&jn->jn_wakeup);
+    while (jn->jn_committed_seq < seq && !jn->jn_failed) {
+        pthread_cond_wait(&jn->jn_done, &jn->jn_mutex);
+    }
+    int result = jn->jn_failed ? -1 : 0;
+    pthread_mutex_unlock(&jn->jn_mutex);
+
+    return result;
+}
+
+/* Returns the sequence number of the running transaction (within a handle,
+ * the one the handle's changes are committed in) */
+uint64_t journal_running(journal_t *jn) {
+    return jn != NULL ? atomic_load(&jn->jn_seq) : 0;
+}
+
+/* Marks the cells of a range of the image as changed */
+static void journal_mark(journal_t *jn, _Atomic uint64_t *cells,
+                         void const *addr, size_t len) {
+    size_t offset = (size_t)((char const *)addr - jn->jn_image);
+    size_t last = (offset + len - 1) / JOURNAL_CELL_SIZE;
+    for (size_t c = offset / JOURNAL_CELL_SIZE; c <= last; c++) {
+        uint64_t bit = (uint64_t)1 << (c % 64);
+        if (!(atomic_load_explicit(&cells[c / 64], memory_order_relaxed) &
+              bit)) {
+            atomic_fetch_or_explicit(&cells[c / 64], bit,
+                                     memory_order_relaxed);
+        }
+    }
+
+    if (!atomic_load_explicit(&jn->jn_changed, memory_order_relaxed)) {
+        atomic_store(&jn->jn_changed, true);
+    }
+}
+
+/*
+ * Records a change to the image's metadata, logged in the journal when the
+ * running transaction commits.
+ * Inputs:
+ *  - the journal
+ *  - address and length of the range changed, within the image
+ */
+void journal_log(journal_t *jn, void const *addr, size_t len) {
+    if (jn != NULL && jn->jn_on && len > 0) {
+        journal_mark(jn, jn->jn_logged, addr, len);
+    }
+}
+
+/*
+ * Records a change to the image's data, written in place when the running
+ * transaction commits (before its metadata).
+ * Inputs:
+ *  - the journal
+ *  - address and length of the range changed, within the image
+ */
+void journal_data(journal_t *jn, void const *addr, size_t len) {
+    if (jn != NULL && jn->jn_on && len > 0) {
+        journal_mark(jn, jn->jn_written, addr, len);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct journal journal_t;
+
+journal_t *journal_init(char const *path, int image_fd, size_t image_size);
+int journal_enable(journal_t *jn, void *image,
+                   void (*committed)(void *arg, uint64_t seq), void *arg);
+int journal_destroy(journal_t *jn);
+
+void journal_start(journal_t *jn);
+void journal_stop(journal_t *jn);
+int journal_sync(journal_t *jn);
+uint64_t journal_running(journal_t *jn);
+
+void journal_log(journal_t *jn, void const *addr, size_t len);
+void journal_data(journal_t *jn, void const *addr, size_t len);
+
+#endif // JOURNAL_H
@@ -0,0 +1,504 @@
+#include "kernels.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Block kernels: copies and fills of data blocks, implemented with the widest
+ * vector instructions the processor supports (selected at run time, as the
+ * binary may run on processors other than the one it was built on).
+ */
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected */
+#define CRC32C_POLY (0x82f63b78u)
+
+typedef struct {
+    void (*k_copy)(void *dst, void const *src, size_t len);
+    void (*k_copy_stream)(void *dst, void const *src, size_t len);
+    void (*k_fill)(void *dst, int c, size_t len);
+} kernels_t;
+
+/* Software CRC32C, a byte at a time */
+static uint32_t crc32c_table[256];
+
+/*
+ * Returns how many bytes to handle before a buffer is aligned, at most len.
+ * Inputs:
+ *  - the buffer
+ *  - the alignment (a power of 2)
+ *  - the buffer's length
+ */
+static size_t align_head(void const *buffer, size_t alignment, size_t len) {
+    size_t head = (alignment - (uintptr_t)buffer % alignment) % alignment;
+    return head < len ? head : len;
+}
+
+static void generic_copy(void *dst, void const *src, size_t len) {
+    memcpy(dst, src, len);
+}
+
+static void generic_fill(void *dst, int c, size_t len) { memset(dst, c, len); }
+
+static uint32_t generic_crc32c(uint32_t crc, void const *buf, size_t len) {
+    unsigned char const *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static kernels_t const generic_kernels = {
+    .k_copy = generic_copy,
+    .k_copy_stream = generic_copy,
+    .k_fill = generic_fill,
+};
+
+#ifdef KERNELS_X86
+
+/* SSE2: 16-byte vectors, 64 bytes per iteration */
+
+__attribute__((target("sse2"))) static void
+sse2_copy(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((__m128i const *)s);
+        __m128i b = _mm_loadu_si128((__m128i const *)(s + 16));
+        __m128i c = _mm_loadu_si128((__m128i const *)(s + 32));
+        __m128i e = _mm_loadu_si128((__m128i const *)(s + 48));
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), e);
+    }
+    for (; len >= 16; len -= 16, d += 16, s += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)s);
+        _mm_storeu_si128((__m128i *)d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)(s + len - 16));
+        _mm_storeu_si128((__m128i *)(d + len - 16), v);
+        return;
+    }
+    memcpy(d, s, len);
+}
+
+__attribute__((target("sse2"))) static void
+sse2_copy_stream(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    size_t head = align_head(d, 16, len);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((__m128i const *)s);
+        __m128i b = _mm_loadu_si128((__m128i const *)(s + 16));
+        __m128i c = _mm_loadu_si128((__m128i const *)(s + 32));
+        __m128i e = _mm_loadu_si128((__m128i const *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    _mm_sfence(); // order the streaming stores before later stores
+    memcpy(d, s, len);
+}
+
+__attribute__((target("sse2"))) static void sse2_fill(void *dst, int c,
+                                                      size_t len) {
+    char *d = dst;
+    __m128i v = _mm_set1_epi8((char)c);
+    for (; len >= 64; len -= 64, d += 64) {
+        _mm_storeu_si128((__m128i *)d, v);
+        _mm_storeu_si128((__m128i *)(d + 16), v);
+        _mm_storeu_si128((__m128i *)(d + 32), v);
+        _mm_storeu_si128((__m128i *)(d + 48), v);
+    }
+    for (; len >= 16; len -= 16, d += 16) {
+        _mm_storeu_si128((__m128i *)d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 16) {
+        _mm_storeu_si128((__m128i *)(d + len - 16), v);
+        return;
+    }
+    memset(d, c, len);
+}
+
+/* SSE4.2: the crc32 instruction, 8 bytes at a time */
+
+__attribute__((target("sse4.2"))) static uint32_t
+sse42_crc32c(uint32_t crc, void const *buf, size_t len) {
+    unsigned char const *p = buf;
+    for (; len > 0 && (uintptr_t)p % 8 != 0; len--, p++) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; len >= 4; len -= 4, p += 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; len > 0; len--, p++) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+static kernels_t const sse2_kernels = {
+    .k_copy = sse2_copy,
+    .k_copy_stream = sse2_copy_stream,
+    .k_fill = sse2_fill,
+};
+
+/* AVX2: 32-byte vectors, 128 bytes per iteration */
+
+__attribute__((target("avx2"))) static void
+avx2_copy(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)s);
+        __m256i b = _mm256_loadu_si256((__m256i const *)(s + 32));
+        __m256i c = _mm256_loadu_si256((__m256i const *)(s + 64));
+        __m256i e = _mm256_loadu_si256((__m256i const *)(s + 96));
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        _mm256_storeu_si256((__m256i *)(d + 64), c);
+        _mm256_storeu_si256((__m256i *)(d + 96), e);
+    }
+    for (; len >= 32; len -= 32, d += 32, s += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)s);
+        _mm256_storeu_si256((__m256i *)d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(s + len - 32));
+        _mm256_storeu_si256((__m256i *)(d + len - 32), v);
+        return;
+    }
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_copy_stream(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    size_t head = align_head(d, 32, len);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)s);
+        __m256i b = _mm256_loadu_si256((__m256i const *)(s + 32));
+        __m256i c = _mm256_loadu_si256((__m256i const *)(s + 64));
+        __m256i e = _mm256_loadu_si256((__m256i const *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void avx2_fill(void *dst, int c,
+                                                      size_t len) {
+    char *d = dst;
+    __m256i v = _mm256_set1_epi8((char)c);
+    for (; len >= 128; len -= 128, d += 128) {
+        _mm256_storeu_si256((__m256i *)d, v);
+        _mm256_storeu_si256((__m256i *)(d + 32), v);
+        _mm256_storeu_si256((__m256i *)(d + 64), v);
+        _mm256_storeu_si256((__m256i *)(d + 96), v);
+    }
+    for (; len >= 32; len -= 32, d += 32) {
+        _mm256_storeu_si256((__m256i *)d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 32) {
+        _mm256_storeu_si256((__m256i *)(d + len - 32), v);
+        return;
+    }
+    memset(d, c, len);
+}
+
+static kernels_t const avx2_kernels = {
+    .k_copy = avx2_copy,
+    .k_copy_stream = avx2_copy_stream,
+    .k_fill = avx2_fill,
+};
+
+/* AVX-512: 64-byte vectors, 256 bytes per iteration */
+
+__attribute__((target("avx512f"))) static void
+avx512_copy(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    for (; len >= 256; len -= 256, d += 256, s += 256) {
+        __m512i a = _mm512_loadu_si512(s);
+        __m512i b = _mm512_loadu_si512(s + 64);
+        __m512i c = _mm512_loadu_si512(s + 128);
+        __m512i e = _mm512_loadu_si512(s + 192);
+        _mm512_storeu_si512(d, a);
+        _mm512_storeu_si512(d + 64, b);
+        _mm512_storeu_si512(d + 128, c);
+        _mm512_storeu_si512(d + 192, e);
+    }
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        __m512i v = _mm512_loadu_si512(s);
+        _mm512_storeu_si512(d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 64) {
+        __m512i v = _mm512_loadu_si512(s + len - 64);
+        _mm512_storeu_si512(d + len - 64, v);
+        return;
+    }
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_copy_stream(void *dst, void const *src, size_t len) {
+    char *d = dst;
+    char const *s = src;
+    size_t head = align_head(d, 64, len);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 256; len -= 256, d += 256, s += 256) {
+        __m512i a = _mm512_loadu_si512(s);
+        __m512i b = _mm512_loadu_si512(s + 64);
+        __m512i c = _mm512_loadu_si512(s + 128);
+        __m512i e = _mm512_loadu_si512(s + 192);
+        _mm512_stream_si512((void *)d, a);
+        _mm512_stream_si512((void *)(d + 64), b);
+        _mm512_stream_si512((void *)(d + 128), c);
+        _mm512_stream_si512((void *)(d + 192), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f"))) static void avx512_fill(void *dst, int c,
+                                                           size_t len) {
+    char *d = dst;
+    __m512i v = _mm512_set1_epi32((int)(0x01010101u * (unsigned char)c));
+    for (; len >= 256; len -= 256, d += 256) {
+        _mm512_storeu_si512(d, v);
+        _mm512_storeu_si512(d + 64, v);
+        _mm512_storeu_si512(d + 128, v);
+        _mm512_storeu_si512(d + 192, v);
+    }
+    for (; len >= 64; len -= 64, d += 64) {
+        _mm512_storeu_si512(d, v);
+    }
+    /* Finish with a vector overlapping the bytes already handled */
+    if (len > 0 && (size_t)(d - (char *)dst) >= 64) {
+        _mm512_storeu_si512(d + len - 64, v);
+        return;
+    }
+    memset(d, c, len);
+}
+
+static kernels_t const avx512_kernels = {
+    .k_copy = avx512_copy,
+    .k_copy_stream = avx512_copy_stream,
+    .k_fill = avx512_fill,
+};
+
+#endif // KERNELS_X86
+
+/* Kernels in use, and the instruction set they use; the CRC32C kernel only
+ * depends on whether the processor has the crc32 instruction */
+static kernels_t const *kernels = &generic_kernels;
+static kernels_isa_t kernels_isa = KERNELS_GENERIC;
+static uint32_t (*crc32c_kernel)(uint32_t, void const *, size_t) =
+    generic_crc32c;
+
+/* Fills the table of the software CRC32C */
+static void crc32c_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+/*
+ * Checks whether the processor (and the operating system) supports the
+ * kernels for an instruction set.
+ * Input:
+ *  - isa: the instruction set
+ * Returns non-zero if supported, 0 otherwise.
+ */
+int kernels_supported(kernels_isa_t isa) {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    switch (isa) {
+    case KERNELS_GENERIC:
+        return 1;
+    case KERNELS_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case KERNELS_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case KERNELS_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+    return 0;
+#else
+    return isa == KERNELS_GENERIC;
+#endif
+}
+
+/*
+ * Switches to the kernels for an instruction set.
+ * Must not be called while the kernels are in use by other threads.
+ * Input:
+ *  - isa: the instruction set
+ * Returns 0 if successful, -1 if the instruction set is not supported.
+ */
+int kernels_select(kernels_isa_t isa) {
+    if (!kernels_supported(isa)) {
+        return -1;
+    }
+
+    crc32c_init_table();
+    kernels_t const *selected = &generic_kernels;
+    crc32c_kernel = generic_crc32c;
+#ifdef KERNELS_X86
+    if (isa != KERNELS_GENERIC && __builtin_cpu_supports("sse4.2")) {
+        crc32c_kernel = sse42_crc32c;
+    }
+    switch (isa) {
+    case KERNELS_GENERIC:
+        break;
+    case KERNELS_SSE2:
+        selected = &sse2_kernels;
+        break;
+    case KERNELS_AVX2:
+        selected = &avx2_kernels;
+        break;
+    case KERNELS_AVX512:
+        selected = &avx512_kernels;
+        break;
+    }
+#endif
+
+    kernels = selected;
+    kernels_isa = isa;
+    return 0;
+}
+
+/*
+ * Switches to the kernels for the widest instruction set supported.
+ * Must not be called while the kernels are in use by other threads.
+ */
+void kernels_init() {
+    for (int isa = KERNELS_AVX512; isa > KERNELS_GENERIC; isa--) {
+        if (kernels_select((kernels_isa_t)isa) == 0) {
+            return;
+        }
+    }
+
+    kernels_select(KERNELS_GENERIC);
+}
+
+/*
+ * Returns the instruction set of the kernels in use.
+ */
+kernels_isa_t kernels_current() { return kernels_isa; }
+
+/*
+ * Returns the name of an instruction set.
+ * Input:
+ *  - isa: the instruction set
+ */
+char const *kernels_name(kernels_isa_t isa) {
+    switch (isa) {
+    case KERNELS_GENERIC:
+        return "generic";
+    case KERNELS_SSE2:
+        return "sse2";
+    case KERNELS_AVX2:
+        return "avx2";
+    case KERNELS_AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+/*
+ * Copies bytes between buffers that do not overlap.
+ * Inputs:
+ *  - destination and source buffers
+ *  - number of bytes to copy
+ */
+void block_copy(void *dst, void const *src, size_t len) {
+    kernels->k_copy(dst, src, len);
+}
+
+/*
+ * Copies bytes between buffers that do not overlap, with stores that bypass
+ * the caches (where supported), for data that will not be read again soon:
+ * large writes do not evict the data being worked on.
+ * Inputs:
+ *  - destination and source buffers
+ *  - number of bytes to copy
+ */
+void block_copy_stream(void *dst, void const *src, size_t len) {
+    kernels->k_copy_stream(dst, src, len);
+}
+
+/*
+ * Sets every byte of a buffer to a value.
+ * Inputs:
+ *  - the buffer
+ *  - the value (converted to unsigned char)
+ *  - the buffer's length
+ */
+void block_fill(void *dst, int c, size_t len) { kernels->k_fill(dst, c, len); }
+
+/*
+ * Sets every byte of a buffer to zero.
+ * Inputs:
+ *  - the buffer and its length
+ */
+void block_zero(void *dst, size_t len) { kernels->k_fill(dst, 0, len); }
+
+/*
+ * Updates a CRC32C over a buffer. The CRC is neither inverted before nor
+ * after, so the update is linear: callers wanting the standard CRC32C start
+ * from ~0 and invert the result. The kernels must have been selected first
+ * (see kernels_init).
+ * Inputs:
+ *  - the CRC so far
+ *  - the buffer and its length
+ * Returns the updated CRC.
+ */
+uint32_t block_crc32c(uint32_t crc, void const *buf, size_t len) {
+    return crc32c_kernel(crc, buf, len);
+}
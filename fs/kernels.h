@@ -0,0 +1,30 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Instruction sets the block kernels are implemented with, from the most
+ * portable to the widest
+ */
+typedef enum {
+    KERNELS_GENERIC,
+    KERNELS_SSE2,
+    KERNELS_AVX2,
+    KERNELS_AVX512,
+} kernels_isa_t;
+
+void kernels_init();
+int kernels_select(kernels_isa_t isa);
+int kernels_supported(kernels_isa_t isa);
+kernels_isa_t kernels_current();
+char const *kernels_name(kernels_isa_t isa);
+
+void block_copy(void *dst, void const *src, size_t len);
+void block_copy_stream(void *dst, void const *src, size_t len);
+void block_fill(void *dst, int c, size_t len);
+void block_zero(void *dst, size_t len);
+uint32_t block_crc32c(uint32_t crc, void const *buf, size_t len);
+
+#endif // KERNELS_H
@@ -0,0 +1,237 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A fast LZ77 codec, in the style of LZ4: the compressed data is a sequence of
+ * literal runs, each followed by a match (a copy of earlier data, at most
+ * LZ_MAX_OFFSET bytes back), except for the last run. Each sequence is:
+ *  - a token byte: the run's length in the high nibble, and the match's length
+ *    minus LZ_MIN_MATCH in the low nibble (15 meaning more bytes follow)
+ *  - the rest of the run's length, if any: bytes added to it, up to the first
+ *    one below 255
+ *  - the run's bytes
+ *  - the match's offset (2 bytes, little-endian)
+ *  - the rest of the match's length, if any, like the run's
+ * Matches are found through a hash table of the positions of 4-byte sequences.
+ */
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (12)
+
+static uint32_t lz_read32(unsigned char const *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static size_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Writes the rest of a length that does not fit in its token nibble.
+ * Inputs:
+ *  - where to write it, and the end of the output
+ *  - the length, minus the 15 in the nibble
+ * Returns where the next byte goes, or NULL if the output is full.
+ */
+static unsigned char *lz_put_length(unsigned char *op,
+                                    unsigned char const *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == oend) {
+        return NULL;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+ * Writes a sequence: a literal run and, unless it is the last, a match.
+ * Inputs:
+ *  - where to write it, and the end of the output
+ *  - the run and its length
+ *  - the match's offset and length (0 for the last sequence)
+ * Returns where the next sequence goes, or NULL if the output is full.
+ */
+static unsigned char *lz_put_sequence(unsigned char *op,
+                                      unsigned char const *oend,
+                                      unsigned char const *literals,
+                                      size_t literal_len, size_t offset,
+                                      size_t match_len) {
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    if (op == oend) {
+        return NULL;
+    }
+    *op++ = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4 |
+                            (match_code < 15 ? match_code : 15));
+
+    if (literal_len >= 15 &&
+        (op = lz_put_length(op, oend, literal_len - 15)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < literal_len) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    if (match_code >= 15) {
+        op = lz_put_length(op, oend, match_code - 15);
+    }
+    return op;
+}
+
+/*
+ * Compresses a buffer.
+ * Inputs:
+ *  - the buffer and its length
+ *  - where to write the compressed data, and its capacity
+ * Returns the length of the compressed data, or 0 if it does not fit.
+ */
+size_t lz_compress(void const *src, size_t len, void *dst, size_t capacity) {
+    unsigned char const *base = src;
+    unsigned char const *ip = base;
+    unsigned char const *anchor = base; // start of the pending literal run
+    unsigned char const *iend = base + len;
+    unsigned char *op = dst;
+    unsigned char const *oend = op + capacity;
+
+    /* Position (plus one) of the last sequence seen with each hash */
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (iend - ip >= LZ_MIN_MATCH) {
+        uint32_t sequence = lz_read32(ip);
+        size_t hash = lz_hash(sequence);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)(ip - base + 1);
+
+        unsigned char const *match = base + candidate - 1;
+        if (candidate == 0 || ip - match > LZ_MAX_OFFSET ||
+            lz_read32(match) != sequence) {
+            ip++;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < iend && match[match_len] == ip[match_len]) {
+            match_len++;
+        }
+
+        op = lz_put_sequence(op, oend, anchor, (size_t)(ip - anchor),
+                             (size_t)(ip - match), match_len);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = lz_put_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return (size_t)(op - (unsigned char *)dst);
+}
+
+/*
+ * Reads the rest of a length that does not fit in its token nibble.
+ * Inputs:
+ *  - where to read it from (advanced past it), and the end of the input
+ *  - the length so far, to which the rest is added
+ * Returns 0 if successful, -1 if the input ends first.
+ */
+static int lz_get_length(unsigned char const **ip, unsigned char const *iend,
+                         size_t *len) {
+    unsigned char byte;
+    do {
+        if (*ip == iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+ * Decompresses a buffer compressed by lz_compress.
+ * Inputs:
+ *  - the compressed data and its length
+ *  - where to write the data, and its capacity
+ * Returns the length of the data, or -1 if the compressed data is malformed
+ * or the data does not fit.
+ */
+ssize_t lz_decompress(void const *src, size_t len, void *dst,
+                      size_t capacity) {
+    unsigned char const *ip = src;
+    unsigned char const *iend = ip + len;
+    unsigned char *op = dst;
+    unsigned char *oend = op + capacity;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && lz_get_length(&ip, iend, &literal_len) == -1) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < literal_len ||
+            (size_t)(oend - op) < literal_len) {
+            return -1;
+        }
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        /* The last sequence has no match */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz_get_length(&ip, iend, &match_len) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) {
+            return -1;
+        }
+
+        /* The match may overlap the bytes it produces */
+        unsigned char const *match = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return (ssize_t)(op - (unsigned char *)dst);
+}
@@ -0,0 +1,11 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t lz_compress(void const *src, size_t len, void *dst, size_t capacity);
+ssize_t lz_decompress(void const *src, size_t len, void *dst,
+                      size_t capacity);
+
+#endif // LZ_H
@@ -1,18 +1,54 @@
 #include "operations.h"
+#include "journal.h"
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int tfs_init() {
-    if (state_init() == -1) {
+int tfs_init() { return tfs_init_flags(0); }
+
+int tfs_init_flags(int flags) { return tfs_init_image(NULL, flags); }
+
+int tfs_init_image(char const *image_path, int flags) {
+    tfs_params_t params;
+    tfs_params_init(&params);
+    params.tp_image_path = image_path;
+    params.tp_flags = flags;
+    return tfs_init_with_params(&params);
+}
+
+void tfs_params_init(tfs_params_t *params) {
+    params->tp_block_size = BLOCK_SIZE;
+    params->tp_data_blocks = DATA_BLOCKS;
+    params->tp_inode_table_size = INODE_TABLE_SIZE;
+    params->tp_max_open_files = MAX_OPEN_FILES;
+    params->tp_delay = DELAY;
+    params->tp_huge_pages = 0;
+    params->tp_image_path = NULL;
+    params->tp_flags = 0;
+}
+
+int tfs_init_with_params(tfs_params_t const *params) {
+    if (state_init(params, params->tp_flags & TFS_MOUNT_VERIFY,
+                   params->tp_flags & TFS_MOUNT_DEDUP) == -1) {
         return -1;
     }
 
-    /* create root inode */
+    /* create root inode, unless the image has it */
+    if (inode_size(ROOT_DIR_INUM) != -1) {
+        return 0;
+    }
+
+    journal_t *jn = state_journal();
+    journal_start(jn);
     int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+    journal_stop(jn);
+    if (root != ROOT_DIR_INUM || journal_sync(jn) == -1) {
         return -1;
     }
 
@@ -37,7 +73,7 @@ int tfs_lookup(char const *name) {
     return find_in_dir(ROOT_DIR_INUM, name);
 }
 
-int tfs_create(char const *name, inode_type type) {
+int tfs_create(char const *name, inode_type type, int compressed) {
     if (!valid_pathname(name)) {
         return -1;
     }
@@ -45,10 +81,19 @@ int tfs_create(char const *name, inode_type type) {
     // skip the initial '/' character
     name++;
 
-    return create_in_dir(ROOT_DIR_INUM, type, name);
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int inum = create_in_dir(ROOT_DIR_INUM, type, name, compressed);
+    journal_stop(jn);
+    if (inum == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return inum;
 }
 
-int tfs_open(char const *name, int flags) {
+/* Opens a file (see tfs_open), within a journal handle */
+static int open_file(char const *name, int flags) {
     int inum;
 
     /* Checks if the path name is valid */
@@ -56,70 +101,1050 @@ int tfs_open(char const *name, int flags) {
         return -1;
     }
 
-    inum = flags & TFS_O_CREAT ? tfs_create(name, T_FILE) : tfs_lookup(name);
+    inum = flags & TFS_O_CREAT
+               ? tfs_create(name, T_FILE, flags & TFS_O_COMPRESS)
+               : tfs_lookup(name);
     if (inum == -1) {
         return -1;
     }
 
-    /* Truncate (if requested) */
+    /* Truncate (if requested), after any buffered writes */
     if (flags & TFS_O_TRUNC) {
-        if (inode_clear(inum) == -1) {
+        if (flush_file_buffers(inum) == -1 || inode_clear(inum) == -1) {
             return -1;
         }
     }
 
     /* Add entry to the open file table and return the file descriptor */
-    return add_to_open_file_table(inum, flags & TFS_O_APPEND);
+    return add_to_open_file_table(inum, flags & TFS_O_APPEND,
+                                  flags & TFS_O_BUFFERED);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
      * opened but it remains created */
 }
 
-int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
+int tfs_open(char const *name, int flags) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int fhandle = open_file(name, flags);
+    journal_stop(jn);
+
+    /* Creating or truncating the file is committed before it is used */
+    if (fhandle != -1 && (flags & (TFS_O_CREAT | TFS_O_TRUNC)) &&
+        journal_sync(jn) == -1) {
+        tfs_close(fhandle);
+        return -1;
+    }
+
+    return fhandle;
+}
+
+int tfs_close(int fhandle) {
+    journal_t *jn = state_journal();
+    /* Write back buffered data; the file is closed even if that fails */
+    journal_start(jn);
+    int result = flush_open_file(fhandle);
+    if (remove_from_open_file_table(fhandle) == -1) {
+        result = -1;
+    }
+    journal_stop(jn);
+
+    return result;
+}
+
+int tfs_fsync(int fhandle) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = flush_open_file(fhandle);
+    journal_stop(jn);
+    if (result == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    off_t result = seek_open_file(fhandle, offset, whence);
+    journal_stop(jn);
+    return result;
+}
+
+int tfs_truncate(char const *path, size_t len) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int inum = tfs_lookup(path);
+    int result = inum == -1 || flush_file_buffers(inum) == -1
+                     ? -1
+                     : inode_truncate(inum, len);
+    journal_stop(jn);
+    if (result == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int tfs_ftruncate(int fhandle, size_t len) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = truncate_open_file(fhandle, len);
+    journal_stop(jn);
+    if (result == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    return write_to_open_file(fhandle, buffer, to_write);
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t written = write_to_open_file(fhandle, buffer, to_write);
+    journal_stop(jn);
+    return written;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    return read_from_open_file(fhandle, buffer, len);
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t read = read_from_open_file(fhandle, buffer, len);
+    journal_stop(jn);
+    return read;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t written = writev_to_open_file(fhandle, iov, iovcnt);
+    journal_stop(jn);
+    return written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t read = readv_from_open_file(fhandle, iov, iovcnt);
+    journal_stop(jn);
+    return read;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t written = pwrite_to_open_file(fhandle, buffer, len, offset);
+    journal_stop(jn);
+    return written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t read = pread_from_open_file(fhandle, buffer, len, offset);
+    journal_stop(jn);
+    return read;
+}
+
+ssize_t tfs_copy_file_range(int src_fhandle, size_t src_offset,
+                            int dst_fhandle, size_t dst_offset, size_t len) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    ssize_t copied = copy_between_open_files(src_fhandle, src_offset,
+                                             dst_fhandle, dst_offset, len);
+    journal_stop(jn);
+    return copied;
+}
+
+int tfs_read_map(int fhandle, size_t offset, size_t len, file_map_t *map) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = map_open_file(fhandle, offset, len, map);
+    journal_stop(jn);
+    return result;
+}
+
+int tfs_read_unmap(file_map_t *map) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = unmap_file(map);
+    journal_stop(jn);
+    return result;
+}
+
+struct tfs_queue {
+    tfs_t *q_fs;          // instance the requests are executed on
+    size_t q_entries;     // requests submitted but not yet reaped, at most
+    size_t q_outstanding; // requests submitted but not yet reaped
+
+    /* Requests waiting for a worker (ring buffer) */
+    tfs_request_t *q_requests;
+    size_t q_request_head;
+    size_t q_request_count;
+
+    /* Completions waiting to be reaped (ring buffer) */
+    tfs_completion_t *q_completions;
+    size_t q_completion_head;
+    size_t q_completion_count;
+
+    bool q_stopping;
+    pthread_mutex_t q_mutex;
+    pthread_cond_t q_submitted; // signaled when a request is submitted
+    pthread_cond_t q_completed; // signaled when a request is completed
+
+    pthread_t q_workers[QUEUE_MAX_WORKERS];
+    size_t q_worker_count;
+};
+
+/*
+ * Executes a request with the corresponding synchronous call.
+ * Input:
+ *  - the request
+ * Returns the result of the call.
+ */
+static ssize_t queue_execute(tfs_request_t const *request) {
+    switch (request->rq_op) {
+    case TFS_OP_OPEN:
+        return tfs_open(request->rq_name, request->rq_flags);
+    case TFS_OP_CLOSE:
+        return tfs_close(request->rq_fhandle);
+    case TFS_OP_READ:
+        return tfs_read(request->rq_fhandle, request->rq_buffer,
+                        request->rq_len);
+    case TFS_OP_WRITE:
+        return tfs_write(request->rq_fhandle, request->rq_buffer,
+                         request->rq_len);
+    case TFS_OP_PREAD:
+        return tfs_pread(request->rq_fhandle, request->rq_buffer,
+                         request->rq_len, request->rq_offset);
+    case TFS_OP_PWRITE:
+        return tfs_pwrite(request->rq_fhandle, request->rq_buffer,
+                          request->rq_len, request->rq_offset);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Worker thread of a queue: executes requests until the queue is destroyed
+ * and no requests are left.
+ */
+static void *queue_worker(void *arg) {
+    tfs_queue_t *queue = arg;
+    state_select(queue->q_fs);
+
+    pthread_mutex_lock(&queue->q_mutex);
+    for (;;) {
+        while (queue->q_request_count == 0 && !queue->q_stopping) {
+            pthread_cond_wait(&queue->q_submitted, &queue->q_mutex);
+        }
+
+        if (queue->q_request_count == 0) {
+            break;
+        }
+
+        tfs_request_t request = queue->q_requests[queue->q_request_head];
+        queue->q_request_head = (queue->q_request_head + 1) % queue->q_entries;
+        queue->q_request_count--;
+
+        /* Requests are executed concurrently, without the queue locked */
+        pthread_mutex_unlock(&queue->q_mutex);
+        tfs_completion_t completion = {.cq_user_data = request.rq_user_data,
+                                       .cq_result = queue_execute(&request)};
+        pthread_mutex_lock(&queue->q_mutex);
+
+        /* There is room, as completions never outnumber outstanding requests */
+        size_t tail = (queue->q_completion_head + queue->q_completion_count) %
+                      queue->q_entries;
+        queue->q_completions[tail] = completion;
+        queue->q_completion_count++;
+        pthread_cond_broadcast(&queue->q_completed);
+    }
+    pthread_mutex_unlock(&queue->q_mutex);
+
+    return NULL;
+}
+
+/*
+ * Stops the worker threads of a queue (once no requests are left) and frees
+ * it.
+ * Input:
+ *  - the queue
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int queue_free(tfs_queue_t *queue) {
+    int result = 0;
+
+    pthread_mutex_lock(&queue->q_mutex);
+    queue->q_stopping = true;
+    pthread_cond_broadcast(&queue->q_submitted);
+    pthread_mutex_unlock(&queue->q_mutex);
+
+    for (size_t i = 0; i < queue->q_worker_count; i++) {
+        if (pthread_join(queue->q_workers[i], NULL)) {
+            result = -1;
+        }
+    }
+
+    if (pthread_cond_destroy(&queue->q_completed) ||
+        pthread_cond_destroy(&queue->q_submitted) ||
+        pthread_mutex_destroy(&queue->q_mutex)) {
+        result = -1;
+    }
+
+    free(queue->q_completions);
+    free(queue->q_requests);
+    free(queue);
+    return result;
+}
+
+tfs_queue_t *tfs_queue_create(size_t entries, size_t workers) {
+    if (entries == 0 || entries > QUEUE_MAX_ENTRIES || workers == 0 ||
+        workers > QUEUE_MAX_WORKERS) {
+        return NULL;
+    }
+
+    tfs_queue_t *queue = calloc(1, sizeof(tfs_queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->q_fs = state_current();
+    queue->q_entries = entries;
+    queue->q_requests = malloc(entries * sizeof(tfs_request_t));
+    queue->q_completions = malloc(entries * sizeof(tfs_completion_t));
+    if (queue->q_requests == NULL || queue->q_completions == NULL) {
+        free(queue->q_completions);
+        free(queue->q_requests);
+        free(queue);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&queue->q_mutex, NULL) ||
+        pthread_cond_init(&queue->q_submitted, NULL) ||
+        pthread_cond_init(&queue->q_completed, NULL)) {
+        free(queue->q_completions);
+        free(queue->q_requests);
+        free(queue);
+        return NULL;
+    }
+
+    for (; queue->q_worker_count < workers; queue->q_worker_count++) {
+        if (pthread_create(&queue->q_workers[queue->q_worker_count], NULL,
+                           queue_worker, queue)) {
+            queue_free(queue);
+            return NULL;
+        }
+    }
+
+    return queue;
+}
+
+int tfs_queue_destroy(tfs_queue_t *queue) {
+    if (queue == NULL) {
+        return -1;
+    }
+
+    return queue_free(queue);
+}
+
+ssize_t tfs_submit(tfs_queue_t *queue, tfs_request_t const *requests,
+                   size_t count) {
+    if (queue == NULL || (requests == NULL && count > 0)) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&queue->q_mutex)) {
+        return -1;
+    }
+
+    /* Submit as many requests as there is room for */
+    size_t room = queue->q_entries - queue->q_outstanding;
+    if (count > room) {
+        count = room;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t tail = (queue->q_request_head + queue->q_request_count) %
+                      queue->q_entries;
+        queue->q_requests[tail] = requests[i];
+        queue->q_request_count++;
+    }
+    queue->q_outstanding += count;
+
+    if (count > 0 && pthread_cond_broadcast(&queue->q_submitted)) {
+        pthread_mutex_unlock(&queue->q_mutex);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&queue->q_mutex)) {
+        return -1;
+    }
+
+    return (ssize_t)count;
+}
+
+ssize_t tfs_reap(tfs_queue_t *queue, tfs_completion_t *completions, size_t max,
+                 size_t min) {
+    if (queue == NULL || (completions == NULL && max > 0) || min > max) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&queue->q_mutex)) {
+        return -1;
+    }
+
+    /* Wait for enough completions, unless no more are coming */
+    while (queue->q_completion_count < min &&
+           queue->q_completion_count < queue->q_outstanding) {
+        if (pthread_cond_wait(&queue->q_completed, &queue->q_mutex)) {
+            pthread_mutex_unlock(&queue->q_mutex);
+            return -1;
+        }
+    }
+
+    size_t count = queue->q_completion_count;
+    if (count > max) {
+        count = max;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        completions[i] = queue->q_completions[queue->q_completion_head];
+        queue->q_completion_head =
+            (queue->q_completion_head + 1) % queue->q_entries;
+    }
+    queue->q_completion_count -= count;
+    queue->q_outstanding -= count;
+
+    if (pthread_mutex_unlock(&queue->q_mutex)) {
+        return -1;
+    }
+
+    return (ssize_t)count;
+}
+
+/* Clones a file (see tfs_clone), within a journal handle */
+static int clone_file(char const *source_path, char const *dest_path) {
+    int src = tfs_lookup(source_path);
+    if (src == -1) {
+        return -1;
+    }
+
+    int dst = tfs_create(dest_path, T_FILE, 0);
+    if (dst == -1) {
+        return -1;
+    }
+
+    /* Clone the files with any buffered writes applied */
+    if (flush_file_buffers(src) == -1 || flush_file_buffers(dst) == -1) {
+        return -1;
+    }
+
+    return inode_clone(src, dst);
+}
+
+int tfs_clone(char const *source_path, char const *dest_path) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = clone_file(source_path, dest_path);
+    journal_stop(jn);
+    if (result == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Copies a host file into a new file (see tfs_copy_from_external_fs), within
+ * a journal handle */
+static int copy_from_external(char const *source_path, char const *dest_path) {
+    int src = open(source_path, O_RDONLY);
+    if (src == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(src, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (size_t)st.st_size > MAX_FILE_SIZE) {
+        close(src);
+        return -1;
+    }
+
+    /* Map the source file, so that it is copied straight into the blocks */
+    size_t size = (size_t)st.st_size;
+    void *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src, 0);
+        if (data == MAP_FAILED) {
+            close(src);
+            return -1;
+        }
+    }
+
+    int result = -1;
+    int inum = tfs_create(dest_path, T_FILE, 0);
+    if (inum != -1 && flush_file_buffers(inum) != -1) {
+        result = inode_replace_data(inum, data, size);
+    }
+
+    if (size > 0 && munmap(data, size) == -1) {
+        result = -1;
+    }
+
+    if (close(src) == -1) {
+        result = -1;
+    }
+
+    return result;
+}
+
+int tfs_copy_from_external_fs(char const *source_path,
+                              char const *dest_path) {
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    int result = copy_from_external(source_path, dest_path);
+    journal_stop(jn);
+    if (result == -1 || journal_sync(jn) == -1) {
+        return -1;
+    }
+
+    return 0;
 }
 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
-    /* Open the source file */
-    int fd = tfs_open(source_path, 0);
+    journal_t *jn = state_journal();
+    /* Look for the source file, and apply any buffered writes to it */
+    journal_start(jn);
+    int inum = tfs_lookup(source_path);
+    int flushed = inum == -1 ? -1 : flush_file_buffers(inum);
+    journal_stop(jn);
+    if (flushed == -1) {
+        return -1;
+    }
+
+    int dst = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst == -1) {
+        return -1;
+    }
+
+    /* Write the data straight from the blocks */
+    int result = inode_export(inum, dst);
+
+    if (close(dst) == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/* A range of a file, handled by a bulk operation */
+typedef struct {
+    int rt_inumber;
+    int rt_fd; // host file descriptor, if any
+    size_t rt_offset;
+    size_t rt_len;
+} range_task_t;
+
+/* Ranges handled by a bulk operation, shared by its workers */
+typedef struct {
+    tfs_t *rp_fs; // instance the files are in
+    range_task_t *rp_tasks;
+    size_t rp_count;
+    ssize_t (*rp_handle)(range_task_t const *); // -1 if the range failed
+    atomic_size_t rp_next; // first range no worker has taken yet
+    atomic_size_t rp_total; // sum of the results of the ranges handled
+    atomic_bool rp_failed;
+} range_pool_t;
+
+/*
+ * Initializes a pool of ranges.
+ * Inputs:
+ *  - pool: the pool
+ *  - handle: function handling each range
+ */
+static void range_pool_init(range_pool_t *pool,
+                            ssize_t (*handle)(range_task_t const *)) {
+    pool->rp_fs = state_current();
+    pool->rp_tasks = NULL;
+    pool->rp_count = 0;
+    pool->rp_handle = handle;
+    atomic_init(&pool->rp_next, 0);
+    atomic_init(&pool->rp_total, 0);
+    atomic_init(&pool->rp_failed, false);
+}
+
+/*
+ * Splits a file into ranges of at most BULK_RANGE_SIZE bytes, and adds them
+ * to a pool.
+ * Inputs:
+ *  - pool: the pool
+ *  - inumber: i-node of the file
+ *  - fd: host file descriptor to go with the ranges
+ *  - size: the file's size
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int range_pool_add(range_pool_t *pool, int inumber, int fd,
+                          size_t size) {
+    size_t count = (size + BULK_RANGE_SIZE - 1) / BULK_RANGE_SIZE;
+    if (count == 0) {
+        return 0;
+    }
+
+    range_task_t *tasks =
+        realloc(pool->rp_tasks, (pool->rp_count + count) * sizeof(*tasks));
+    if (tasks == NULL) {
+        return -1;
+    }
+    pool->rp_tasks = tasks;
+
+    for (size_t i = 0; i < count; i++) {
+        pool->rp_tasks[pool->rp_count++] =
+            (range_task_t){.rt_inumber = inumber,
+                           .rt_fd = fd,
+                           .rt_offset = i * BULK_RANGE_SIZE,
+                           .rt_len = BULK_RANGE_SIZE};
+    }
+
+    return 0;
+}
+
+/* Bulk operation worker: handles ranges until there are none left */
+static void *range_worker(void *arg) {
+    range_pool_t *pool = arg;
+    state_select(pool->rp_fs);
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&pool->rp_next, 1);
+        if (i >= pool->rp_count) {
+            break;
+        }
+
+        ssize_t result = pool->rp_handle(&pool->rp_tasks[i]);
+        if (result == -1) {
+            atomic_store(&pool->rp_failed, true);
+        } else {
+            atomic_fetch_add(&pool->rp_total, (size_t)result);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Handles the ranges of a pool with worker threads, which take the ranges
+ * from the pool as each finishes its previous one, and frees the ranges.
+ * Inputs:
+ *  - pool: the pool
+ *  - nthreads: maximum number of workers
+ * Returns the sum of the results of the ranges, or -1 if any failed.
+ */
+static ssize_t range_pool_run(range_pool_t *pool, size_t nthreads) {
+    /* No more workers than there are ranges */
+    pthread_t workers[BULK_MAX_THREADS];
+    size_t started = 0;
+    if (nthreads > pool->rp_count) {
+        nthreads = pool->rp_count;
+    }
+    if (nthreads > BULK_MAX_THREADS) {
+        nthreads = BULK_MAX_THREADS;
+    }
+    for (; started < nthreads; started++) {
+        if (pthread_create(&workers[started], NULL, range_worker, pool) != 0) {
+            break;
+        }
+    }
+
+    if (started == 0 && nthreads > 0) {
+        /* No worker could be started: handle the ranges from this thread */
+        range_worker(pool);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(pool->rp_tasks);
+    pool->rp_tasks = NULL;
+    pool->rp_count = 0;
+
+    if (atomic_load(&pool->rp_failed)) {
+        return -1;
+    }
+
+    return (ssize_t)atomic_load(&pool->rp_total);
+}
+
+static ssize_t export_range(range_task_t const *task) {
+    return inode_export_at(task->rt_inumber, task->rt_fd, task->rt_offset,
+                           task->rt_len);
+}
+
+/*
+ * Checks if a file name names a file within a host directory: it is neither
+ * "." nor "..", and has no '/'.
+ * Input:
+ *  - name: the file name (MAX_FILE_NAME bytes at most)
+ */
+static bool host_file_name(char const *name) {
+    size_t len = strnlen(name, MAX_FILE_NAME);
+    return len > 0 && memchr(name, '/', len) == NULL &&
+           !(len == 1 && name[0] == '.') &&
+           !(len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/*
+ * Creates the host file a TecnicoFS file is exported to, and adds the file's
+ * ranges to the export.
+ * Inputs:
+ *  - host_dir: destination directory
+ *  - entry: directory entry of the file
+ *  - pool: ranges to export
+ * Returns the host file descriptor, or -1 if the operation failed (or the
+ * file's name would name a host file outside the directory).
+ */
+static int export_prepare(char const *host_dir, dir_entry_t const *entry,
+                          range_pool_t *pool) {
+    if (!host_file_name(entry->d_name) ||
+        flush_file_buffers(entry->d_inumber) == -1) {
+        return -1;
+    }
+
+    ssize_t size = inode_size(entry->d_inumber);
+    if (size == -1) {
+        return -1;
+    }
+
+    size_t path_len = strlen(host_dir) + MAX_FILE_NAME + 2;
+    char *path = malloc(path_len);
+    if (path == NULL) {
+        return -1;
+    }
+    snprintf(path, path_len, "%s/%.*s", host_dir, MAX_FILE_NAME,
+             entry->d_name);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    free(path);
     if (fd == -1) {
         return -1;
     }
 
-    FILE *dst = fopen(dest_path, "w");
-    if (dst == NULL) {
-        tfs_close(fd);
+    /* Size the host file first, as the ranges may be written in any order */
+    if (ftruncate(fd, size) == -1 ||
+        range_pool_add(pool, entry->d_inumber, fd, (size_t)size) == -1) {
+        close(fd);
         return -1;
     }
 
-    /* Read blocks until EOF */
-    char buf[BLOCK_SIZE];
-    ssize_t read;
-    while ((read = tfs_read(fd, buf, BLOCK_SIZE)) > 0) {
-        /* Write the block to the external file */
-        if (fwrite(buf, 1, (size_t)read, dst) != read) {
-            tfs_close(fd);
-            fclose(dst);
+    return fd;
+}
+
+int tfs_export_all(char const *host_dir, size_t nthreads) {
+    if (nthreads == 0 || nthreads > BULK_MAX_THREADS) {
+        return -1;
+    }
+
+    dir_entry_t entries[MAX_DIR_ENTRIES];
+    int entry_count = list_dir(ROOT_DIR_INUM, entries);
+    if (entry_count == -1) {
+        return -1;
+    }
+
+    /* Create the host files and split the files into ranges */
+    int fds[MAX_DIR_ENTRIES];
+    range_pool_t pool;
+    range_pool_init(&pool, export_range);
+
+    int result = 0;
+    int opened = 0;
+    journal_t *jn = state_journal();
+    journal_start(jn);
+    for (; opened < entry_count; opened++) {
+        fds[opened] = export_prepare(host_dir, &entries[opened], &pool);
+        if (fds[opened] == -1) {
+            result = -1;
+            break;
+        }
+    }
+    journal_stop(jn);
+
+    if (result == 0) {
+        result = range_pool_run(&pool, nthreads) == -1 ? -1 : 0;
+    }
+
+    for (int i = 0; i < opened; i++) {
+        if (close(fds[i]) == -1) {
+            result = -1;
+        }
+    }
+
+    free(pool.rp_tasks);
+    return result;
+}
+
+static ssize_t verify_range(range_task_t const *task) {
+    return inode_verify(task->rt_inumber, task->rt_offset, task->rt_len);
+}
+
+ssize_t tfs_verify(size_t nthreads) {
+    if (nthreads == 0 || nthreads > BULK_MAX_THREADS) {
+        return -1;
+    }
+
+    dir_entry_t entries[MAX_DIR_ENTRIES];
+    int entry_count = list_dir(ROOT_DIR_INUM, entries);
+    if (entry_count == -1) {
+        return -1;
+    }
+
+    range_pool_t pool;
+    range_pool_init(&pool, verify_range);
+    for (int i = 0; i < entry_count; i++) {
+        ssize_t size = inode_size(entries[i].d_inumber);
+        if (size == -1 ||
+            range_pool_add(&pool, entries[i].d_inumber, -1, (size_t)size) ==
+                -1) {
+            free(pool.rp_tasks);
             return -1;
         }
     }
 
-    if (fclose(dst)) {
-        tfs_close(fd);
+    return range_pool_run(&pool, nthreads);
+}
+
+int tfs_checkpoint(char const *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
         return -1;
     }
 
-    if (read == -1) {
-        tfs_close(fd);
+    int result = state_checkpoint(fd);
+
+    if (close(fd) == -1) {
         return -1;
     }
 
-    return tfs_close(fd);
+    return result;
+}
+
+int tfs_restore(char const *image_path, char const *const *checkpoint_paths,
+                size_t count) {
+    return state_restore(image_path, checkpoint_paths, count);
+}
+
+tfs_t *tfs_instance_create() { return state_create(); }
+
+void tfs_instance_free(tfs_t *fs) { state_free(fs); }
+
+int tfs_init_r(tfs_t *fs) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_init();
+    state_select(previous);
+    return result;
+}
+
+int tfs_init_flags_r(tfs_t *fs, int flags) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_init_flags(flags);
+    state_select(previous);
+    return result;
+}
+
+int tfs_init_image_r(tfs_t *fs, char const *image_path, int flags) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_init_image(image_path, flags);
+    state_select(previous);
+    return result;
+}
+
+int tfs_init_with_params_r(tfs_t *fs, tfs_params_t const *params) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_init_with_params(params);
+    state_select(previous);
+    return result;
+}
+
+int tfs_destroy_r(tfs_t *fs) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_destroy();
+    state_select(previous);
+    return result;
+}
+
+int tfs_destroy_after_all_closed_r(tfs_t *fs) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_destroy_after_all_closed();
+    state_select(previous);
+    return result;
+}
+
+int tfs_lookup_r(tfs_t *fs, char const *name) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_lookup(name);
+    state_select(previous);
+    return result;
+}
+
+int tfs_open_r(tfs_t *fs, char const *name, int flags) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_open(name, flags);
+    state_select(previous);
+    return result;
+}
+
+int tfs_close_r(tfs_t *fs, int fhandle) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_close(fhandle);
+    state_select(previous);
+    return result;
+}
+
+int tfs_fsync_r(tfs_t *fs, int fhandle) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_fsync(fhandle);
+    state_select(previous);
+    return result;
+}
+
+off_t tfs_lseek_r(tfs_t *fs, int fhandle, off_t offset, int whence) {
+    tfs_t *previous = state_select(fs);
+    off_t result = tfs_lseek(fhandle, offset, whence);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_write_r(tfs_t *fs, int fhandle, void const *buffer, size_t len) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_write(fhandle, buffer, len);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_read_r(tfs_t *fs, int fhandle, void *buffer, size_t len) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_read(fhandle, buffer, len);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_writev_r(tfs_t *fs, int fhandle, struct iovec const *iov,
+                     int iovcnt) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_writev(fhandle, iov, iovcnt);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_readv_r(tfs_t *fs, int fhandle, struct iovec const *iov,
+                    int iovcnt) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_readv(fhandle, iov, iovcnt);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_pwrite_r(tfs_t *fs, int fhandle, void const *buffer, size_t len,
+                     size_t offset) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_pwrite(fhandle, buffer, len, offset);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_pread_r(tfs_t *fs, int fhandle, void *buffer, size_t len,
+                    size_t offset) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_pread(fhandle, buffer, len, offset);
+    state_select(previous);
+    return result;
+}
+
+int tfs_truncate_r(tfs_t *fs, char const *path, size_t len) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_truncate(path, len);
+    state_select(previous);
+    return result;
+}
+
+int tfs_ftruncate_r(tfs_t *fs, int fhandle, size_t len) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_ftruncate(fhandle, len);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_copy_file_range_r(tfs_t *fs, int src_fhandle, size_t src_offset,
+                              int dst_fhandle, size_t dst_offset, size_t len) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_copy_file_range(src_fhandle, src_offset, dst_fhandle,
+                                         dst_offset, len);
+    state_select(previous);
+    return result;
+}
+
+int tfs_read_map_r(tfs_t *fs, int fhandle, size_t offset, size_t len,
+                   file_map_t *map) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_read_map(fhandle, offset, len, map);
+    state_select(previous);
+    return result;
+}
+
+int tfs_read_unmap_r(tfs_t *fs, file_map_t *map) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_read_unmap(map);
+    state_select(previous);
+    return result;
+}
+
+tfs_queue_t *tfs_queue_create_r(tfs_t *fs, size_t entries, size_t workers) {
+    tfs_t *previous = state_select(fs);
+    tfs_queue_t *result = tfs_queue_create(entries, workers);
+    state_select(previous);
+    return result;
+}
+
+int tfs_clone_r(tfs_t *fs, char const *source_path, char const *dest_path) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_clone(source_path, dest_path);
+    state_select(previous);
+    return result;
+}
+
+int tfs_copy_to_external_fs_r(tfs_t *fs, char const *source_path,
+                              char const *dest_path) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_copy_to_external_fs(source_path, dest_path);
+    state_select(previous);
+    return result;
+}
+
+int tfs_copy_from_external_fs_r(tfs_t *fs, char const *source_path,
+                                char const *dest_path) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_copy_from_external_fs(source_path, dest_path);
+    state_select(previous);
+    return result;
+}
+
+int tfs_export_all_r(tfs_t *fs, char const *host_dir, size_t nthreads) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_export_all(host_dir, nthreads);
+    state_select(previous);
+    return result;
+}
+
+ssize_t tfs_verify_r(tfs_t *fs, size_t nthreads) {
+    tfs_t *previous = state_select(fs);
+    ssize_t result = tfs_verify(nthreads);
+    state_select(previous);
+    return result;
+}
+
+int tfs_checkpoint_r(tfs_t *fs, char const *path) {
+    tfs_t *previous = state_select(fs);
+    int result = tfs_checkpoint(path);
+    state_select(previous);
+    return result;
 }
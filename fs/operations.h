@@ -9,8 +9,48 @@ enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_BUFFERED = 0b1000,
+    TFS_O_COMPRESS = 0b10000,
 };
 
+/* Mount flags (see tfs_init_flags) */
+enum {
+    TFS_MOUNT_VERIFY = 0b1,
+    TFS_MOUNT_DEDUP = 0b10,
+};
+
+/* Operations that can be submitted to an asynchronous queue */
+typedef enum {
+    TFS_OP_OPEN,
+    TFS_OP_CLOSE,
+    TFS_OP_READ,
+    TFS_OP_WRITE,
+    TFS_OP_PREAD,
+    TFS_OP_PWRITE,
+} tfs_op_t;
+
+/* Request submitted to an asynchronous queue, with the arguments of the
+ * synchronous call it stands for (only those the operation uses are read) */
+typedef struct {
+    tfs_op_t rq_op;
+    char const *rq_name; // open
+    int rq_flags;        // open
+    int rq_fhandle;      // close, read and write
+    void *rq_buffer;     // read and write (only read from by writes)
+    size_t rq_len;       // read and write
+    size_t rq_offset;    // pread and pwrite
+    void *rq_user_data;  // passed back in the completion
+} tfs_request_t;
+
+/* Completion of a request, with the result the synchronous call would have
+ * returned */
+typedef struct {
+    void *cq_user_data;
+    ssize_t cq_result;
+} tfs_completion_t;
+
+typedef struct tfs_queue tfs_queue_t;
+
 /*
  * Initializes tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -18,7 +58,83 @@ enum {
 int tfs_init();
 
 /*
- * Destroy tecnicofs
+ * Initializes tecnicofs with mount flags
+ * Input:
+ *  - flags: can be a combination (with bitwise or) of the following flags:
+ *    - verify data blocks against their checksums whenever they are read
+ *      (TFS_MOUNT_VERIFY): reads of corrupted data fail
+ *    - deduplicate whole blocks written (TFS_MOUNT_DEDUP): a block written
+ *      with the same contents as a block already stored shares it, and a
+ *      block of zeros is left as a hole. Writes and appends of whole blocks
+ *      then lock the file exclusively, and replace the blocks they cover,
+ *      so a mapping of the file (see tfs_read_map) keeps the data it had.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_flags(int flags);
+
+/*
+ * Initializes tecnicofs on an image file on the host, which holds its whole
+ * state (superblock, i-node table, free maps and data blocks) and is mapped
+ * to memory: the state is used in place, and persists across restarts. It is
+ * loaded lazily, so starting takes the same time whatever the image holds:
+ * only its metadata is read right away, each data block is read when first
+ * accessed, and the readahead thread, when it has nothing else to do, loads
+ * the blocks in use not accessed yet in the background.
+ * The image is only written through a journal, kept in a file named after it
+ * with ".journal" appended: the changes to its metadata (free maps, i-nodes,
+ * directory entries and checksums) are committed to the journal atomically,
+ * after the data they refer to is written in place, and are replayed into
+ * the image when it is mounted again, so that a crash loses whole operations
+ * only. Creating, truncating and cloning files, and tfs_fsync, return once
+ * committed, concurrent calls sharing each commit and its flush to the host's
+ * storage; other changes are committed within JOURNAL_COMMIT_INTERVAL
+ * milliseconds. Blocks freed are only reused once that is committed.
+ * Input:
+ *  - image_path: path of the image file, created if it does not exist (or is
+ *    empty); an existing image must have been created with the same geometry
+ *    (the default one, see tfs_params_init)
+ *  - flags: mount flags (see tfs_init_flags)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_image(char const *image_path, int flags);
+
+/*
+ * Sets parameters to the defaults tfs_init, tfs_init_flags and tfs_init_image
+ * use (see config.h): the default geometry, no huge pages, the state in
+ * memory and no mount flags
+ * Input:
+ *  - params: the parameters to set
+ */
+void tfs_params_init(tfs_params_t *params);
+
+/*
+ * Initializes tecnicofs with the geometry and options chosen at run time,
+ * rather than the defaults: the number of data blocks, of i-nodes and of
+ * files open at a time size its tables when it starts, so one build can
+ * serve a small volume and a large one. The block size is fixed when
+ * tecnicofs is built (BLOCK_SIZE), as files and their buffers are laid out
+ * by it.
+ * Input:
+ *  - params: parameters set up with tfs_params_init, then changed:
+ *    - tp_block_size: must be BLOCK_SIZE
+ *    - tp_data_blocks, tp_inode_table_size and tp_max_open_files: at least 1
+ *      and at most INT_MAX each
+ *    - tp_delay: iterations spent simulating each access to storage
+ *    - tp_huge_pages: whether to keep the state, when in memory, in huge
+ *      pages of the host (IMAGE_HUGE_PAGE_SIZE), sparing TLB misses on large
+ *      volumes; it is kept in normal pages if the host has none to spare,
+ *      or if the system headers offer no way to ask for them (MAP_HUGETLB)
+ *    - tp_image_path: path of an image file to keep the state in (see
+ *      tfs_init_image), which must have been created with the same geometry,
+ *      or NULL to keep it in memory
+ *    - tp_flags: mount flags (see tfs_init_flags)
+ * Returns 0 if successful, -1 otherwise (invalid parameters included).
+ */
+int tfs_init_with_params(tfs_params_t const *params);
+
+/*
+ * Destroy tecnicofs, committing every change to its image (see
+ * tfs_init_image), if any, and writing it into the image itself
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
@@ -46,6 +162,14 @@ int tfs_lookup(char const *name);
  *    - append mode (TFS_O_APPEND)
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
+ *    - buffer small writes (TFS_O_BUFFERED): writes smaller than a block are
+ *      accumulated and only written to the file when a block is filled, the
+ *      file is closed or synced (tfs_fsync), or the file is accessed
+ *      otherwise; errors writing the buffer are reported by that call. It has
+ *      no effect in append mode.
+ *    - store the file's data compressed (TFS_O_COMPRESS), in chunks of
+ *      COMPRESS_CHUNK_BLOCKS blocks, each read as a whole; only applies if
+ *      the file is created. Compressed files cannot be mapped (tfs_read_map).
  */
 int tfs_open(char const *name, int flags);
 
@@ -56,6 +180,34 @@ int tfs_open(char const *name, int flags);
  */
 int tfs_close(int fhandle);
 
+/* Writes any data buffered by a file handle (see TFS_O_BUFFERED) to the file,
+ * and, on an image, waits until every change made so far is committed (see
+ * tfs_init_image)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/* Moves the offset of an open file; later reads and writes (except in append
+ * mode) start there. Writing past the end of file leaves a hole in between,
+ * which reads as zeros but takes up no data blocks.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset, relative to the reference point
+ * 	- reference point, one of:
+ * 	  - TFS_SEEK_SET: the start of the file
+ * 	  - TFS_SEEK_CUR: the current offset
+ * 	  - TFS_SEEK_END: the end of the file
+ * 	  - TFS_SEEK_DATA: the offset given (which must be within the file) is
+ * 	    moved to the next byte that holds data
+ * 	  - TFS_SEEK_HOLE: the offset given (which must be within the file) is
+ * 	    moved to the next byte in a hole, or to the end of the file
+ * 	Returns the new offset (at most the maximum file size), or -1 in case of
+ * 	error
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
 /* Writes to an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -77,6 +229,183 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes the contents of an I/O vector to an open file, starting at the
+ * current offset, as a single operation: no other write to the file is
+ * interleaved with it and no read observes it partially applied.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of buffers (with their lengths) to write, in order
+ * 	- number of elements in the array
+ * 	Returns the number of bytes that were written (can be lower than the
+ * 	total length if the maximum file size is exceeded), or -1 in case of
+ * 	error
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into the buffers of an I/O vector, starting at the
+ * current offset, as a single operation: the buffers are filled in order and
+ * the data read is not affected by concurrent writes.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of destination buffers (with their lengths)
+ * 	- number of elements in the array
+ * 	Returns the number of bytes that were copied from the file to the buffers
+ * 	(can be lower than the total length if the file size was reached), or -1
+ * 	in case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Writes to an open file, starting at the given offset, without using or
+ * changing the file's current offset. Unlike tfs_write, concurrent calls on
+ * the same file handle are not serialized by the handle.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file to start writing at (past the end of file, the
+ * 	  bytes in between are left as a hole)
+ * 	Returns the number of bytes that were written (can be lower than
+ * 	'len' if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at the given offset, without using or
+ * changing the file's current offset. Unlike tfs_read, concurrent calls on
+ * the same file handle are not serialized by the handle.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file to start reading at
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(can be lower than 'len' if the file size was reached), or -1 in case of
+ * error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Sets the size of a file: shrinking it frees the data blocks past the new
+ * size, and growing it leaves a hole, which reads as zeros.
+ * Input:
+ * 	- path name of the file
+ * 	- the new size (at most the maximum file size)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_truncate(char const *path, size_t len);
+
+/* Sets the size of an open file (see tfs_truncate), without changing the
+ * file handle's offset.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- the new size (at most the maximum file size)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ftruncate(int fhandle, size_t len);
+
+/* Copies a range of an open file into another open file (or into another,
+ * non-overlapping, range of the same file) without going through a buffer,
+ * and without using or changing the file handles' offsets. Whole blocks
+ * aligned in both files end up shared by them rather than copied (see
+ * tfs_clone).
+ * Input:
+ * 	- file handle to copy from (obtained from a previous call to tfs_open)
+ * 	- offset of the range in the file to copy from (at most its size)
+ * 	- file handle to copy to (obtained from a previous call to tfs_open)
+ * 	- offset to copy the range to (past the end of file, the bytes in
+ * 	  between are left as a hole)
+ * 	- length of the range
+ * 	Returns the number of bytes copied (can be lower than 'len' if the end
+ * 	of the file copied from or the maximum file size is reached), or -1 in
+ * 	case of error
+ */
+ssize_t tfs_copy_file_range(int src_fhandle, size_t src_offset,
+                            int dst_fhandle, size_t dst_offset, size_t len);
+
+/* Maps a range of an open file for reading without copying it: the spans
+ * of the mapping point directly into the file's data blocks, in order.
+ * The data stays valid until the mapping is released with tfs_read_unmap,
+ * as the file cannot be truncated (nor its blocks reused) meanwhile; a
+ * thread must therefore not truncate a file it holds a mapping of.
+ * Writes to the range are, however, visible through the mapping, except
+ * where they fill a hole (holes are mapped to a block of zeros shared by
+ * every file) or replace a block: a block shared with a clone is copied on
+ * write, and with TFS_MOUNT_DEDUP whole blocks written replace those they
+ * cover. The mapping keeps the originals until it is released.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset in the file of the first byte to map
+ * 	- number of bytes to map
+ * 	- mapping to fill in (spans can cover less than 'len' bytes if the file
+ * 	  size was reached)
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_read_map(int fhandle, size_t offset, size_t len, file_map_t *map);
+
+/* Releases a mapping obtained from a previous call to tfs_read_map.
+ * Input:
+ * 	- the mapping to release
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_read_unmap(file_map_t *map);
+
+/* Creates an asynchronous queue, whose requests are executed by a pool of
+ * worker threads, so that a single thread can keep many requests in flight.
+ * Requests are executed concurrently and in no particular order: a request
+ * that depends on another (e.g. a read on a file handle being opened) must
+ * only be submitted once the other is reaped.
+ * Input:
+ * 	- maximum number of requests submitted but not yet reaped (at most
+ * 	  QUEUE_MAX_ENTRIES)
+ * 	- number of worker threads (at most QUEUE_MAX_WORKERS)
+ * 	Returns the queue, or NULL in case of error
+ */
+tfs_queue_t *tfs_queue_create(size_t entries, size_t workers);
+
+/* Waits for the requests in a queue to be executed and destroys it; their
+ * completions are discarded. Must be called before tfs_destroy.
+ * Input:
+ * 	- the queue (obtained from a previous call to tfs_queue_create)
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_queue_destroy(tfs_queue_t *queue);
+
+/* Submits a batch of requests to a queue, without waiting for them
+ * Input:
+ * 	- the queue (obtained from a previous call to tfs_queue_create)
+ * 	- array of requests, which are copied (buffers and names must stay
+ * 	  valid until the request is reaped)
+ * 	- number of requests in the array
+ * 	Returns the number of requests submitted, from the start of the array
+ * 	(can be lower than 'count' if the queue is full), or -1 in case of error
+ */
+ssize_t tfs_submit(tfs_queue_t *queue, tfs_request_t const *requests,
+                   size_t count);
+
+/* Collects the completions of requests submitted to a queue, in the order
+ * they completed
+ * Input:
+ * 	- the queue (obtained from a previous call to tfs_queue_create)
+ * 	- array to store the completions in
+ * 	- maximum number of completions to collect
+ * 	- minimum number of completions to wait for (the wait ends early if no
+ * 	  other requests are in flight)
+ * 	Returns the number of completions collected, or -1 in case of error
+ */
+ssize_t tfs_reap(tfs_queue_t *queue, tfs_completion_t *completions, size_t max,
+                 size_t min);
+
+/* Makes a file a copy of another, without copying their data: both files
+ * share the data blocks until either is written, each block being copied
+ * (into the file written) by the first write to it. A thread must not write
+ * to a cloned file it holds a read mapping of. The copy is compressed if the
+ * source is (see TFS_O_COMPRESS).
+ * Input:
+ * 	- path name of the source file
+ * 	- path name of the destination file, which is created if needed, and
+ * 	  overwritten if it already exists
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_clone(char const *source_path, char const *dest_path);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Returns 0 if successful, -1 otherwise.
@@ -88,4 +417,127 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to the contents of a file in TecnicoFS, in bulk: the data blocks
+ * are allocated at once, and the data copied straight into them.
+ * Input:
+ * 	- path name of the source file (in the main file system), which must fit
+ * 	  in a TecnicoFS file
+ * 	- path name of the destination file (from TecnicoFS), which is created
+ * 	  if needed, and overwritten if it already exists
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Copies every file in TecnicoFS into a directory of the OS' file system tree
+ * (outside TecnicoFS), in parallel. Files are split into ranges, which a pool
+ * of worker threads takes from a shared list as each finishes its previous
+ * one, so a large file is exported by every worker instead of stalling one.
+ * Each range is a consistent snapshot, but the export as a whole is not.
+ * Input:
+ * 	- path name of the destination directory (in the main file system),
+ * 	  which must exist; files in it are created if needed, and overwritten
+ * 	  if they already exist
+ * 	- number of worker threads, from 1 to BULK_MAX_THREADS
+ * 	Returns 0 if successful, -1 otherwise (including if a file's name, such
+ * 	as "..", would name a host file outside the directory).
+ */
+int tfs_export_all(char const *host_dir, size_t nthreads);
+
+/* Checks every data block of every file against its checksum (a CRC32C kept
+ * up to date by every write), in parallel, like tfs_export_all.
+ * Input:
+ * 	- number of worker threads, from 1 to BULK_MAX_THREADS
+ * 	Returns the number of corrupted blocks found (a block shared by several
+ * 	files counting once per file), or -1 in case of error.
+ */
+ssize_t tfs_verify(size_t nthreads);
+
+/* Writes an incremental checkpoint of TecnicoFS to a file in the OS' file
+ * system tree (outside TecnicoFS): only the files' blocks and i-nodes changed
+ * since the previous checkpoint (or, for the first one since tfs_init, every
+ * one), and the block maps. It is a point-in-time copy: operations wait while
+ * the changes are copied, but not while the file is written. Writes still
+ * buffered by open files (see TFS_O_BUFFERED) are not in it.
+ * Input:
+ * 	- path name of the checkpoint file (in the main file system), which is
+ * 	  created if needed, and overwritten if it already exists
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_checkpoint(char const *path);
+
+/* Rebuilds TecnicoFS, as of the last of a chain of checkpoints (see
+ * tfs_checkpoint), into an image file (see tfs_init_image). TecnicoFS need not
+ * be initialized, but the image must not be in use.
+ * Input:
+ * 	- path name of the image file (in the main file system), which is
+ * 	  created if needed, and overwritten if it already exists
+ * 	- path names of the checkpoint files, in the order they were written,
+ * 	  starting with the first one since tfs_init
+ * 	- number of checkpoint files
+ * 	Returns 0 if successful, -1 if a checkpoint cannot be read, is corrupted
+ * 	or does not follow the one before it, or the image cannot be written.
+ */
+int tfs_restore(char const *image_path, char const *const *checkpoint_paths,
+                size_t count);
+
+/*
+ * Creates a TecnicoFS instance: a file system of its own, sharing no state
+ * (and no lock) with the others in the process, so that each tenant, or
+ * test, can have one. It is used through the functions with an _r suffix,
+ * which take it first and otherwise behave as the ones without it, starting
+ * with an initialization (tfs_init_r and the like). The functions without
+ * the suffix use the default instance, which always exists (and which the
+ * ones with it use when given NULL). File handles, queues and read mappings
+ * belong to the instance they were obtained from.
+ * Returns the instance if successful, NULL otherwise.
+ */
+tfs_t *tfs_instance_create();
+
+/*
+ * Frees an instance created by tfs_instance_create, which must have been
+ * destroyed (tfs_destroy_r) if it was initialized
+ * Input:
+ *  - fs: the instance
+ */
+void tfs_instance_free(tfs_t *fs);
+
+int tfs_init_r(tfs_t *fs);
+int tfs_init_flags_r(tfs_t *fs, int flags);
+int tfs_init_image_r(tfs_t *fs, char const *image_path, int flags);
+int tfs_init_with_params_r(tfs_t *fs, tfs_params_t const *params);
+int tfs_destroy_r(tfs_t *fs);
+int tfs_destroy_after_all_closed_r(tfs_t *fs);
+int tfs_lookup_r(tfs_t *fs, char const *name);
+int tfs_open_r(tfs_t *fs, char const *name, int flags);
+int tfs_close_r(tfs_t *fs, int fhandle);
+int tfs_fsync_r(tfs_t *fs, int fhandle);
+off_t tfs_lseek_r(tfs_t *fs, int fhandle, off_t offset, int whence);
+ssize_t tfs_write_r(tfs_t *fs, int fhandle, void const *buffer, size_t len);
+ssize_t tfs_read_r(tfs_t *fs, int fhandle, void *buffer, size_t len);
+ssize_t tfs_writev_r(tfs_t *fs, int fhandle, struct iovec const *iov,
+                     int iovcnt);
+ssize_t tfs_readv_r(tfs_t *fs, int fhandle, struct iovec const *iov,
+                    int iovcnt);
+ssize_t tfs_pwrite_r(tfs_t *fs, int fhandle, void const *buffer, size_t len,
+                     size_t offset);
+ssize_t tfs_pread_r(tfs_t *fs, int fhandle, void *buffer, size_t len,
+                    size_t offset);
+int tfs_truncate_r(tfs_t *fs, char const *path, size_t len);
+int tfs_ftruncate_r(tfs_t *fs, int fhandle, size_t len);
+ssize_t tfs_copy_file_range_r(tfs_t *fs, int src_fhandle, size_t src_offset,
+                              int dst_fhandle, size_t dst_offset, size_t len);
+int tfs_read_map_r(tfs_t *fs, int fhandle, size_t offset, size_t len,
+                   file_map_t *map);
+int tfs_read_unmap_r(tfs_t *fs, file_map_t *map);
+tfs_queue_t *tfs_queue_create_r(tfs_t *fs, size_t entries, size_t workers);
+int tfs_clone_r(tfs_t *fs, char const *source_path, char const *dest_path);
+int tfs_copy_to_external_fs_r(tfs_t *fs, char const *source_path,
+                              char const *dest_path);
+int tfs_copy_from_external_fs_r(tfs_t *fs, char const *source_path,
+                                char const *dest_path);
+int tfs_export_all_r(tfs_t *fs, char const *host_dir, size_t nthreads);
+ssize_t tfs_verify_r(tfs_t *fs, size_t nthreads);
+int tfs_checkpoint_r(tfs_t *fs, char const *path);
+
 #endif // OPERATIONS_H
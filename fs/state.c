@@ -1,46 +1,290 @@
 #include "state.h"
-
+#include "journal.h"
+#include "kernels.h"
+#include "lz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+/* Persistent FS state: kept in primary memory, or mapped from an image file
+ * on the host (see state_init), laid out as follows. Changes mark the
+ * metadata (image_logged) and data (image_written) they touch, so that an
+ * image journals them (see journal.c) and checkpoints only hold the blocks and
+ * i-nodes changed (see state_checkpoint). */
 
-/* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
-static char free_inode_ts[INODE_TABLE_SIZE];
+#define IMAGE_MAGIC (0x6567616d69736674) // "tfsimage", little-endian
+#define IMAGE_VERSION (1)
+#define CHECKPOINT_MAGIC (0x6b63656863736674) // "tfscheck", little-endian
 
-/* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
+/*
+ * Superblock: identifies an image and the geometry it was created with, which
+ * must be the file system's (see state_init)
+ */
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_block_size;
+    uint32_t sb_data_blocks;
+    uint32_t sb_inode_table_size;
+    uint64_t sb_image_size;
+} superblock_t;
 
-/* Volatile FS state */
+/*
+ * Layout of the state for a geometry: the superblock, followed by the tables
+ * at these offsets (in this order, each aligned for its elements) and by the
+ * data blocks, page aligned
+ */
+typedef struct {
+    size_t il_data_blocks;
+    size_t il_inode_table_size;
+    size_t il_inode_table;
+    size_t il_free_inode_ts;
+    size_t il_free_blocks;
+    size_t il_block_refs;
+    size_t il_block_crc;
+    size_t il_block_crc_valid;
+    size_t il_dedup_buckets; // one bucket per data block
+    size_t il_dedup_next;
+    size_t il_block_indexed;
+    size_t il_data;
+    size_t il_size;
+} image_layout_t;
+
+#define IMAGE_PAGE_SIZE (4096)
 
-/* Open file table */
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
-static int open_file_count;
+/*
+ * Checkpoint file: a header, followed by the records of the i-nodes changed
+ * since the checkpoint before it, the block maps (the image from
+ * il_free_blocks up to the data) and the records of the data blocks changed
+ */
+typedef struct {
+    uint64_t ck_magic;
+    superblock_t ck_super; // geometry of the volume
+    uint64_t ck_volume;    // chain of checkpoints it belongs to
+    uint64_t ck_seq;       // position in the chain, from 1 (which is full)
+    uint64_t ck_inodes;    // i-node records
+    uint64_t ck_blocks;    // data block records
+    uint32_t ck_crc;       // CRC32C of everything after the header
+    uint32_t ck_unused;
+} checkpoint_header_t;
+
+typedef struct {
+    uint64_t ci_inumber;
+    uint64_t ci_state; // FREE or TAKEN
+    inode_t ci_inode;
+} checkpoint_inode_t;
+
+typedef struct {
+    uint64_t cb_block;
+    char cb_data[BLOCK_SIZE];
+} checkpoint_block_t;
+
+/* Block maps of a layout, as a checkpoint holds them */
+#define CHECKPOINT_MAPS_OFFSET(il) ((il)->il_free_blocks)
+#define CHECKPOINT_MAPS_SIZE(il) ((il)->il_data - (il)->il_free_blocks)
+
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
+/* Block ranges locked within an i-node (see inode_range_lock) */
+typedef struct range_lock {
+    size_t rl_first;
+    size_t rl_last;
+    bool rl_exclusive;
+    struct range_lock *rl_next;
+} range_lock_t;
+
+/* Readahead requests, served by a helper thread */
+typedef struct {
+    int rr_inumber;
+    size_t rr_first;
+    size_t rr_count;
+} readahead_request_t;
+
+/* Contents of every hole, and their checksum */
+static char const zero_block[BLOCK_SIZE];
+static uint32_t zero_block_crc;
+
+/* Setup shared by every instance, done by the first to be initialized */
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
 
-/* Mutexes and rwlocks */
-static pthread_rwlock_t inode_lock_table[INODE_TABLE_SIZE];
-static pthread_mutex_t inode_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t data_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t open_file_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t open_file_table_cond = PTHREAD_COND_INITIALIZER;
+/*
+ * File system instance: the whole state of one file system, which shares
+ * nothing (locks included) with the others in the process
+ */
+struct tfs {
+    /* Geometry of the file system (see state_init) */
+    size_t data_blocks;
+    size_t inode_table_size;
+    size_t max_open_files;
+    int storage_delay;
+
+    image_layout_t layout; // of the state in use
+    char *image;           // the state in use
+    int image_fd;          // the image file, if mapped
+    bool image_huge;       // whether it is in huge pages, if not mapped
+    journal_t *journal;    // of the image file, if mapped
+
+    /* I-node table */
+    inode_t *inode_table;
+    char *free_inode_ts;
+
+    /* Data blocks */
+    char *fs_data;
+    char *free_blocks;
+    int *block_refs; // i-nodes sharing each taken block
+
+    /* Checksums of the files' data blocks: the CRC32C of each block (if it
+     * has one), and, as appends write to parts of a block concurrently, the
+     * writes in progress and completed on each block (see data_block_verify)
+     */
+    uint32_t *block_crc;
+    bool *block_crc_valid;
+    atomic_uint *block_crc_writers;
+    atomic_uint *block_crc_gen;
+    bool verify_reads; // verify blocks against their checksums on reads
+
+    /* Deduplication of whole blocks written (if enabled): blocks indexed by
+     * checksum, in chains per bucket (see dedup_find). An indexed block holds
+     * a reference of its own, so it is shared, and thus never written in
+     * place. */
+    bool dedup_writes;
+    int *dedup_buckets;  // first block in each chain
+    int *dedup_next;     // next block in the same chain
+    bool *block_indexed; // also guarded by the blocks mutex
+    pthread_mutex_t dedup_mutex[DEDUP_LOCKS];
+
+    /* Blocks whose last reference was dropped, by the journal transaction
+     * that dropped it (0 if none): they are only freed once it commits, so
+     * that no block a committed file still refers to is written over before
+     * then. They are queued as dropped, and so by transaction (a list linked
+     * through block_pending_next, -1 ended). All guarded by the blocks
+     * mutex. */
+    uint64_t *block_free_seq;
+    int *block_pending_next;
+    int blocks_pending_head;
+    int blocks_pending_tail;
+
+    /* Data blocks and i-nodes changed since the last checkpoint, as bitmaps:
+     * all of them after state_init, so that the first checkpoint of a chain
+     * (the one volume identifies) holds the whole volume */
+    _Atomic uint64_t *blocks_changed;
+    _Atomic uint64_t *inodes_changed;
+    uint64_t checkpoint_volume;
+    uint64_t checkpoint_seq; // checkpoints taken in the chain
+    pthread_mutex_t checkpoint_mutex;
+
+    /* Volatile FS state */
+
+    /* Open file table */
+    open_file_entry_t *open_file_table;
+    char *free_open_file_entries;
+    int open_file_count;
+
+    /* Mutexes and rwlocks */
+    pthread_rwlock_t *inode_lock_table;
+    pthread_mutex_t inode_table_mutex;
+    pthread_mutex_t data_blocks_mutex;
+    pthread_mutex_t open_file_table_mutex;
+    pthread_cond_t open_file_table_cond;
+
+    /* Number of open file handles with a write-back buffer, per i-node */
+    atomic_int *inode_buffered_count;
+
+    /* Number of read mappings pinning each i-node's data blocks, and the
+     * blocks replaced in the i-node meanwhile, released once it is unpinned
+     * (a list linked through block_deferred_next, -1 ended) */
+    int *inode_pin_count;
+    int *inode_deferred_blocks;
+    int *block_deferred_next;
+    pthread_mutex_t inode_pin_mutex;
+    pthread_cond_t inode_pin_cond;
+
+    /* Block ranges locked within each i-node */
+    range_lock_t **inode_ranges;
+    pthread_mutex_t *inode_range_mutex;
+    pthread_cond_t *inode_range_cond;
+
+    /* Appends in flight to each i-node (see inode_appendv): the end of the
+     * reserved bytes, the end of the bytes published in the file size
+     * (guarded by the range mutex) and the number of appenders */
+    atomic_size_t *inode_append_cursor;
+    size_t *inode_append_published;
+    atomic_int *inode_append_inflight;
+    pthread_cond_t *inode_append_cond;
+
+    /* Block cache: blocks already fetched by readahead, evicted in FIFO
+     * order */
+    atomic_bool *block_cached;
+    int block_cache_ring[BLOCK_CACHE_SIZE];
+    size_t block_cache_next;
+    pthread_mutex_t block_cache_mutex;
+
+    /* Readahead requests, and the helper thread serving them */
+    readahead_request_t readahead_queue[READAHEAD_QUEUE_SIZE];
+    size_t readahead_queue_head;
+    size_t readahead_queue_len;
+    bool readahead_stop;
+    bool readahead_running;
+    pthread_t readahead_tid;
+    pthread_mutex_t readahead_mutex;
+    pthread_cond_t readahead_cond;
+
+    /* Lazy loading of an image: the data blocks already loaded into memory
+     * (on their first access, or by the readahead thread), and the next block
+     * the readahead thread loads when idle (see image_prefetch) */
+    atomic_bool *block_loaded;
+    size_t image_prefetch_next;
+};
+
+/* The instance the global API works on */
+static tfs_t tfs_default = {
+    .data_blocks = DATA_BLOCKS,
+    .inode_table_size = INODE_TABLE_SIZE,
+    .max_open_files = MAX_OPEN_FILES,
+    .storage_delay = DELAY,
+    .image_fd = -1,
+    .checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .inode_table_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .data_blocks_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .open_file_table_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .open_file_table_cond = PTHREAD_COND_INITIALIZER,
+    .inode_pin_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .inode_pin_cond = PTHREAD_COND_INITIALIZER,
+    .block_cache_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .readahead_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .readahead_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* The instance the calling thread works on (see state_select): the default
+ * one, unless within a call on another */
+static _Thread_local tfs_t *fs = &tfs_default;
+
+static void *readahead_thread(void *arg);
+static void data_blocks_committed(void *arg, uint64_t seq);
 
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 && (size_t)inumber < fs->inode_table_size;
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && (size_t)block_number < fs->data_blocks;
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 && (size_t)file_handle < fs->max_open_files;
 }
 
 /**
@@ -65,838 +309,5119 @@ static void touch_all_memory() { __asm volatile("" : : : "memory"); }
  * latencies as if such data structures were really stored in secondary memory.
  */
 static void insert_delay() {
-    for (int i = 0; i < DELAY; i++) {
+    int delay = fs->storage_delay; // not reloaded after each touch_all_memory
+    for (int i = 0; i < delay; i++) {
         touch_all_memory();
     }
 }
 
+/* Sets a bit of a bitmap shared by threads */
+static void bitmap_set(_Atomic uint64_t *bits, size_t i) {
+    uint64_t bit = (uint64_t)1 << (i % 64);
+    if (!(atomic_load_explicit(&bits[i / 64], memory_order_relaxed) & bit)) {
+        atomic_fetch_or_explicit(&bits[i / 64], bit, memory_order_relaxed);
+    }
+}
+
+/* Marks the data blocks a range of the image lies in (if any) as changed */
+static void blocks_mark_changed(void const *addr, size_t len) {
+    char const *start = addr;
+    if (len == 0 || start < fs->fs_data ||
+        start >= fs->fs_data + (size_t)BLOCK_SIZE * fs->data_blocks) {
+        return;
+    }
+
+    size_t offset = (size_t)(start - fs->fs_data);
+    for (size_t b = offset / BLOCK_SIZE; b <= (offset + len - 1) / BLOCK_SIZE;
+         b++) {
+        bitmap_set(fs->blocks_changed, b);
+    }
+}
+
+/* Records a change to the image's metadata (see journal_log) */
+static void image_logged(void const *addr, size_t len) {
+    journal_log(fs->journal, addr, len);
+    blocks_mark_changed(addr, len);
+}
+
+/* Records a change to the image's data (see journal_data) */
+static void image_written(void const *addr, size_t len) {
+    journal_data(fs->journal, addr, len);
+    blocks_mark_changed(addr, len);
+}
+
+/* Rounds an offset up to a multiple of an alignment */
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
 /*
- * Initializes FS state
+ * Lays out the state for a geometry.
+ * Inputs:
+ *  - the layout
+ *  - number of data blocks and of i-nodes
  */
-int state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        free_inode_ts[i] = FREE;
-        if (pthread_rwlock_init(&inode_lock_table[i], NULL)) {
-            return -1;
-        }
+static void image_layout_init(image_layout_t *il, size_t blocks,
+                              size_t inodes) {
+    il->il_data_blocks = blocks;
+    il->il_inode_table_size = inodes;
+    il->il_inode_table = align_up(sizeof(superblock_t), _Alignof(inode_t));
+    il->il_free_inode_ts = il->il_inode_table + inodes * sizeof(inode_t);
+    il->il_free_blocks = il->il_free_inode_ts + inodes;
+    il->il_block_refs = align_up(il->il_free_blocks + blocks, _Alignof(int));
+    il->il_block_crc =
+        align_up(il->il_block_refs + blocks * sizeof(int), _Alignof(uint32_t));
+    il->il_block_crc_valid = il->il_block_crc + blocks * sizeof(uint32_t);
+    il->il_dedup_buckets = align_up(
+        il->il_block_crc_valid + blocks * sizeof(bool), _Alignof(int));
+    il->il_dedup_next = il->il_dedup_buckets + blocks * sizeof(int);
+    il->il_block_indexed = il->il_dedup_next + blocks * sizeof(int);
+    il->il_data = align_up(il->il_block_indexed + blocks * sizeof(bool),
+                           IMAGE_PAGE_SIZE);
+    il->il_size = align_up(il->il_data + blocks * BLOCK_SIZE, IMAGE_PAGE_SIZE);
+}
+
+/*
+ * Formats an image: every i-node and data block is free. The data blocks are
+ * not touched.
+ * Input:
+ *  - the image and its layout
+ */
+static void image_format(char *im, image_layout_t const *il) {
+    superblock_t *sb = (superblock_t *)im;
+    sb->sb_magic = IMAGE_MAGIC;
+    sb->sb_version = IMAGE_VERSION;
+    sb->sb_block_size = BLOCK_SIZE;
+    sb->sb_data_blocks = (uint32_t)il->il_data_blocks;
+    sb->sb_inode_table_size = (uint32_t)il->il_inode_table_size;
+    sb->sb_image_size = il->il_size;
+
+    memset(im + il->il_free_inode_ts, FREE, il->il_inode_table_size);
+    memset(im + il->il_free_blocks, FREE, il->il_data_blocks);
+    memset(im + il->il_block_crc_valid, false,
+           il->il_data_blocks * sizeof(bool));
+    memset(im + il->il_block_indexed, false,
+           il->il_data_blocks * sizeof(bool));
+    int *buckets = (int *)(im + il->il_dedup_buckets);
+    for (size_t i = 0; i < il->il_data_blocks; i++) {
+        buckets[i] = -1;
     }
+}
+
+/* Checks that a superblock is of an image with a layout's geometry */
+static bool superblock_valid(superblock_t const *sb, image_layout_t const *il) {
+    return sb->sb_magic == IMAGE_MAGIC && sb->sb_version == IMAGE_VERSION &&
+           sb->sb_block_size == BLOCK_SIZE &&
+           sb->sb_data_blocks == il->il_data_blocks &&
+           sb->sb_inode_table_size == il->il_inode_table_size &&
+           sb->sb_image_size == il->il_size;
+}
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+/* Returns the path of an image file's journal (to be freed), or NULL */
+static char *image_journal_path(char const *path) {
+    size_t len = strlen(path) + sizeof(".journal");
+    char *journal_path = malloc(len);
+    if (journal_path != NULL) {
+        snprintf(journal_path, len, "%s.journal", path);
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
-        if (pthread_mutex_init(&open_file_table[i].of_mutex, NULL)) {
-            return -1;
-        }
+    return journal_path;
+}
+
+/*
+ * Maps an image file, creating (and formatting) it if it is empty or does not
+ * exist, after replaying its journal (the file's path followed by
+ * ".journal") into it. The mapping is private: the file is only written
+ * through the journal. Only the pages of the file accessed are ever read.
+ * Input:
+ *  - path of the image file on the host
+ * Returns the image if successful, NULL if it cannot be mapped or was not
+ * created with the file system's geometry (see layout).
+ */
+static char *image_map(char const *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        return NULL;
     }
 
-    open_file_count = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
 
-    return 0;
-}
+    superblock_t sb;
+    bool created = st.st_size == 0;
+    if ((!created && ((size_t)st.st_size != fs->layout.il_size ||
+                      pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+                      !superblock_valid(&sb, &fs->layout))) ||
+        (created && ftruncate(fd, (off_t)fs->layout.il_size) == -1)) {
+        close(fd);
+        return NULL;
+    }
 
-int state_destroy() { /* nothing to do */
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (pthread_rwlock_destroy(&inode_lock_table[i])) {
-            return -1;
-        }
+    /* A journal left by an image since removed is not this image's */
+    char *journal_path = image_journal_path(path);
+    if (journal_path == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (created) {
+        unlink(journal_path);
+    }
+    fs->journal = journal_init(journal_path, fd, fs->layout.il_size);
+    free(journal_path);
+    if (fs->journal == NULL) {
+        close(fd);
+        return NULL;
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        if (pthread_mutex_destroy(&open_file_table[i].of_mutex)) {
-            return -1;
+    char *im = mmap(NULL, fs->layout.il_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+    if (im == MAP_FAILED) {
+        journal_destroy(fs->journal);
+        fs->journal = NULL;
+        close(fd);
+        return NULL;
+    }
+
+    /* The metadata is read at once; each data block, only when accessed (see
+     * image_prefetch), rather than with the blocks around it */
+    posix_madvise(im, fs->layout.il_data, POSIX_MADV_WILLNEED);
+    posix_madvise(im + fs->layout.il_data,
+                  fs->layout.il_size - fs->layout.il_data, POSIX_MADV_RANDOM);
+
+    /* The metadata of a new image is written out right away */
+    if (created) {
+        image_format(im, &fs->layout);
+        if (pwrite(fd, im, fs->layout.il_data, 0) !=
+                (ssize_t)fs->layout.il_data ||
+            fdatasync(fd) == -1) {
+            munmap(im, fs->layout.il_size);
+            journal_destroy(fs->journal);
+            fs->journal = NULL;
+            close(fd);
+            return NULL;
         }
     }
 
-    return 0;
+    fs->image_fd = fd;
+    return im;
 }
 
-int state_destroy_after_all_closed() {
-    if (pthread_mutex_lock(&open_file_table_mutex)) {
-        return -1;
+/*
+ * Allocates the state kept in memory, zeroed: in huge pages if asked to and
+ * the host has them to spare, or from the heap otherwise (always, if built
+ * without MAP_HUGETLB, e.g. under strict POSIX).
+ * Input:
+ *  - whether to use huge pages
+ * Returns the state if successful, NULL otherwise.
+ */
+static char *image_alloc(bool huge) {
+    (void)huge;
+    fs->image_huge = false;
+#if defined(MAP_ANONYMOUS) && defined(MAP_HUGETLB)
+    if (huge) {
+        char *im =
+            mmap(NULL, align_up(fs->layout.il_size, IMAGE_HUGE_PAGE_SIZE),
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (im != MAP_FAILED) {
+            fs->image_huge = true;
+            return im;
+        }
     }
+#endif
 
-    if (pthread_cond_wait(&open_file_table_cond, &open_file_table_mutex)) {
-        pthread_mutex_unlock(&open_file_table_mutex);
-        return -1;
+    char *im = aligned_alloc(IMAGE_PAGE_SIZE, fs->layout.il_size);
+    if (im != NULL) {
+        memset(im, 0, fs->layout.il_size);
+    }
+
+    return im;
+}
+
+/* Frees the state, mapped from an image file or allocated by image_alloc */
+static int image_free() {
+    int result = 0;
+    if (fs->image_fd != -1) {
+        if (munmap(fs->image, fs->layout.il_size) == -1 ||
+            close(fs->image_fd) == -1) {
+            result = -1;
+        }
+    } else if (fs->image_huge) {
+        if (munmap(fs->image,
+                   align_up(fs->layout.il_size, IMAGE_HUGE_PAGE_SIZE)) == -1) {
+            result = -1;
+        }
+    } else {
+        free(fs->image);
     }
 
-    if (pthread_mutex_unlock(&open_file_table_mutex)) {
+    fs->image = NULL;
+    fs->image_fd = -1;
+    fs->image_huge = false;
+    return result;
+}
+
+/* Allocates the volatile tables sized by the geometry, zeroed (see
+ * state_tables_free) */
+static int state_tables_alloc() {
+    size_t block_words = BITMAP_WORDS(fs->data_blocks);
+    size_t inode_words = BITMAP_WORDS(fs->inode_table_size);
+    fs->block_crc_writers =
+        calloc(fs->data_blocks, sizeof(*fs->block_crc_writers));
+    fs->block_crc_gen = calloc(fs->data_blocks, sizeof(*fs->block_crc_gen));
+    fs->block_free_seq = calloc(fs->data_blocks, sizeof(*fs->block_free_seq));
+    fs->block_pending_next =
+        calloc(fs->data_blocks, sizeof(*fs->block_pending_next));
+    fs->block_cached = calloc(fs->data_blocks, sizeof(*fs->block_cached));
+    fs->block_loaded = calloc(fs->data_blocks, sizeof(*fs->block_loaded));
+    fs->blocks_changed = calloc(block_words, sizeof(*fs->blocks_changed));
+    fs->inodes_changed = calloc(inode_words, sizeof(*fs->inodes_changed));
+    fs->open_file_table =
+        calloc(fs->max_open_files, sizeof(*fs->open_file_table));
+    fs->free_open_file_entries =
+        calloc(fs->max_open_files, sizeof(*fs->free_open_file_entries));
+    fs->inode_lock_table =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_lock_table));
+    fs->inode_buffered_count =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_buffered_count));
+    fs->inode_pin_count =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_pin_count));
+    fs->inode_deferred_blocks =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_deferred_blocks));
+    fs->block_deferred_next =
+        calloc(fs->data_blocks, sizeof(*fs->block_deferred_next));
+    fs->inode_ranges = calloc(fs->inode_table_size, sizeof(*fs->inode_ranges));
+    fs->inode_range_mutex =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_range_mutex));
+    fs->inode_range_cond =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_range_cond));
+    fs->inode_append_cursor =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_append_cursor));
+    fs->inode_append_published =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_append_published));
+    fs->inode_append_inflight =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_append_inflight));
+    fs->inode_append_cond =
+        calloc(fs->inode_table_size, sizeof(*fs->inode_append_cond));
+
+    if (fs->block_crc_writers == NULL || fs->block_crc_gen == NULL ||
+        fs->block_free_seq == NULL || fs->block_pending_next == NULL ||
+        fs->block_cached == NULL || fs->block_loaded == NULL ||
+        fs->blocks_changed == NULL || fs->inodes_changed == NULL ||
+        fs->open_file_table == NULL || fs->free_open_file_entries == NULL ||
+        fs->inode_lock_table == NULL ||
+        fs->inode_buffered_count == NULL || fs->inode_pin_count == NULL ||
+        fs->inode_deferred_blocks == NULL || fs->block_deferred_next == NULL ||
+        fs->inode_ranges == NULL || fs->inode_range_mutex == NULL ||
+        fs->inode_range_cond == NULL || fs->inode_append_cursor == NULL ||
+        fs->inode_append_published == NULL ||
+        fs->inode_append_inflight == NULL || fs->inode_append_cond == NULL) {
         return -1;
     }
 
-    state_destroy();
     return 0;
 }
 
+/* Frees the tables allocated by state_tables_alloc */
+static void state_tables_free() {
+    free(fs->block_crc_writers);
+    free(fs->block_crc_gen);
+    free(fs->block_free_seq);
+    free(fs->block_pending_next);
+    free(fs->block_cached);
+    free(fs->block_loaded);
+    free(fs->blocks_changed);
+    free(fs->inodes_changed);
+    free(fs->open_file_table);
+    free(fs->free_open_file_entries);
+    free(fs->inode_lock_table);
+    free(fs->inode_buffered_count);
+    free(fs->inode_pin_count);
+    free(fs->inode_deferred_blocks);
+    free(fs->block_deferred_next);
+    free(fs->inode_ranges);
+    free(fs->inode_range_mutex);
+    free(fs->inode_range_cond);
+    free(fs->inode_append_cursor);
+    free(fs->inode_append_published);
+    free(fs->inode_append_inflight);
+    free(fs->inode_append_cond);
+}
+
 /*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
+ * Creates a file system instance, not initialized yet (see state_init)
+ * Returns the instance if successful, NULL otherwise.
  */
-static int data_block_alloc() {
-    if (pthread_mutex_lock(&data_blocks_mutex)) {
-        return -1;
+tfs_t *state_create() {
+    tfs_t *instance = calloc(1, sizeof(*instance));
+    if (instance == NULL) {
+        return NULL;
     }
 
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    instance->data_blocks = DATA_BLOCKS;
+    instance->inode_table_size = INODE_TABLE_SIZE;
+    instance->max_open_files = MAX_OPEN_FILES;
+    instance->storage_delay = DELAY;
+    instance->image_fd = -1;
+    if (pthread_mutex_init(&instance->checkpoint_mutex, NULL) ||
+        pthread_mutex_init(&instance->inode_table_mutex, NULL) ||
+        pthread_mutex_init(&instance->data_blocks_mutex, NULL) ||
+        pthread_mutex_init(&instance->open_file_table_mutex, NULL) ||
+        pthread_cond_init(&instance->open_file_table_cond, NULL) ||
+        pthread_mutex_init(&instance->inode_pin_mutex, NULL) ||
+        pthread_cond_init(&instance->inode_pin_cond, NULL) ||
+        pthread_mutex_init(&instance->block_cache_mutex, NULL) ||
+        pthread_mutex_init(&instance->readahead_mutex, NULL) ||
+        pthread_cond_init(&instance->readahead_cond, NULL)) {
+        free(instance);
+        return NULL;
+    }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            if (pthread_mutex_unlock(&data_blocks_mutex)) {
-                return -1;
-            }
-            return i;
-        }
+    return instance;
+}
+
+/* Frees an instance created by state_create, destroyed (see state_destroy)
+ * if it was initialized */
+void state_free(tfs_t *instance) {
+    if (instance == NULL) {
+        return;
     }
+    pthread_mutex_destroy(&instance->checkpoint_mutex);
+    pthread_mutex_destroy(&instance->inode_table_mutex);
+    pthread_mutex_destroy(&instance->data_blocks_mutex);
+    pthread_mutex_destroy(&instance->open_file_table_mutex);
+    pthread_cond_destroy(&instance->open_file_table_cond);
+    pthread_mutex_destroy(&instance->inode_pin_mutex);
+    pthread_cond_destroy(&instance->inode_pin_cond);
+    pthread_mutex_destroy(&instance->block_cache_mutex);
+    pthread_mutex_destroy(&instance->readahead_mutex);
+    pthread_cond_destroy(&instance->readahead_cond);
+    free(instance);
+}
 
-    pthread_mutex_unlock(&data_blocks_mutex);
-    return -1;
+/*
+ * Selects the instance the calling thread works on: the one every other
+ * function here uses.
+ * Input:
+ *  - the instance, or NULL for the default one
+ * Returns the instance selected before.
+ */
+tfs_t *state_select(tfs_t *instance) {
+    tfs_t *previous = fs;
+    fs = instance != NULL ? instance : &tfs_default;
+    return previous;
 }
 
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
+/* Returns the instance the calling thread works on (see state_select) */
+tfs_t *state_current() { return fs; }
+
+/* Returns the journal of the instance the calling thread works on, or NULL
+ * if its state is not in an image */
+journal_t *state_journal() { return fs->journal; }
+
+/*
+ * Selects the block kernels and computes the checksum of zero_block, once
+ * per process: instances initialized later must not switch them under the
+ * ones already in use.
  */
-static int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
+static void state_init_once() {
+    kernels_init();
+    zero_block_crc = ~block_crc32c(~0u, zero_block, BLOCK_SIZE);
+}
+
+/*
+ * Initializes the locks of an i-node's entry: all of them, or none.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_locks_init(size_t inumber) {
+    if (pthread_rwlock_init(&fs->inode_lock_table[inumber], NULL)) {
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
-
-    if (pthread_mutex_lock(&data_blocks_mutex)) {
+    if (pthread_mutex_init(&fs->inode_range_mutex[inumber], NULL)) {
+        pthread_rwlock_destroy(&fs->inode_lock_table[inumber]);
         return -1;
     }
 
-    free_blocks[block_number] = FREE;
+    if (pthread_cond_init(&fs->inode_range_cond[inumber], NULL)) {
+        pthread_mutex_destroy(&fs->inode_range_mutex[inumber]);
+        pthread_rwlock_destroy(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
 
-    if (pthread_mutex_unlock(&data_blocks_mutex)) {
+    if (pthread_cond_init(&fs->inode_append_cond[inumber], NULL)) {
+        pthread_cond_destroy(&fs->inode_range_cond[inumber]);
+        pthread_mutex_destroy(&fs->inode_range_mutex[inumber]);
+        pthread_rwlock_destroy(&fs->inode_lock_table[inumber]);
         return -1;
     }
 
     return 0;
 }
 
-/* Returns a pointer to the contents of a given block
- * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+/*
+ * Undoes what a failed state_init did, so that it can be retried: destroys
+ * the locks initialized, closes the journal (stopping its helper thread), and
+ * frees the image and the tables.
+ * Inputs:
+ *  - number of i-node entries, deduplication locks and open file entries
+ *    whose locks were initialized
+ * Returns -1, for state_init to return.
  */
-static void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
+static int state_init_undo(size_t inodes, size_t dedup_locks, size_t files) {
+    for (size_t i = 0; i < files; i++) {
+        pthread_mutex_destroy(&fs->open_file_table[i].of_mutex);
+    }
+    for (size_t i = 0; i < dedup_locks; i++) {
+        pthread_mutex_destroy(&fs->dedup_mutex[i]);
+    }
+    for (size_t i = 0; i < inodes; i++) {
+        pthread_rwlock_destroy(&fs->inode_lock_table[i]);
+        pthread_mutex_destroy(&fs->inode_range_mutex[i]);
+        pthread_cond_destroy(&fs->inode_range_cond[i]);
+        pthread_cond_destroy(&fs->inode_append_cond[i]);
     }
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
+    journal_destroy(fs->journal);
+    fs->journal = NULL;
+    image_free();
+    state_tables_free();
+    return -1;
 }
 
 /*
- * Extends the i-node's data blocks by adding a new data block unsafely.
+ * Initializes FS state
  * Input:
- * - inumber: i-node's number
- *  Returns: the block number if successful, -1 if failed
+ *  - params: geometry of the file system, which sizes every table and the
+ *    data blocks, and where to keep the persistent state: in an image file
+ *    on the host (created if needed) if it has a path, or in memory, empty
+ *    (in huge pages if asked to)
+ *  - verify: whether reads verify data blocks against their checksums
+ *  - dedup: whether whole blocks written are deduplicated
  */
-static int inode_extend_unsafe(int inumber) {
-    if (!valid_inumber(inumber) || free_inode_ts[inumber] == FREE) {
+int state_init(tfs_params_t const *params, int verify, int dedup) {
+    if (params->tp_block_size != BLOCK_SIZE || params->tp_data_blocks == 0 ||
+        params->tp_data_blocks > INT_MAX || params->tp_inode_table_size == 0 ||
+        params->tp_inode_table_size > INT_MAX ||
+        params->tp_max_open_files == 0 ||
+        params->tp_max_open_files > INT_MAX || params->tp_delay < 0) {
         return -1;
     }
 
-    /* Allocates a new data block */
-    int b = data_block_alloc();
-    if (b == -1) {
+    if (pthread_once(&state_once, state_init_once)) {
         return -1;
     }
+    fs->verify_reads = verify != 0;
+    fs->dedup_writes = dedup != 0;
+
+    fs->data_blocks = params->tp_data_blocks;
+    fs->inode_table_size = params->tp_inode_table_size;
+    fs->max_open_files = params->tp_max_open_files;
+    fs->storage_delay = params->tp_delay;
+    image_layout_init(&fs->layout, fs->data_blocks, fs->inode_table_size);
+    if (state_tables_alloc() == -1) {
+        return state_init_undo(0, 0, 0);
+    }
 
-    if (inode_table[inumber].i_data_block_count < INODE_DIRECT_REFS) {
-        /* Add a direct reference to the block */
-        size_t bc = inode_table[inumber].i_data_block_count;
-        inode_table[inumber].i_data_block[bc] = b;
-    } else if (inode_table[inumber].i_data_block_count <
-               INODE_DIRECT_REFS + MAX_INDIRECT_REFS) {
-        /* Create the indirect reference block */
-        if (inode_table[inumber].i_data_block_count == INODE_DIRECT_REFS) {
-            inode_table[inumber].i_data_extension_block = data_block_alloc();
-            if (inode_table[inumber].i_data_extension_block == -1) {
-                data_block_free(b);
-                return -1;
-            }
+    if (params->tp_image_path == NULL) {
+        if ((fs->image = image_alloc(params->tp_huge_pages != 0)) == NULL) {
+            return state_init_undo(0, 0, 0);
         }
+        image_format(fs->image, &fs->layout);
+    } else if ((fs->image = image_map(params->tp_image_path)) == NULL) {
+        return state_init_undo(0, 0, 0);
+    }
 
-        /* Add a indirect reference to the block */
-        size_t bc = inode_table[inumber].i_data_block_count - INODE_DIRECT_REFS;
-        int *indirect_refs =
-            (int *)data_block_get(inode_table[inumber].i_data_extension_block);
-        if (indirect_refs == NULL) {
-            data_block_free(b);
-            return -1;
+    fs->inode_table = (inode_t *)(fs->image + fs->layout.il_inode_table);
+    fs->free_inode_ts = fs->image + fs->layout.il_free_inode_ts;
+    fs->fs_data = fs->image + fs->layout.il_data;
+    fs->free_blocks = fs->image + fs->layout.il_free_blocks;
+    fs->block_refs = (int *)(fs->image + fs->layout.il_block_refs);
+    fs->block_crc = (uint32_t *)(fs->image + fs->layout.il_block_crc);
+    fs->block_crc_valid = (bool *)(fs->image + fs->layout.il_block_crc_valid);
+    fs->dedup_buckets = (int *)(fs->image + fs->layout.il_dedup_buckets);
+    fs->dedup_next = (int *)(fs->image + fs->layout.il_dedup_next);
+    fs->block_indexed = (bool *)(fs->image + fs->layout.il_block_indexed);
+
+    if (fs->image_fd != -1) {
+        if (journal_enable(fs->journal, fs->image, data_blocks_committed, fs) ==
+            -1) {
+            return state_init_undo(0, 0, 0);
         }
 
-        indirect_refs[bc] = b;
-    } else {
-        data_block_free(b);
-        return -1;
+        /* Blocks pending reuse when the file system stopped are free */
+        for (size_t i = 0; i < fs->data_blocks; i++) {
+            if (fs->free_blocks[i] == TAKEN && fs->block_refs[i] == 0) {
+                fs->free_blocks[i] = FREE;
+                image_logged(&fs->free_blocks[i], sizeof(fs->free_blocks[i]));
+            }
+        }
     }
 
-    inode_table[inumber].i_data_block_count += 1;
-    return b;
-}
-
-/*
- * Creates a new i-node in the i-node table unsafely.
- * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
- */
-static int inode_create_unsafe(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    for (size_t i = 0; i < fs->inode_table_size; i++) {
+        /* Appends to the files in an image start at their end */
+        size_t size =
+            fs->free_inode_ts[i] == FREE ? 0 : fs->inode_table[i].i_size;
+        fs->inode_pin_count[i] = 0;
+        fs->inode_deferred_blocks[i] = -1;
+        atomic_init(&fs->inode_buffered_count[i], 0);
+        fs->inode_ranges[i] = NULL;
+        atomic_init(&fs->inode_append_cursor[i], size);
+        fs->inode_append_published[i] = size;
+        atomic_init(&fs->inode_append_inflight[i], 0);
+        if (inode_locks_init(i) == -1) {
+            return state_init_undo(i, 0, 0);
         }
+    }
 
-        /* Finds first free entry in i-node table */
-        if (free_inode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            free_inode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-            inode_table[inumber].i_size = 0;
-            inode_table[inumber].i_data_block_count = 0;
+    for (size_t i = 0; i < fs->data_blocks; i++) {
+        fs->block_free_seq[i] = 0;
+        atomic_init(&fs->block_cached[i], false);
+        atomic_init(&fs->block_loaded[i], false);
+        atomic_init(&fs->block_crc_writers[i], 0);
+        atomic_init(&fs->block_crc_gen[i], 0);
+    }
 
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its first block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = inode_extend_unsafe(inumber);
-                if (b == -1) {
-                    free_inode_ts[inumber] = FREE;
-                    return -1;
-                }
+    for (size_t i = 0; i < DEDUP_LOCKS; i++) {
+        if (pthread_mutex_init(&fs->dedup_mutex[i], NULL)) {
+            return state_init_undo(fs->inode_table_size, i, 0);
+        }
+    }
 
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    free_inode_ts[inumber] = FREE;
-                    return -1;
-                }
+    for (size_t i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        fs->block_cache_ring[i] = -1;
+    }
+    fs->block_cache_next = 0;
+    fs->blocks_pending_head = -1;
+    fs->blocks_pending_tail = -1;
+    fs->image_prefetch_next = fs->image_fd != -1 ? 0 : fs->data_blocks;
+
+    /* A new chain of checkpoints starts, from the whole volume */
+    for (size_t i = 0; i < BITMAP_WORDS(fs->data_blocks); i++) {
+        atomic_init(&fs->blocks_changed[i], ~(uint64_t)0);
+    }
+    for (size_t i = 0; i < BITMAP_WORDS(fs->inode_table_size); i++) {
+        atomic_init(&fs->inodes_changed[i], ~(uint64_t)0);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fs->checkpoint_volume = (uint64_t)now.tv_sec * 1000000000u +
+                        (uint64_t)now.tv_nsec + ((uint64_t)getpid() << 40);
+    fs->checkpoint_seq = 0;
+
+    for (size_t i = 0; i < fs->max_open_files; i++) {
+        fs->free_open_file_entries[i] = FREE;
+        if (pthread_mutex_init(&fs->open_file_table[i].of_mutex, NULL)) {
+            return state_init_undo(fs->inode_table_size, DEDUP_LOCKS, i);
+        }
+    }
 
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            }
+    fs->open_file_count = 0;
 
-            return inumber;
+    /* Start the readahead helper thread */
+    fs->readahead_queue_head = 0;
+    fs->readahead_queue_len = 0;
+    fs->readahead_stop = false;
+    if (!fs->readahead_running) {
+        if (pthread_create(&fs->readahead_tid, NULL, readahead_thread, fs)) {
+            return state_init_undo(fs->inode_table_size, DEDUP_LOCKS,
+                                   fs->max_open_files);
         }
+        fs->readahead_running = true;
     }
 
-    return -1;
+    return 0;
 }
 
-/*
- * Frees all data blocks of an i-node unsafely.
- * Input:
- * - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
- */
-static int inode_clear_unsafe(int inumber) {
-    if (free_inode_ts[inumber] == FREE) {
-        return -1;
-    }
+int state_destroy() {
+    /* Stop the readahead helper thread */
+    if (fs->readahead_running) {
+        if (pthread_mutex_lock(&fs->readahead_mutex)) {
+            return -1;
+        }
+        fs->readahead_stop = true;
+        pthread_cond_signal(&fs->readahead_cond);
+        pthread_mutex_unlock(&fs->readahead_mutex);
 
-    /* Free direct data blocks */
-    size_t i = 0;
-    while (i < inode_table[inumber].i_data_block_count &&
-           i < INODE_DIRECT_REFS) {
-        if (data_block_free(inode_table[inumber].i_data_block[i++]) == -1) {
+        if (pthread_join(fs->readahead_tid, NULL)) {
             return -1;
         }
+        fs->readahead_running = false;
     }
 
-    if (i < inode_table[inumber].i_data_block_count) {
-        /* Get indirect block */
-        int indirect_refs_block = inode_table[inumber].i_data_extension_block;
-        int *indirect_refs = (int *)data_block_get(indirect_refs_block);
-        if (indirect_refs == NULL) {
+    for (size_t i = 0; i < fs->inode_table_size; i++) {
+        if (pthread_rwlock_destroy(&fs->inode_lock_table[i]) ||
+            pthread_mutex_destroy(&fs->inode_range_mutex[i]) ||
+            pthread_cond_destroy(&fs->inode_range_cond[i]) ||
+            pthread_cond_destroy(&fs->inode_append_cond[i])) {
             return -1;
         }
+    }
 
-        /* Free all indirect references */
-        while (i < inode_table[inumber].i_data_block_count) {
-            if (i >= MAX_INDIRECT_REFS + INODE_DIRECT_REFS) {
-                return -1;
-            }
-
-            if (data_block_free(indirect_refs[i++ - INODE_DIRECT_REFS]) == -1) {
-                return -1;
-            }
+    for (size_t i = 0; i < fs->max_open_files; i++) {
+        if (pthread_mutex_destroy(&fs->open_file_table[i].of_mutex)) {
+            return -1;
         }
+    }
 
-        if (data_block_free(indirect_refs_block) == -1) {
+    for (size_t i = 0; i < DEDUP_LOCKS; i++) {
+        if (pthread_mutex_destroy(&fs->dedup_mutex[i])) {
             return -1;
         }
     }
 
-    inode_table[inumber].i_size = 0;
-    inode_table[inumber].i_data_block_count = 0;
+    /* Commit every change to the image before unmapping it */
+    int result = journal_destroy(fs->journal);
+    fs->journal = NULL;
+    if (image_free() == -1) {
+        result = -1;
+    }
+    state_tables_free();
 
-    return 0;
+    return result;
 }
 
-/*
- * Creates a new i-node in the i-node table.
- * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
- */
-int inode_create(inode_type n_type) {
-    if (pthread_mutex_lock(&inode_table_mutex)) {
+int state_destroy_after_all_closed() {
+    if (pthread_mutex_lock(&fs->open_file_table_mutex)) {
         return -1;
     }
 
-    int inumber = inode_create_unsafe(n_type);
+    if (pthread_cond_wait(&fs->open_file_table_cond,
+                          &fs->open_file_table_mutex)) {
+        pthread_mutex_unlock(&fs->open_file_table_mutex);
+        return -1;
+    }
 
-    if (pthread_mutex_unlock(&inode_table_mutex)) {
+    if (pthread_mutex_unlock(&fs->open_file_table_mutex)) {
         return -1;
     }
 
-    return inumber;
+    state_destroy();
+    return 0;
+}
+
+/* Records a change to a data block's state (see image_logged) */
+static void data_block_logged(int block_number) {
+    bitmap_set(fs->blocks_changed, (size_t)block_number);
+    image_logged(&fs->free_blocks[block_number], sizeof(fs->free_blocks[0]));
+    image_logged(&fs->block_refs[block_number], sizeof(fs->block_refs[0]));
+    image_logged(&fs->block_crc_valid[block_number],
+                 sizeof(fs->block_crc_valid[0]));
+    image_logged(&fs->block_indexed[block_number],
+                 sizeof(fs->block_indexed[0]));
+    image_logged(&fs->dedup_next[block_number], sizeof(fs->dedup_next[0]));
 }
 
 /*
- * Frees all data blocks of an i-node.
- * Input:
- * - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
+ * Frees a data block no reference is left to, unsafely: on an image, only
+ * once the journal transaction running commits (see block_free_seq).
+ * The caller must hold the blocks mutex.
+ * Input
+ * 	- the block index
  */
-int inode_clear(int inumber) {
-    if (!valid_inumber(inumber)) {
-        return -1;
+static void data_block_release_unsafe(int block_number) {
+    if (fs->image_fd != -1) {
+        fs->block_free_seq[block_number] = journal_running(fs->journal);
+        fs->block_pending_next[block_number] = -1;
+        if (fs->blocks_pending_tail == -1) {
+            fs->blocks_pending_head = block_number;
+        } else {
+            fs->block_pending_next[fs->blocks_pending_tail] = block_number;
+        }
+        fs->blocks_pending_tail = block_number;
+    } else {
+        fs->free_blocks[block_number] = FREE;
     }
+    atomic_store(&fs->block_cached[block_number], false);
+    data_block_logged(block_number);
+}
 
-    if (pthread_rwlock_wrlock(&inode_lock_table[inumber])) {
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+static int data_block_alloc() {
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
         return -1;
     }
 
-    int result = inode_clear_unsafe(inumber);
+    for (int i = 0; i < (int)fs->data_blocks; i++) {
+        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
 
-    if (pthread_rwlock_unlock(&inode_lock_table[inumber])) {
-        return -1;
+        if (fs->free_blocks[i] == FREE) {
+            fs->free_blocks[i] = TAKEN;
+            fs->block_refs[i] = 1;
+            fs->block_crc_valid[i] = false;
+            data_block_logged(i);
+            if (pthread_mutex_unlock(&fs->data_blocks_mutex)) {
+                return -1;
+            }
+            return i;
+        }
     }
 
-    return result;
+    pthread_mutex_unlock(&fs->data_blocks_mutex);
+    return -1;
 }
 
 /*
- * Deletes the i-node.
+ * Allocates a set of new data blocks, in a single pass over the free blocks
  * Input:
- *  - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
+ * 	- array to store the block indexes in
+ * 	- number of blocks to allocate
+ * Returns: 0 if successful, -1 otherwise (and no block is allocated)
  */
-int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
+static int data_blocks_alloc(int *blocks, size_t count) {
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        return -1;
+    }
+
+    size_t found = 0;
+    for (int i = 0; i < (int)fs->data_blocks && found < count; i++) {
+        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
+
+        if (fs->free_blocks[i] == FREE) {
+            fs->free_blocks[i] = TAKEN;
+            fs->block_refs[i] = 1;
+            fs->block_crc_valid[i] = false;
+            data_block_logged(i);
+            blocks[found++] = i;
+        }
+    }
+
+    /* Not enough free blocks: give back those taken */
+    if (found < count) {
+        for (size_t i = 0; i < found; i++) {
+            fs->free_blocks[blocks[i]] = FREE;
+            fs->block_refs[blocks[i]] = 0;
+            data_block_logged(blocks[i]);
+        }
+        pthread_mutex_unlock(&fs->data_blocks_mutex);
+        return -1;
+    }
 
-    if (pthread_mutex_lock(&inode_table_mutex)) {
+    if (pthread_mutex_unlock(&fs->data_blocks_mutex)) {
         return -1;
     }
 
-    if (pthread_rwlock_wrlock(&inode_lock_table[inumber])) {
-        pthread_mutex_unlock(&inode_table_mutex);
+    return 0;
+}
+
+/* Removes a data block from the deduplication index and frees it, if no file
+ * uses it anymore (the index holding its only reference)
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+static int dedup_evict(int block_number) {
+    uint32_t crc =
+        __atomic_load_n(&fs->block_crc[block_number], __ATOMIC_RELAXED);
+    size_t bucket = crc % fs->data_blocks;
+    pthread_mutex_t *mutex = &fs->dedup_mutex[bucket % DEDUP_LOCKS];
+    if (pthread_mutex_lock(mutex)) {
         return -1;
     }
 
-    if (!valid_inumber(inumber) || free_inode_ts[inumber] == FREE) {
-        pthread_rwlock_unlock(&inode_lock_table[inumber]);
-        pthread_mutex_unlock(&inode_table_mutex);
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        pthread_mutex_unlock(mutex);
         return -1;
     }
 
-    if (inode_clear_unsafe(inumber) == -1) {
-        pthread_rwlock_unlock(&inode_lock_table[inumber]);
-        pthread_mutex_unlock(&inode_table_mutex);
+    /* The block may have been found (and shared) meanwhile */
+    if (fs->block_indexed[block_number] && fs->block_refs[block_number] == 1) {
+        for (int *b = &fs->dedup_buckets[bucket]; *b != -1;
+             b = &fs->dedup_next[*b]) {
+            if (*b == block_number) {
+                *b = fs->dedup_next[block_number];
+                image_logged(b, sizeof(*b));
+                break;
+            }
+        }
+
+        fs->block_indexed[block_number] = false;
+        fs->block_refs[block_number] = 0;
+        data_block_release_unsafe(block_number);
+    }
+
+    if (pthread_mutex_unlock(&fs->data_blocks_mutex) ||
+        pthread_mutex_unlock(mutex)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drops a reference to a data block, freeing it if it was the last one
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+static int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
         return -1;
     }
 
-    free_inode_ts[inumber] = FREE;
+    insert_delay(); // simulate storage access delay to free_blocks
 
-    if (pthread_rwlock_unlock(&inode_lock_table[inumber])) {
-        pthread_mutex_unlock(&inode_table_mutex);
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
         return -1;
     }
 
-    if (pthread_mutex_unlock(&inode_table_mutex)) {
+    fs->block_refs[block_number] -= 1;
+    data_block_logged(block_number);
+    if (fs->block_refs[block_number] == 0) {
+        data_block_release_unsafe(block_number);
+    }
+    bool orphaned =
+        fs->block_refs[block_number] == 1 && fs->block_indexed[block_number];
+
+    if (pthread_mutex_unlock(&fs->data_blocks_mutex)) {
         return -1;
     }
 
+    /* Only the deduplication index uses the block now */
+    if (orphaned) {
+        return dedup_evict(block_number);
+    }
+
     return 0;
 }
 
 /*
- * Returns a pointer to an existing i-node.
+ * Frees the blocks whose last reference was dropped by a journal transaction
+ * now committed (called by the journal's helper thread).
+ * Input
+ * 	- the instance whose journal it is
+ * 	- the transaction's sequence number
+ */
+static void data_blocks_committed(void *arg, uint64_t seq) {
+    tfs_t *previous = state_select(arg);
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        state_select(previous);
+        return;
+    }
+
+    /* Transactions commit in order, so the blocks to free lead the queue */
+    while (fs->blocks_pending_head != -1 &&
+           fs->block_free_seq[fs->blocks_pending_head] <= seq) {
+        int b = fs->blocks_pending_head;
+        fs->blocks_pending_head = fs->block_pending_next[b];
+        fs->block_free_seq[b] = 0;
+        fs->free_blocks[b] = FREE;
+        data_block_logged(b);
+    }
+    if (fs->blocks_pending_head == -1) {
+        fs->blocks_pending_tail = -1;
+    }
+
+    pthread_mutex_unlock(&fs->data_blocks_mutex);
+    state_select(previous);
+}
+
+/* Adds a reference to each of a set of data blocks
+ * Input
+ * 	- array of block indexes (-1 entries are skipped)
+ * 	- number of elements in the array
+ * Returns: 0 if success, -1 otherwise
+ */
+static int data_blocks_share(int const *blocks, size_t count) {
+    insert_delay(); // simulate storage access delay to block_refs
+
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (valid_block_number(blocks[i])) {
+            fs->block_refs[blocks[i]] += 1;
+            data_block_logged(blocks[i]);
+        }
+    }
+
+    if (pthread_mutex_unlock(&fs->data_blocks_mutex)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Checks if a data block is shared by more than one i-node
+ * Input
+ * 	- the block index
+ * Returns: true if the block is shared, false otherwise
+ */
+static bool data_block_shared(int block_number) {
+    if (!valid_block_number(block_number) ||
+        pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        return false;
+    }
+
+    bool shared = fs->block_refs[block_number] > 1;
+    pthread_mutex_unlock(&fs->data_blocks_mutex);
+    return shared;
+}
+
+/* Returns a pointer to the contents of a given block
  * Input:
- *  - inumber: identifier of the i-node
- * Returns: pointer if successful, NULL if failed
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
  */
-static inode_t *inode_get(int inumber) {
-    if (!valid_inumber(inumber)) {
+static void *data_block_get(int block_number) {
+    if (!valid_block_number(block_number)) {
         return NULL;
     }
 
-    insert_delay(); // simulate storage access delay to i-node
-    return &inode_table[inumber];
+    /* Blocks prefetched into the cache, or of an image and loaded into memory
+     * already, are at hand; a block of an image is loaded by its first
+     * access */
+    if (!atomic_load(&fs->block_cached[block_number]) &&
+        !atomic_load(&fs->block_loaded[block_number])) {
+        insert_delay(); // simulate storage access delay to block
+        if (fs->image_fd != -1) {
+            atomic_store(&fs->block_loaded[block_number], true);
+        }
+    }
+
+    return &fs->fs_data[block_number * BLOCK_SIZE];
+}
+
+/* Computes the CRC32C of a data block's contents */
+static uint32_t data_block_crc(void const *block) {
+    return ~block_crc32c(~0u, block, BLOCK_SIZE);
 }
 
 /*
- * Returns an i-node's block number from its index unsafely.
+ * Sets a data block's checksum from its contents.
+ * The caller must be the only one writing to the block.
+ * Inputs:
+ *  - the block index and its contents
+ */
+static void data_block_seal(int block_number, void const *block) {
+    __atomic_store_n(&fs->block_crc[block_number], data_block_crc(block),
+                     __ATOMIC_RELAXED);
+    if (!fs->block_crc_valid[block_number]) {
+        fs->block_crc_valid[block_number] = true;
+        image_logged(&fs->block_crc_valid[block_number], sizeof(bool));
+    }
+    image_logged(&fs->block_crc[block_number], sizeof(uint32_t));
+    image_written(block, BLOCK_SIZE);
+}
+
+/*
+ * Updates a data block's checksum after part of it was written. Only the part
+ * written is read, so writes to other parts of the block may run meanwhile.
+ * Inputs:
+ *  - the block index and its contents
+ *  - offset and length of the part written
+ *  - the CRC32C of the part before it was written, not inverted (see
+ *    block_crc32c) and starting from 0
+ */
+static void data_block_update_crc(int block_number, void const *block,
+                                  size_t offset, size_t len, uint32_t before) {
+    /* The CRC is linear: the checksum changes by the CRC of the bytes that
+     * changed, carried through the rest of the block */
+    uint32_t after = block_crc32c(0, (char const *)block + offset, len);
+    uint32_t change =
+        block_crc32c(before ^ after, zero_block, BLOCK_SIZE - offset - len);
+    __atomic_fetch_xor(&fs->block_crc[block_number], change, __ATOMIC_RELAXED);
+    image_logged(&fs->block_crc[block_number], sizeof(uint32_t));
+    image_written((char const *)block + offset, len);
+}
+
+/*
+ * Checks a data block against its checksum. Waits for writes to parts of the
+ * block in progress (by appends, which do not lock blocks) to complete.
+ * Inputs:
+ *  - the block index and its contents
+ * Returns 0 if the block matches its checksum (or has none), -1 otherwise.
+ */
+static int data_block_verify(int block_number, void const *block) {
+    if (!fs->block_crc_valid[block_number]) {
+        return 0;
+    }
+
+    for (;;) {
+        unsigned gen = atomic_load(&fs->block_crc_gen[block_number]);
+        if (atomic_load(&fs->block_crc_writers[block_number]) == 0) {
+            uint32_t crc = data_block_crc(block);
+            if (atomic_load(&fs->block_crc_writers[block_number]) == 0 &&
+                atomic_load(&fs->block_crc_gen[block_number]) == gen) {
+                uint32_t expected = __atomic_load_n(
+                    &fs->block_crc[block_number], __ATOMIC_RELAXED);
+                return crc == expected ? 0 : -1;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/* Fetches a block into the block cache, evicting the oldest cached block
  * Input:
- * - inumber: identifier of the i-node
- * - index: index of the block
- * Returns: block number if successful, -1 if failed
+ * 	- Block's index
  */
-static int inode_get_block_unsafe(int inumber, int index) {
-    if (!valid_inumber(inumber) || free_inode_ts[inumber] == FREE) {
+static void data_block_prefetch(int block_number) {
+    if (!valid_block_number(block_number) ||
+        atomic_load(&fs->block_cached[block_number])) {
+        return;
+    }
+
+    insert_delay(); // simulate storage access delay to block
+
+    if (pthread_mutex_lock(&fs->block_cache_mutex)) {
+        return;
+    }
+
+    int evicted = fs->block_cache_ring[fs->block_cache_next];
+    if (evicted != -1) {
+        atomic_store(&fs->block_cached[evicted], false);
+    }
+
+    fs->block_cache_ring[fs->block_cache_next] = block_number;
+    fs->block_cache_next = (fs->block_cache_next + 1) % BLOCK_CACHE_SIZE;
+    atomic_store(&fs->block_cached[block_number], true);
+
+    pthread_mutex_unlock(&fs->block_cache_mutex);
+}
+
+/* Records a change to an i-node (see image_logged) */
+static void inode_logged(int inumber) {
+    bitmap_set(fs->inodes_changed, (size_t)inumber);
+    image_logged(&fs->inode_table[inumber], sizeof(inode_t));
+    image_logged(&fs->free_inode_ts[inumber], sizeof(fs->free_inode_ts[0]));
+}
+
+/*
+ * Locks an i-node exclusively once no appends to it are in flight, as their
+ * reserved bytes lie beyond its size. Used by any change to an i-node's size
+ * or blocks other than appending.
+ * Input:
+ * - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+static int inode_wrlock_quiesced(int inumber) {
+    for (;;) {
+        if (pthread_rwlock_wrlock(&fs->inode_lock_table[inumber])) {
+            return -1;
+        }
+
+        /* Appends only start with the i-node locked shared */
+        if (atomic_load(&fs->inode_append_inflight[inumber]) == 0) {
+            return 0;
+        }
+
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber]) ||
+            pthread_mutex_lock(&fs->inode_range_mutex[inumber])) {
+            return -1;
+        }
+
+        while (atomic_load(&fs->inode_append_inflight[inumber]) > 0) {
+            if (pthread_cond_wait(&fs->inode_append_cond[inumber],
+                                  &fs->inode_range_mutex[inumber])) {
+                pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+                return -1;
+            }
+        }
+
+        if (pthread_mutex_unlock(&fs->inode_range_mutex[inumber])) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Unlocks an i-node locked by inode_wrlock_quiesced, so that later appends
+ * start from its (possibly changed) size.
+ * Input:
+ * - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+static int inode_wrunlock_quiesced(int inumber) {
+    inode_logged(inumber);
+    size_t size = fs->inode_table[inumber].i_size;
+    atomic_store(&fs->inode_append_cursor[inumber], size);
+    fs->inode_append_published[inumber] = size;
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Waits until no read mapping pins an i-node's data blocks.
+ * Must be called, with the i-node's write lock held, before its data blocks
+ * are released in bulk (a block replaced on its own is released by
+ * inode_release_block_unsafe instead). The lock prevents new mappings from
+ * being created.
+ * Input:
+ * - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+static int inode_wait_unpinned_unsafe(int inumber) {
+    if (pthread_mutex_lock(&fs->inode_pin_mutex)) {
+        return -1;
+    }
+
+    while (fs->inode_pin_count[inumber] > 0) {
+        if (pthread_cond_wait(&fs->inode_pin_cond, &fs->inode_pin_mutex)) {
+            pthread_mutex_unlock(&fs->inode_pin_mutex);
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_pin_mutex)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Drops a reference an i-node held to one of its data blocks, unsafely: if
+ * read mappings pin the i-node's blocks, one may point to the block, which
+ * is then released once they are all unmapped (see unmap_file).
+ * The caller must hold the i-node's write lock, which prevents new mappings
+ * from being created.
+ * Input:
+ * - inumber: i-node's number
+ * - block_number: the block dropped
+ * Returns: 0 if successful, -1 if failed
+ */
+static int inode_release_block_unsafe(int inumber, int block_number) {
+    if (pthread_mutex_lock(&fs->inode_pin_mutex)) {
+        return -1;
+    }
+
+    if (fs->inode_pin_count[inumber] > 0) {
+        fs->block_deferred_next[block_number] =
+            fs->inode_deferred_blocks[inumber];
+        fs->inode_deferred_blocks[inumber] = block_number;
+        return pthread_mutex_unlock(&fs->inode_pin_mutex) ? -1 : 0;
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_pin_mutex)) {
         return -1;
     }
 
-    if (index < 0 || index >= inode_table[inumber].i_data_block_count) {
+    return data_block_free(block_number);
+}
+
+/*
+ * Replaces the reference to one of the i-node's blocks unsafely, releasing
+ * the block it replaces (if any).
+ * The caller must hold the i-node's write lock.
+ * Input:
+ * - inumber: i-node's number
+ * - index: index of the block
+ * - b: the new block (-1 for a hole), whose reference the i-node takes over
+ *  Returns: 0 if successful, -1 if failed
+ */
+static int inode_set_block_unsafe(int inumber, size_t index, int b) {
+    inode_t *inode = &fs->inode_table[inumber];
+    if (index >= inode->i_data_block_count) {
         return -1;
     }
 
+    int *ref;
     if (index < INODE_DIRECT_REFS) {
-        return inode_table[inumber].i_data_block[index];
+        ref = &inode->i_data_block[index];
     } else {
-        int *refs =
-            (int *)data_block_get(inode_table[inumber].i_data_extension_block);
-        if (refs == NULL) {
+        /* Create the indirect reference block, with every reference a hole */
+        if (inode->i_data_extension_block == -1) {
+            if (b == -1) {
+                return 0;
+            }
+
+            int ext = data_block_alloc();
+            int *indirect_refs = ext == -1 ? NULL : (int *)data_block_get(ext);
+            if (indirect_refs == NULL) {
+                data_block_free(ext);
+                return -1;
+            }
+
+            block_fill(indirect_refs, 0xff, BLOCK_SIZE); // all -1
+            image_logged(indirect_refs, BLOCK_SIZE);
+            inode->i_data_extension_block = ext;
+        }
+
+        int *indirect_refs =
+            (int *)data_block_get(inode->i_data_extension_block);
+        if (indirect_refs == NULL) {
             return -1;
         }
+        ref = &indirect_refs[index - INODE_DIRECT_REFS];
+    }
 
-        return refs[index - INODE_DIRECT_REFS];
+    int old = *ref;
+    if (old == b) {
+        return 0;
+    }
+
+    *ref = b;
+    image_logged(ref, sizeof(*ref));
+    inode_logged(inumber);
+    if (old == -1) {
+        inode->i_hole_count -= 1;
+    } else {
+        /* Read mappings of the i-node may point to the block replaced */
+        inode_release_block_unsafe(inumber, old);
+    }
+    if (b == -1) {
+        inode->i_hole_count += 1;
     }
+
+    return 0;
 }
 
 /*
- * Adds an entry to the i-node directory data.
+ * Allocates a data block for one of the i-node's holes unsafely. The block's
+ * contents are left as they are.
  * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
+ * - inumber: i-node's number
+ * - index: index of the hole
+ *  Returns: the block number if successful, -1 if failed
  */
-static int add_dir_entry_unsafe(int inumber, int sub_inumber,
-                                char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+static int inode_fill_hole_unsafe(int inumber, size_t index) {
+    if (!valid_inumber(inumber) || fs->free_inode_ts[inumber] == FREE) {
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
+    /* Allocates a new data block */
+    int b = data_block_alloc();
+    if (b == -1) {
+        return -1;
+    }
+
+    if (inode_set_block_unsafe(inumber, index, b) == -1) {
+        data_block_free(b);
+        return -1;
+    }
+
+    return b;
+}
+
+/*
+ * Gives an i-node its own copy of a data block it shares with other i-nodes,
+ * unsafely.
+ * The caller must hold the i-node's write lock.
+ * Input:
+ * - inumber: i-node's number
+ * - index: index of the block
+ * - b: the shared block
+ * - whether to copy the block's contents (or leave the copy's as they are)
+ *  Returns: the block number of the copy if successful, -1 if failed
+ */
+static int inode_unshare_block_unsafe(int inumber, size_t index, int b,
+                                      bool copy) {
+    int copy_b = data_block_alloc();
+    if (copy_b == -1) {
+        return -1;
+    }
+
+    if (copy) {
+        void const *block = data_block_get(b);
+        void *copy_block = data_block_get(copy_b);
+        if (block == NULL || copy_block == NULL) {
+            data_block_free(copy_b);
+            return -1;
+        }
+        block_copy(copy_block, block, BLOCK_SIZE);
+        if (fs->block_crc_valid[b]) {
+            data_block_seal(copy_b, copy_block);
+        } else {
+            image_written(copy_block, BLOCK_SIZE);
+        }
+    }
+
+    /* The i-node's reference to the shared block is dropped */
+    if (inode_set_block_unsafe(inumber, index, copy_b) == -1) {
+        data_block_free(copy_b);
+        return -1;
+    }
+
+    return copy_b;
+}
+
+/*
+ * Extends an i-node with holes until its blocks hold a given number of bytes,
+ * unsafely. No data blocks are allocated.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - number of bytes the blocks must hold
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_reserve_unsafe(int inumber, size_t bytes) {
+    size_t count = bytes / BLOCK_SIZE + (bytes % BLOCK_SIZE != 0);
+    if (count > INODE_DIRECT_REFS + MAX_INDIRECT_REFS) {
+        return -1;
+    }
+
+    /* References past the block count are always holes */
+    inode_t *inode = &fs->inode_table[inumber];
+    if (count > inode->i_data_block_count) {
+        inode->i_hole_count += count - inode->i_data_block_count;
+        inode->i_data_block_count = count;
+        inode_logged(inumber);
+    }
+
+    return 0;
+}
+
+/*
+ * Releases an i-node's data blocks from a given index on, unsafely.
+ * The caller must hold the i-node's write lock, and no read mapping may pin
+ * the i-node's blocks.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - number of blocks to keep
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_release_blocks_unsafe(int inumber, size_t count) {
+    inode_t *inode = &fs->inode_table[inumber];
+
+    /* Get indirect block, if any reference in it is released */
+    int *indirect_refs = NULL;
+    if (inode->i_data_extension_block != -1 &&
+        inode->i_data_block_count > INODE_DIRECT_REFS &&
+        inode->i_data_block_count > count) {
+        indirect_refs = (int *)data_block_get(inode->i_data_extension_block);
+        if (indirect_refs == NULL) {
+            return -1;
+        }
+        image_logged(indirect_refs, BLOCK_SIZE);
+    }
+    inode_logged(inumber);
+
+    /* Free the data blocks, last to first */
+    while (inode->i_data_block_count > count) {
+        size_t i = inode->i_data_block_count - 1;
+        int *ref = NULL;
+        if (i < INODE_DIRECT_REFS) {
+            ref = &inode->i_data_block[i];
+        } else if (indirect_refs != NULL) {
+            ref = &indirect_refs[i - INODE_DIRECT_REFS];
+        }
+
+        if (ref == NULL || *ref == -1) {
+            inode->i_hole_count -= 1;
+        } else {
+            if (data_block_free(*ref) == -1) {
+                return -1;
+            }
+            *ref = -1;
+        }
+
+        inode->i_data_block_count -= 1;
+    }
+
+    /* Free the indirect block once it holds no references */
+    if (inode->i_data_block_count <= INODE_DIRECT_REFS &&
+        inode->i_data_extension_block != -1) {
+        if (data_block_free(inode->i_data_extension_block) == -1) {
+            return -1;
+        }
+        inode->i_data_extension_block = -1;
+    }
+
+    /* Chunks no longer holding any block are stored as is (as holes) */
+    for (size_t c = (count + COMPRESS_CHUNK_BLOCKS - 1) / COMPRESS_CHUNK_BLOCKS;
+         c < INODE_MAX_CHUNKS; c++) {
+        inode->i_chunk_len[c] = 0;
+    }
+
+    if (inode->i_data_block_count == 0) {
+        inode->i_shared = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Creates a new i-node in the i-node table unsafely.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+static int inode_create_unsafe(inode_type n_type) {
+    for (int inumber = 0; inumber < (int)fs->inode_table_size; inumber++) {
+        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
+            insert_delay(); // simulate storage access delay (to freeinode_ts)
+        }
+
+        /* Finds first free entry in i-node table */
+        if (fs->free_inode_ts[inumber] == FREE) {
+            /* Found a free entry, so takes it for the new i-node*/
+            fs->free_inode_ts[inumber] = TAKEN;
+            inode_logged(inumber);
+            insert_delay(); // simulate storage access delay (to i-node)
+            fs->inode_table[inumber].i_node_type = n_type;
+            fs->inode_table[inumber].i_size = 0;
+            fs->inode_table[inumber].i_data_block_count = 0;
+            fs->inode_table[inumber].i_hole_count = 0;
+            fs->inode_table[inumber].i_shared = 0;
+            fs->inode_table[inumber].i_compressed = 0;
+            memset(fs->inode_table[inumber].i_chunk_len, 0,
+                   sizeof(fs->inode_table[inumber].i_chunk_len));
+            for (size_t i = 0; i < INODE_DIRECT_REFS; i++) {
+                fs->inode_table[inumber].i_data_block[i] = -1;
+            }
+            fs->inode_table[inumber].i_data_extension_block = -1;
+            atomic_store(&fs->inode_append_cursor[inumber], 0);
+            fs->inode_append_published[inumber] = 0;
+
+            if (n_type == T_DIRECTORY) {
+                /* Initializes directory (filling its first block with empty
+                 * entries, labeled with inumber==-1) */
+                int b = inode_reserve_unsafe(inumber, BLOCK_SIZE) == -1
+                            ? -1
+                            : inode_fill_hole_unsafe(inumber, 0);
+                if (b == -1) {
+                    fs->free_inode_ts[inumber] = FREE;
+                    return -1;
+                }
+
+                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+                if (dir_entry == NULL) {
+                    fs->free_inode_ts[inumber] = FREE;
+                    return -1;
+                }
+
+                /* Every entry is free: its d_inumber is -1 (all bits set) */
+                block_fill(dir_entry, 0xff, BLOCK_SIZE);
+                image_logged(dir_entry, BLOCK_SIZE);
+            }
+
+            return inumber;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Frees all data blocks of an i-node unsafely.
+ * Input:
+ * - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+static int inode_clear_unsafe(int inumber) {
+    if (fs->free_inode_ts[inumber] == FREE) {
+        return -1;
+    }
+
+    if (inode_wait_unpinned_unsafe(inumber) == -1) {
+        return -1;
+    }
+
+    if (inode_release_blocks_unsafe(inumber, 0) == -1) {
+        return -1;
+    }
+
+    fs->inode_table[inumber].i_size = 0;
+    inode_logged(inumber);
+
+    return 0;
+}
+
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+int inode_create(inode_type n_type) {
+    if (pthread_mutex_lock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    int inumber = inode_create_unsafe(n_type);
+
+    if (pthread_mutex_unlock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    return inumber;
+}
+
+/*
+ * Frees all data blocks of an i-node.
+ * Input:
+ * - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_clear(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    if (inode_wrlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    int result = inode_clear_unsafe(inumber);
+
+    if (inode_wrunlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_delete(int inumber) {
+    // simulate storage access delay (to i-node and freeinode_ts)
+    insert_delay();
+    insert_delay();
+
+    if (pthread_mutex_lock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    if (inode_wrlock_quiesced(inumber) == -1) {
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    if (!valid_inumber(inumber) || fs->free_inode_ts[inumber] == FREE) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    if (inode_clear_unsafe(inumber) == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    fs->free_inode_ts[inumber] = FREE;
+    inode_logged(inumber);
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a pointer to an existing i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed
+ */
+static inode_t *inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node
+    return &fs->inode_table[inumber];
+}
+
+/*
+ * Returns an i-node's block number from its index unsafely.
+ * Input:
+ * - inumber: identifier of the i-node
+ * - index: index of the block
+ * Returns: block number if successful, -1 if failed or the block is a hole
+ */
+static int inode_get_block_unsafe(int inumber, int index) {
+    if (!valid_inumber(inumber) || fs->free_inode_ts[inumber] == FREE) {
+        return -1;
+    }
+
+    if (index < 0 || index >= fs->inode_table[inumber].i_data_block_count) {
+        return -1;
+    }
+
+    if (index < INODE_DIRECT_REFS) {
+        return fs->inode_table[inumber].i_data_block[index];
+    } else if (fs->inode_table[inumber].i_data_extension_block == -1) {
+        return -1;
+    } else {
+        int *refs = (int *)data_block_get(
+            fs->inode_table[inumber].i_data_extension_block);
+        if (refs == NULL) {
+            return -1;
+        }
+
+        return refs[index - INODE_DIRECT_REFS];
+    }
+}
+
+/*
+ * Adds an entry to the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+static int add_dir_entry_unsafe(int inumber, int sub_inumber,
+                                char const *sub_name) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    if (fs->inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    if (strlen(sub_name) == 0) {
+        return -1;
+    }
+
+    /* Locates the block containing the directory's entries */
+    dir_entry_t *dir_entry =
+        (dir_entry_t *)data_block_get(fs->inode_table[inumber].i_data_block[0]);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+
+    /* Finds and fills the first empty entry */
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber == -1) {
+            dir_entry[i].d_inumber = sub_inumber;
+            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
+            image_logged(&dir_entry[i], sizeof(dir_entry_t));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Looks for a given name inside a directory, unsafely
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+static int find_in_dir_unsafe(int inumber, char const *sub_name) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    if (fs->inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    /* Locates the block containing the directory's entries */
+    dir_entry_t *dir_entry =
+        (dir_entry_t *)data_block_get(fs->inode_table[inumber].i_data_block[0]);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+
+    /* Iterates over the directory entries looking for one that has the target
+     * name */
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if ((dir_entry[i].d_inumber != -1) &&
+            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+            return dir_entry[i].d_inumber;
+        }
+    }
+
+    return -1;
+}
+
+/* Looks for a given name inside a directory
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    int result = find_in_dir_unsafe(inumber, sub_name);
+    if (result == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    return result;
+}
+
+/* Lists the entries of a directory
+ * Inputs:
+ *  - inumber: directory's i-node number
+ *  - entries: array of at least MAX_DIR_ENTRIES entries to fill
+ * Returns the number of entries listed, -1 if the operation failed.
+ */
+int list_dir(int inumber, dir_entry_t *entries) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    dir_entry_t *dir_entry = NULL;
+    if (fs->free_inode_ts[inumber] == TAKEN &&
+        fs->inode_table[inumber].i_node_type == T_DIRECTORY) {
+        dir_entry = (dir_entry_t *)data_block_get(
+            fs->inode_table[inumber].i_data_block[0]);
+    }
+    if (dir_entry == NULL) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    int count = 0;
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber != -1) {
+            entries[count++] = dir_entry[i];
+        }
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    return count;
+}
+
+/* Looks for a given name inside a directory, and if not found, creates a new
+ * i-node for it.
+ * Input:
+ * 	- parent directory's i-node number
+ *  - i-node type
+ * 	- name to search
+ * 	- non-zero to store the data of a file created compressed (see inode_t)
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int create_in_dir(int inumber, inode_type type, char const *sub_name,
+                  int compressed) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    if (pthread_rwlock_wrlock(&fs->inode_lock_table[inumber])) {
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    int sub_inumber = find_in_dir_unsafe(inumber, sub_name);
+    if (sub_inumber >= 0) {
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+            pthread_mutex_unlock(&fs->inode_table_mutex);
+            return -1;
+        }
+
+        if (pthread_mutex_unlock(&fs->inode_table_mutex)) {
+            return -1;
+        }
+
+        return sub_inumber;
+    }
+
+    /* If the target name is not found, creates a new i-node for it */
+    sub_inumber = inode_create_unsafe(type);
+    if (sub_inumber == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+    fs->inode_table[sub_inumber].i_compressed = type == T_FILE && compressed;
+
+    if (add_dir_entry_unsafe(inumber, sub_inumber, sub_name) == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        pthread_mutex_unlock(&fs->inode_table_mutex);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_table_mutex)) {
+        return -1;
+    }
+
+    return sub_inumber;
+}
+
+/* Add new entry to the open file table
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Non-zero if file was opened in append mode
+ * 	- Non-zero if small writes should be buffered
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, int append, int buffered) {
+    if (pthread_mutex_lock(&fs->open_file_table_mutex)) {
+        return -1;
+    }
+
+    for (int i = 0; i < (int)fs->max_open_files; i++) {
+        if (fs->free_open_file_entries[i] == FREE) {
+            fs->free_open_file_entries[i] = TAKEN;
+            fs->open_file_table[i].of_inumber = inumber;
+            fs->open_file_table[i].of_append = append;
+            fs->open_file_table[i].of_offset = 0;
+            fs->open_file_table[i].of_buffered = buffered;
+            fs->open_file_table[i].of_wbuf_len = 0;
+            fs->open_file_table[i].of_ra_next = 0;
+            fs->open_file_table[i].of_ra_window = 0;
+            fs->open_file_table[i].of_ra_issued = 0;
+            if (buffered) {
+                atomic_fetch_add(&fs->inode_buffered_count[inumber], 1);
+            }
+            fs->open_file_count += 1;
+            if (pthread_mutex_unlock(&fs->open_file_table_mutex)) {
+                return -1;
+            }
+            return i;
+        }
+    }
+
+    pthread_mutex_unlock(&fs->open_file_table_mutex);
+    return -1;
+}
+
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+    if (pthread_mutex_lock(&fs->open_file_table_mutex)) {
+        return -1;
+    }
+
+    if (!valid_file_handle(fhandle) ||
+        fs->free_open_file_entries[fhandle] != TAKEN) {
+        pthread_mutex_unlock(&fs->open_file_table_mutex);
+        return -1;
+    }
+    fs->free_open_file_entries[fhandle] = FREE;
+    open_file_entry_t *file = &fs->open_file_table[fhandle];
+    if (file->of_buffered) {
+        /* Anything still buffered was already flushed (or failed to) */
+        file->of_wbuf_len = 0;
+        atomic_fetch_sub(&fs->inode_buffered_count[file->of_inumber], 1);
+    }
+    fs->open_file_count -= 1;
+    if (fs->open_file_count == 0) {
+        if (pthread_cond_signal(&fs->open_file_table_cond)) {
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_unlock(&fs->open_file_table_mutex)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prefetches a range of an i-node's blocks (and the block holding their
+ * references) into the block cache. Holes in the range are skipped.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - first: index of the first block to prefetch
+ *  - count: number of blocks to prefetch
+ */
+static void inode_prefetch(int inumber, size_t first, size_t count) {
+    for (size_t bi = first; bi < first + count; bi++) {
+        /* Let writers in between blocks */
+        if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+            return;
+        }
+
+        inode_t *inode = &fs->inode_table[inumber];
+        if (fs->free_inode_ts[inumber] == FREE ||
+            bi >= inode->i_data_block_count) {
+            pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+            return;
+        }
+
+        if (bi >= INODE_DIRECT_REFS) {
+            data_block_prefetch(inode->i_data_extension_block);
+        }
+        data_block_prefetch(inode_get_block_unsafe(inumber, (int)bi));
+
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+    }
+}
+
+/*
+ * Loads the next IMAGE_PREFETCH_BLOCKS data blocks of the image that are in
+ * use and not loaded yet into memory, in the background, so that their first
+ * access does not wait for them. Only the readahead thread calls it.
+ */
+static void image_prefetch() {
+    size_t loading = 0;
+    size_t first = fs->image_prefetch_next;
+    while (fs->image_prefetch_next < fs->data_blocks &&
+           loading < IMAGE_PREFETCH_BLOCKS) {
+        size_t i = fs->image_prefetch_next++;
+        if (atomic_load(&fs->block_loaded[i]) ||
+            pthread_mutex_lock(&fs->data_blocks_mutex)) {
+            continue;
+        }
+        bool taken = fs->free_blocks[i] == TAKEN;
+        pthread_mutex_unlock(&fs->data_blocks_mutex);
+
+        if (taken) {
+            insert_delay(); // simulate storage access delay to block
+            atomic_store(&fs->block_loaded[i], true);
+            loading++;
+        }
+    }
+
+    /* Have the host read the pages of those blocks ahead of their use */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (first * BLOCK_SIZE) / page * page;
+    size_t end = fs->image_prefetch_next * BLOCK_SIZE;
+    if (loading > 0 && end > start) {
+        posix_madvise(fs->fs_data + start, end - start, POSIX_MADV_WILLNEED);
+    }
+}
+
+/*
+ * Readahead helper thread: serves prefetch requests until stopped, and loads
+ * an image's blocks (see image_prefetch) while there are none.
+ */
+static void *readahead_thread(void *arg) {
+    state_select(arg);
+
+    if (pthread_mutex_lock(&fs->readahead_mutex)) {
+        return NULL;
+    }
+
+    while (!fs->readahead_stop) {
+        if (fs->readahead_queue_len == 0 &&
+            fs->image_prefetch_next < fs->data_blocks) {
+            pthread_mutex_unlock(&fs->readahead_mutex);
+            image_prefetch();
+            if (pthread_mutex_lock(&fs->readahead_mutex)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        if (fs->readahead_queue_len == 0) {
+            pthread_cond_wait(&fs->readahead_cond, &fs->readahead_mutex);
+            continue;
+        }
+
+        readahead_request_t request =
+            fs->readahead_queue[fs->readahead_queue_head];
+        fs->readahead_queue_head =
+            (fs->readahead_queue_head + 1) % READAHEAD_QUEUE_SIZE;
+        fs->readahead_queue_len -= 1;
+
+        pthread_mutex_unlock(&fs->readahead_mutex);
+        inode_prefetch(request.rr_inumber, request.rr_first, request.rr_count);
+        if (pthread_mutex_lock(&fs->readahead_mutex)) {
+            return NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&fs->readahead_mutex);
+    return NULL;
+}
+
+/*
+ * Queues a prefetch request for the readahead helper thread. Requests are
+ * only hints, so they are dropped when the queue is full.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - first: index of the first block to prefetch
+ *  - count: number of blocks to prefetch
+ */
+static void readahead_submit(int inumber, size_t first, size_t count) {
+    if (pthread_mutex_lock(&fs->readahead_mutex)) {
+        return;
+    }
+
+    if (fs->readahead_queue_len < READAHEAD_QUEUE_SIZE) {
+        size_t tail = (fs->readahead_queue_head + fs->readahead_queue_len) %
+                      READAHEAD_QUEUE_SIZE;
+        fs->readahead_queue[tail].rr_inumber = inumber;
+        fs->readahead_queue[tail].rr_first = first;
+        fs->readahead_queue[tail].rr_count = count;
+        fs->readahead_queue_len += 1;
+        pthread_cond_signal(&fs->readahead_cond);
+    }
+
+    pthread_mutex_unlock(&fs->readahead_mutex);
+}
+
+/*
+ * Updates an open file's sequential access detection after a read, and
+ * requests the blocks in its readahead window that were not requested yet.
+ * The window doubles with each sequential read, and is reset by a seek.
+ * The caller must hold the file entry mutex.
+ * Inputs:
+ *  - the open file entry
+ *  - offset the read started at
+ *  - number of bytes read
+ */
+static void open_file_readahead_unsafe(open_file_entry_t *file, size_t offset,
+                                       size_t read) {
+    if (offset != file->of_ra_next) {
+        file->of_ra_window = 0;
+        file->of_ra_issued = 0;
+    } else if (file->of_ra_window == 0) {
+        file->of_ra_window = READAHEAD_MIN_BLOCKS;
+    } else if (file->of_ra_window < READAHEAD_MAX_BLOCKS) {
+        file->of_ra_window *= 2;
+    }
+    file->of_ra_next = offset + read;
+
+    if (file->of_ra_window == 0) {
+        return;
+    }
+
+    /* Blocks after the one the next read starts in */
+    size_t first = file->of_ra_next / BLOCK_SIZE + 1;
+    if (first < file->of_ra_issued) {
+        first = file->of_ra_issued;
+    }
+
+    size_t end = file->of_ra_next / BLOCK_SIZE + 1 + file->of_ra_window;
+    if (end > first) {
+        readahead_submit(file->of_inumber, first, end - first);
+        file->of_ra_issued = end;
+    }
+}
+
+/*
+ * Position inside an I/O vector.
+ */
+typedef struct {
+    struct iovec const *ic_iov;
+    size_t ic_offset;
+} iov_cursor_t;
+
+/*
+ * Computes the total length of an I/O vector.
+ * Input:
+ *  - the I/O vector and its number of elements
+ * Returns: the total length if successful, -1 if the vector is invalid
+ */
+static ssize_t iov_length(struct iovec const *iov, int iovcnt) {
+    if (iov == NULL || iovcnt < 0) {
+        return -1;
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - length) {
+            return -1;
+        }
+        length += iov[i].iov_len;
+    }
+
+    return (ssize_t)length;
+}
+
+/*
+ * Copies bytes from an I/O vector to a buffer, advancing the cursor.
+ * Inputs:
+ *  - destination buffer
+ *  - cursor into the source I/O vector
+ *  - number of bytes to copy (at most the bytes left in the vector)
+ *  - whether to bypass the caches (see block_copy_stream)
+ */
+static void iov_gather(void *dst, iov_cursor_t *cursor, size_t len,
+                       bool stream) {
+    for (size_t copied = 0; copied < len;) {
+        struct iovec const *v = cursor->ic_iov;
+        size_t n = v->iov_len - cursor->ic_offset;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+
+        if (stream) {
+            block_copy_stream(dst + copied, v->iov_base + cursor->ic_offset, n);
+        } else {
+            block_copy(dst + copied, v->iov_base + cursor->ic_offset, n);
+        }
+        copied += n;
+        cursor->ic_offset += n;
+        if (cursor->ic_offset == v->iov_len) {
+            cursor->ic_iov++;
+            cursor->ic_offset = 0;
+        }
+    }
+}
+
+/*
+ * Copies bytes from a buffer to an I/O vector, advancing the cursor.
+ * Inputs:
+ *  - cursor into the destination I/O vector
+ *  - source buffer
+ *  - number of bytes to copy (at most the bytes left in the vector)
+ */
+static void iov_scatter(iov_cursor_t *cursor, void const *src, size_t len) {
+    for (size_t copied = 0; copied < len;) {
+        struct iovec const *v = cursor->ic_iov;
+        size_t n = v->iov_len - cursor->ic_offset;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+
+        block_copy(v->iov_base + cursor->ic_offset, src + copied, n);
+        copied += n;
+        cursor->ic_offset += n;
+        if (cursor->ic_offset == v->iov_len) {
+            cursor->ic_iov++;
+            cursor->ic_offset = 0;
+        }
+    }
+}
+
+/*
+ * Advances a cursor into an I/O vector.
+ * Inputs:
+ *  - the cursor
+ *  - number of bytes to skip (at most the bytes left in the vector)
+ */
+static void iov_skip(iov_cursor_t *cursor, size_t len) {
+    while (len > 0) {
+        size_t n = cursor->ic_iov->iov_len - cursor->ic_offset;
+        if (n > len) {
+            n = len;
+        }
+
+        len -= n;
+        cursor->ic_offset += n;
+        if (cursor->ic_offset == cursor->ic_iov->iov_len) {
+            cursor->ic_iov++;
+            cursor->ic_offset = 0;
+        }
+    }
+}
+
+/*
+ * Computes the CRC32C of the next bytes of an I/O vector (as data_block_crc
+ * does for a block), without advancing the cursor.
+ * Inputs:
+ *  - cursor into the I/O vector
+ *  - number of bytes (at most the bytes left in the vector)
+ */
+static uint32_t iov_crc(iov_cursor_t cursor, size_t len) {
+    uint32_t crc = ~0u;
+    for (size_t done = 0; done < len;) {
+        struct iovec const *v = cursor.ic_iov;
+        size_t n = v->iov_len - cursor.ic_offset;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        crc = block_crc32c(crc, v->iov_base + cursor.ic_offset, n);
+        done += n;
+        cursor.ic_iov++;
+        cursor.ic_offset = 0;
+    }
+
+    return ~crc;
+}
+
+/*
+ * Compares the next bytes of an I/O vector with a buffer, without advancing
+ * the cursor.
+ * Inputs:
+ *  - cursor into the I/O vector
+ *  - the buffer and the number of bytes (at most the bytes left in the vector)
+ * Returns true if the bytes are equal, false otherwise.
+ */
+static bool iov_equal(iov_cursor_t cursor, void const *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        struct iovec const *v = cursor.ic_iov;
+        size_t n = v->iov_len - cursor.ic_offset;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        if (memcmp(v->iov_base + cursor.ic_offset, buf + done, n) != 0) {
+            return false;
+        }
+        done += n;
+        cursor.ic_iov++;
+        cursor.ic_offset = 0;
+    }
+
+    return true;
+}
+
+/*
+ * Looks for an indexed data block with the same contents as the next block of
+ * an I/O vector, and takes a reference to it.
+ * Inputs:
+ *  - cursor into the I/O vector (at least a block must be left)
+ *  - the CRC32C of the vector's next block (see iov_crc)
+ * Returns the block found, or -1 if there is none.
+ */
+static int dedup_find(iov_cursor_t const *cursor, uint32_t crc) {
+    size_t bucket = crc % fs->data_blocks;
+    pthread_mutex_t *mutex = &fs->dedup_mutex[bucket % DEDUP_LOCKS];
+    if (pthread_mutex_lock(mutex)) {
+        return -1;
+    }
+
+    /* Indexed blocks are not written, nor freed without the mutex */
+    int found = -1;
+    for (int b = fs->dedup_buckets[bucket]; b != -1; b = fs->dedup_next[b]) {
+        if (__atomic_load_n(&fs->block_crc[b], __ATOMIC_RELAXED) != crc) {
+            continue;
+        }
+
+        void const *block = data_block_get(b);
+        if (block != NULL && iov_equal(*cursor, block, BLOCK_SIZE)) {
+            if (data_blocks_share(&b, 1) == 0) {
+                found = b;
+            }
+            break;
+        }
+    }
+
+    if (pthread_mutex_unlock(mutex)) {
+        if (found != -1) {
+            data_block_free(found);
+        }
+        return -1;
+    }
+
+    return found;
+}
+
+/*
+ * Adds one of an i-node's data blocks, whose checksum is set, to the
+ * deduplication index, unsafely. The index takes a reference to the block, so
+ * the i-node copies the block before writing to it.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - the block index
+ */
+static void inode_dedup_index_unsafe(int inumber, int block_number) {
+    uint32_t crc =
+        __atomic_load_n(&fs->block_crc[block_number], __ATOMIC_RELAXED);
+    size_t bucket = crc % fs->data_blocks;
+    pthread_mutex_t *mutex = &fs->dedup_mutex[bucket % DEDUP_LOCKS];
+    if (pthread_mutex_lock(mutex)) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&fs->data_blocks_mutex)) {
+        pthread_mutex_unlock(mutex);
+        return;
+    }
+
+    if (!fs->block_indexed[block_number]) {
+        fs->block_indexed[block_number] = true;
+        fs->block_refs[block_number] += 1;
+        fs->dedup_next[block_number] = fs->dedup_buckets[bucket];
+        fs->dedup_buckets[bucket] = block_number;
+        data_block_logged(block_number);
+        image_logged(&fs->dedup_buckets[bucket], sizeof(int));
+        fs->inode_table[inumber].i_shared = 1;
+    }
+
+    pthread_mutex_unlock(&fs->data_blocks_mutex);
+    pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Makes one of an i-node's blocks share an indexed data block with the same
+ * contents as the next block of an I/O vector, or a hole if they are zeros,
+ * unsafely.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - index of the block
+ *  - cursor into the I/O vector (at least a block must be left)
+ *  - the CRC32C of the vector's next block (see iov_crc)
+ * Returns 1 if the block now holds the vector's contents, 0 if they must be
+ * written, -1 if the operation failed.
+ */
+static int inode_dedup_block_unsafe(int inumber, size_t index,
+                                    iov_cursor_t const *cursor, uint32_t crc) {
+    int dup = -1;
+    if (crc != zero_block_crc || !iov_equal(*cursor, zero_block, BLOCK_SIZE)) {
+        dup = dedup_find(cursor, crc);
+        if (dup == -1) {
+            return 0;
+        }
+    }
+
+    /* The reference taken is the i-node's, unless it already had one */
+    int b = inode_get_block_unsafe(inumber, (int)index);
+    if (b == dup) {
+        if (dup != -1) {
+            data_block_free(dup);
+        }
+        return 1;
+    }
+
+    if (inode_set_block_unsafe(inumber, index, dup) == -1) {
+        if (dup != -1) {
+            data_block_free(dup);
+        }
+        return -1;
+    }
+
+    if (dup != -1) {
+        fs->inode_table[inumber].i_shared = 1;
+    }
+    return 1;
+}
+
+/*
+ * Copies data from an I/O vector into an i-node's blocks, starting at a given
+ * offset, unsafely. Each block touched is resolved only once, no matter how
+ * many vector elements it receives. With the write lock held, holes are
+ * filled with new blocks, zeroed around the data, and blocks shared with
+ * other i-nodes are copied before being written; whole blocks are
+ * deduplicated, if enabled.
+ * The caller must hold a lock on the i-node that keeps its blocks in place,
+ * and ensure no one else accesses the bytes written meanwhile; without the
+ * write lock, the range must have no holes nor shared blocks.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - cursor into the I/O vector to write, advanced past the bytes written
+ *  - number of bytes to write
+ *  - offset to start writing at
+ *  - whether the caller holds the write lock
+ * Returns the number of bytes written, lower than requested if a block could
+ * not be allocated.
+ */
+static size_t inode_copy_in_unsafe(int inumber, iov_cursor_t *cursor,
+                                   size_t to_write, size_t offset,
+                                   bool exclusive) {
+    /* Large writes are unlikely to be read back soon */
+    bool stream = to_write >= KERNELS_STREAM_MIN_SIZE;
+    size_t written = 0;
+    while (written < to_write) {
+        /* Get block index and offset */
+        int bi = (int)(offset / BLOCK_SIZE);
+        size_t block_offset = offset % BLOCK_SIZE;
+        size_t to_write_in_block =
+            block_offset + to_write - written < BLOCK_SIZE
+                ? to_write - written
+                : BLOCK_SIZE - block_offset;
+
+        /* Share an identical block instead of storing the data again */
+        bool dedup =
+            exclusive && fs->dedup_writes && to_write_in_block == BLOCK_SIZE;
+        if (dedup) {
+            int shared = inode_dedup_block_unsafe(
+                inumber, (size_t)bi, cursor, iov_crc(*cursor, BLOCK_SIZE));
+            if (shared == -1) {
+                break;
+            }
+            if (shared == 1) {
+                iov_skip(cursor, BLOCK_SIZE);
+                offset += BLOCK_SIZE;
+                written += BLOCK_SIZE;
+                continue;
+            }
+        }
+
+        /* Get the block, filling it in if it is a hole */
+        int b = inode_get_block_unsafe(inumber, bi);
+        bool filled = b == -1;
+        if (filled &&
+            (!exclusive || (b = inode_fill_hole_unsafe(inumber, bi)) == -1)) {
+            break;
+        }
+
+        /* Copy it if shared, unless it is about to be overwritten */
+        if (exclusive && !filled && fs->inode_table[inumber].i_shared &&
+            data_block_shared(b)) {
+            b = inode_unshare_block_unsafe(inumber, bi, b,
+                                           to_write_in_block < BLOCK_SIZE);
+            if (b == -1) {
+                break;
+            }
+        }
+
+        char *block = data_block_get(b);
+        if (block == NULL) {
+            break;
+        }
+
+        /* Holes read as zeros, and so must the rest of their new block */
+        if (filled) {
+            block_zero(block, block_offset);
+            block_zero(block + block_offset + to_write_in_block,
+                       BLOCK_SIZE - block_offset - to_write_in_block);
+        }
+
+        /* Write the data, updating the block's checksum: appends may write
+         * to other parts of the block meanwhile */
+        bool whole = filled || to_write_in_block == BLOCK_SIZE;
+        uint32_t before = 0;
+        atomic_fetch_add(&fs->block_crc_writers[b], 1);
+        if (!whole) {
+            before = block_crc32c(0, block + block_offset, to_write_in_block);
+        }
+        iov_gather(block + block_offset, cursor, to_write_in_block, stream);
+        if (whole) {
+            data_block_seal(b, block);
+        } else {
+            data_block_update_crc(b, block, block_offset, to_write_in_block,
+                                  before);
+        }
+        atomic_fetch_add(&fs->block_crc_gen[b], 1);
+        atomic_fetch_sub(&fs->block_crc_writers[b], 1);
+        if (dedup) {
+            inode_dedup_index_unsafe(inumber, b);
+        }
+        offset += to_write_in_block;
+        written += to_write_in_block;
+    }
+
+    return written;
+}
+
+/*
+ * Fills the holes in a range of an i-node's data with zeroed blocks, and
+ * copies the blocks in it shared with other i-nodes, so that the range can be
+ * written without the write lock, unsafely.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - offset and length of the range
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_make_writable_unsafe(int inumber, size_t offset,
+                                      size_t len) {
+    for (size_t bi = offset / BLOCK_SIZE; bi * BLOCK_SIZE < offset + len;
+         bi++) {
+        int b = inode_get_block_unsafe(inumber, (int)bi);
+        if (b != -1) {
+            if (fs->inode_table[inumber].i_shared && data_block_shared(b) &&
+                inode_unshare_block_unsafe(inumber, bi, b, true) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        b = inode_fill_hole_unsafe(inumber, bi);
+        void *block = b == -1 ? NULL : data_block_get(b);
+        if (block == NULL) {
+            return -1;
+        }
+        block_zero(block, BLOCK_SIZE);
+        data_block_seal(b, block);
+    }
+
+    return 0;
+}
+
+/*
+ * Drops the holes reserved past an i-node's data by a write that failed,
+ * unsafely.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - number of blocks the i-node had before the write
+ */
+static void inode_trim_unsafe(int inumber, size_t block_count) {
+    size_t size = fs->inode_table[inumber].i_size;
+    size_t used = size / BLOCK_SIZE + (size % BLOCK_SIZE != 0);
+    inode_release_blocks_unsafe(inumber,
+                                used > block_count ? used : block_count);
+}
+
+/*
+ * Reads a chunk of a compressed i-node's data unsafely, decompressing it if
+ * stored compressed. The bytes past the chunk's data read as zeros.
+ * The caller must hold the i-node's read lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - index of the chunk
+ *  - buffer to read the chunk to (COMPRESS_CHUNK_SIZE bytes)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_chunk_load_unsafe(int inumber, size_t chunk, char *buf) {
+    inode_t *inode = &fs->inode_table[inumber];
+    size_t first = chunk * COMPRESS_CHUNK_BLOCKS;
+    size_t packed_len = inode->i_chunk_len[chunk];
+    char packed[COMPRESS_CHUNK_SIZE];
+    char *dst = packed_len > 0 ? packed : buf;
+
+    /* Blocks past the i-node's last one are holes */
+    size_t count = COMPRESS_CHUNK_BLOCKS;
+    if (packed_len > 0) {
+        count = packed_len / BLOCK_SIZE + (packed_len % BLOCK_SIZE != 0);
+    }
+    for (size_t i = 0; i < count; i++) {
+        int b = first + i < inode->i_data_block_count
+                    ? inode_get_block_unsafe(inumber, (int)(first + i))
+                    : -1;
+        void const *block = b == -1 ? zero_block : data_block_get(b);
+        if (block == NULL || (b == -1 && packed_len > 0) ||
+            (b != -1 && fs->verify_reads &&
+             data_block_verify(b, block) == -1)) {
+            return -1;
+        }
+        block_copy(dst + i * BLOCK_SIZE, block, BLOCK_SIZE);
+    }
+
+    if (packed_len > 0) {
+        ssize_t len =
+            lz_decompress(packed, packed_len, buf, COMPRESS_CHUNK_SIZE);
+        if (len == -1) {
+            return -1;
+        }
+        block_zero(buf + len, COMPRESS_CHUNK_SIZE - (size_t)len);
+    }
+
+    return 0;
+}
+
+/*
+ * Stores a chunk of a compressed i-node's data unsafely, replacing its blocks:
+ * compressed, if that saves at least a block, or else as is, blocks of zeros
+ * being left as holes. The new blocks are all allocated before any block of
+ * the chunk is replaced, so the chunk is left as it was if that fails.
+ * The caller must hold the i-node's write lock, and have reserved the blocks
+ * holding the chunk's data.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - index of the chunk
+ *  - the chunk's data and its length (the bytes after it must be zeros)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_chunk_store_unsafe(int inumber, size_t chunk, char const *buf,
+                                    size_t len) {
+    inode_t *inode = &fs->inode_table[inumber];
+    size_t first = chunk * COMPRESS_CHUNK_BLOCKS;
+    size_t count = len / BLOCK_SIZE + (len % BLOCK_SIZE != 0);
+    char packed[COMPRESS_CHUNK_SIZE];
+    size_t packed_len =
+        count > 1 ? lz_compress(buf, len, packed, (count - 1) * BLOCK_SIZE) : 0;
+
+    /* Pick the blocks to store: the compressed bytes, or the data blocks
+     * holding anything other than zeros */
+    char const *src = packed_len > 0 ? packed : buf;
+    bool stored[COMPRESS_CHUNK_BLOCKS] = {false};
+    size_t needed = 0;
+    if (packed_len > 0) {
+        needed = packed_len / BLOCK_SIZE + (packed_len % BLOCK_SIZE != 0);
+        block_zero(packed + packed_len, needed * BLOCK_SIZE - packed_len);
+        for (size_t i = 0; i < needed; i++) {
+            stored[i] = true;
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            stored[i] = memcmp(buf + i * BLOCK_SIZE, zero_block, BLOCK_SIZE);
+            needed += stored[i];
+        }
+    }
+
+    int blocks[COMPRESS_CHUNK_BLOCKS];
+    if (needed > 0 && data_blocks_alloc(blocks, needed) == -1) {
+        return -1;
+    }
+
+    int refs[COMPRESS_CHUNK_BLOCKS];
+    for (size_t i = 0, next = 0; i < COMPRESS_CHUNK_BLOCKS; i++) {
+        refs[i] = stored[i] ? blocks[next++] : -1;
+        if (refs[i] == -1) {
+            continue;
+        }
+
+        char *block = data_block_get(refs[i]);
+        if (block == NULL) {
+            for (size_t j = 0; j < needed; j++) {
+                data_block_free(blocks[j]);
+            }
+            return -1;
+        }
+        block_copy(block, src + i * BLOCK_SIZE, BLOCK_SIZE);
+        data_block_seal(refs[i], block);
+    }
+
+    /* Replace the blocks last to first, so that the indirect block, if
+     * needed, is allocated before any block is replaced */
+    for (size_t i = COMPRESS_CHUNK_BLOCKS; i-- > 0;) {
+        if (first + i >= inode->i_data_block_count) {
+            continue;
+        }
+
+        if (inode_set_block_unsafe(inumber, first + i, refs[i]) == -1) {
+            for (size_t j = 0; j <= i; j++) {
+                data_block_free(refs[j]);
+            }
+            return -1;
+        }
+    }
+
+    inode->i_chunk_len[chunk] = (uint16_t)packed_len;
+    return 0;
+}
+
+/*
+ * Writes an I/O vector to a compressed i-node's data, starting at a given
+ * offset, unsafely. Each chunk touched is read (unless wholly overwritten),
+ * modified and stored again.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to write and its number of elements
+ *  - offset to start writing at
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+static ssize_t inode_compressed_writev_unsafe(int inumber,
+                                              struct iovec const *iov,
+                                              int iovcnt, size_t offset) {
+    inode_t *inode = &fs->inode_table[inumber];
+
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1 || offset > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    size_t to_write = (size_t)length;
+    if (to_write > MAX_FILE_SIZE - offset) {
+        to_write = MAX_FILE_SIZE - offset;
+    }
+
+    if (to_write == 0) {
+        return 0;
+    }
+
+    size_t block_count = inode->i_data_block_count;
+    if (inode_reserve_unsafe(inumber, offset + to_write) == -1) {
+        return -1;
+    }
+
+    size_t size = inode->i_size > offset + to_write ? inode->i_size
+                                                    : offset + to_write;
+    char buf[COMPRESS_CHUNK_SIZE];
+    iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+    size_t written = 0;
+    while (written < to_write) {
+        size_t chunk = (offset + written) / COMPRESS_CHUNK_SIZE;
+        size_t start = chunk * COMPRESS_CHUNK_SIZE;
+        size_t chunk_offset = offset + written - start;
+        size_t n = COMPRESS_CHUNK_SIZE - chunk_offset;
+        if (n > to_write - written) {
+            n = to_write - written;
+        }
+
+        /* Data the write leaves in place must be read first */
+        if (chunk_offset > 0 || start + n < inode->i_size) {
+            if (inode_chunk_load_unsafe(inumber, chunk, buf) == -1) {
+                break;
+            }
+        } else {
+            block_zero(buf + n, COMPRESS_CHUNK_SIZE - n);
+        }
+
+        iov_gather(buf + chunk_offset, &cursor, n, false);
+        size_t len = size - start < COMPRESS_CHUNK_SIZE ? size - start
+                                                        : COMPRESS_CHUNK_SIZE;
+        if (inode_chunk_store_unsafe(inumber, chunk, buf, len) == -1) {
+            break;
+        }
+        written += n;
+    }
+
+    /* Update the size of the file, keeping a partial write */
+    if (written > 0 && offset + written > inode->i_size) {
+        __atomic_store_n(&inode->i_size, offset + written, __ATOMIC_RELEASE);
+    }
+
+    if (written < to_write) {
+        inode_trim_unsafe(inumber, block_count);
+        if (written == 0) {
+            return -1;
+        }
+    }
+
+    return (ssize_t)written;
+}
+
+/*
+ * Reads from a compressed i-node's data into an I/O vector, unsafely. Only the
+ * chunks touched are decompressed.
+ * The caller must hold the i-node's read lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - cursor into the I/O vector to read to
+ *  - number of bytes to read (within the file)
+ *  - offset to start reading at
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_compressed_read_unsafe(int inumber, iov_cursor_t *cursor,
+                                        size_t to_read, size_t offset) {
+    char buf[COMPRESS_CHUNK_SIZE];
+    for (size_t read = 0; read < to_read;) {
+        size_t chunk = offset / COMPRESS_CHUNK_SIZE;
+        size_t chunk_offset = offset % COMPRESS_CHUNK_SIZE;
+        size_t n = COMPRESS_CHUNK_SIZE - chunk_offset;
+        if (n > to_read - read) {
+            n = to_read - read;
+        }
+
+        if (inode_chunk_load_unsafe(inumber, chunk, buf) == -1) {
+            return -1;
+        }
+        iov_scatter(cursor, buf + chunk_offset, n);
+        offset += n;
+        read += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes an I/O vector to an i-node's data, starting at a given offset,
+ * unsafely.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to write and its number of elements
+ *  - offset to start writing at
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+static ssize_t inode_writev_unsafe(int inumber, struct iovec const *iov,
+                                   int iovcnt, size_t offset) {
+    inode_t *inode = &fs->inode_table[inumber];
+    if (inode->i_compressed) {
+        return inode_compressed_writev_unsafe(inumber, iov, iovcnt, offset);
+    }
+
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1) {
+        return -1;
+    }
+
+    /* Check if offset is out of bounds; past the end of file, the bytes
+     * skipped are left as a hole */
+    if (offset > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    /* Determine how many bytes to write */
+    size_t to_write = (size_t)length;
+    if (to_write > MAX_FILE_SIZE - offset) {
+        to_write = MAX_FILE_SIZE - offset;
+    }
+
+    if (to_write == 0) {
+        return 0;
+    }
+
+    /* Extend the file with holes, then write the data, filling them */
+    size_t block_count = inode->i_data_block_count;
+    if (inode_reserve_unsafe(inumber, offset + to_write) == -1) {
+        return -1;
+    }
+
+    iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+    size_t written =
+        inode_copy_in_unsafe(inumber, &cursor, to_write, offset, true);
+
+    /* Update the size of the file, keeping a partial write */
+    if (written > 0 && offset + written > inode->i_size) {
+        __atomic_store_n(&inode->i_size, offset + written, __ATOMIC_RELEASE);
+    }
+
+    if (written < to_write) {
+        inode_trim_unsafe(inumber, block_count);
+        if (written == 0) {
+            return -1;
+        }
+    }
+
+    return (ssize_t)written;
+}
+
+/*
+ * Reads from an i-node's data into an I/O vector, starting at a given offset,
+ * unsafely. Each block touched is resolved only once, no matter how many
+ * vector elements it fills.
+ * The caller must hold the i-node's read lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to read to and its number of elements
+ *  - offset to start reading at
+ * Returns the number of bytes read, or -1 if the operation failed.
+ */
+static ssize_t inode_readv_unsafe(int inumber, struct iovec const *iov,
+                                  int iovcnt, size_t offset) {
+    inode_t *inode = &fs->inode_table[inumber];
+
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1) {
+        return -1;
+    }
+
+    /* Appends publish the file size without the write lock */
+    size_t size = __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+
+    /* Check if offset is out of bounds */
+    if (offset > size) {
+        return -1;
+    }
+
+    /* Determine how many bytes to read */
+    size_t to_read = (size_t)length;
+    if (to_read > size - offset) {
+        to_read = size - offset;
+    }
+
+    iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+    if (inode->i_compressed) {
+        return inode_compressed_read_unsafe(inumber, &cursor, to_read,
+                                            offset) == -1
+                   ? -1
+                   : (ssize_t)to_read;
+    }
+
+    /* Read the data from each necessary block */
+    for (size_t read = 0; read < to_read;) {
+        /* Get block index and offset */
+        int bi = (int)(offset / BLOCK_SIZE);
+        size_t block_offset = offset % BLOCK_SIZE;
+
+        /* Get the block; holes are not stored */
+        int b = inode_get_block_unsafe(inumber, bi);
+        void const *block = b == -1 ? zero_block : data_block_get(b);
+        if (block == NULL ||
+            (b != -1 && fs->verify_reads &&
+             data_block_verify(b, block) == -1)) {
+            return -1;
+        }
+
+        /* Read the data */
+        size_t to_read_in_block = block_offset + to_read - read < BLOCK_SIZE
+                                      ? to_read - read
+                                      : BLOCK_SIZE - block_offset;
+        iov_scatter(&cursor, block + block_offset, to_read_in_block);
+        offset += to_read_in_block;
+        read += to_read_in_block;
+    }
+
+    return (ssize_t)to_read;
+}
+
+/*
+ * Locks a range of an i-node's blocks, waiting for any conflicting range
+ * (overlapping it, where either is exclusive) to be unlocked.
+ * The caller must hold the i-node's read lock, so the i-node's block mapping
+ * and size do not change while ranges are locked.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - range: the range to lock, which must stay valid until unlocked
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_range_lock(int inumber, range_lock_t *range) {
+    if (pthread_mutex_lock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    for (range_lock_t *r = fs->inode_ranges[inumber]; r != NULL;) {
+        if (r->rl_first <= range->rl_last && range->rl_first <= r->rl_last &&
+            (r->rl_exclusive || range->rl_exclusive)) {
+            if (pthread_cond_wait(&fs->inode_range_cond[inumber],
+                                  &fs->inode_range_mutex[inumber])) {
+                pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+                return -1;
+            }
+
+            /* The list may have changed, so start over */
+            r = fs->inode_ranges[inumber];
+        } else {
+            r = r->rl_next;
+        }
+    }
+
+    range->rl_next = fs->inode_ranges[inumber];
+    fs->inode_ranges[inumber] = range;
+
+    if (pthread_mutex_unlock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Unlocks a range of an i-node's blocks locked by inode_range_lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - range: the range to unlock
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_range_unlock(int inumber, range_lock_t *range) {
+    if (pthread_mutex_lock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    for (range_lock_t **r = &fs->inode_ranges[inumber]; *r != NULL;
+         r = &(*r)->rl_next) {
+        if (*r == range) {
+            *r = range->rl_next;
+            break;
+        }
+    }
+
+    if (pthread_cond_broadcast(&fs->inode_range_cond[inumber])) {
+        pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes an I/O vector to an i-node's data, taking only the locks needed.
+ * A write that stays within the size of a file without holes nor blocks
+ * shared with other files (and so neither allocates blocks nor changes the
+ * size) only locks the i-node shared and the range of blocks it touches
+ * exclusively, so it runs in parallel with writes to other ranges. Any other
+ * write locks the whole i-node exclusively.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to write and its number of elements
+ *  - offset to start writing at, updated to where the write ended
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+static ssize_t inode_writev(int inumber, struct iovec const *iov, int iovcnt,
+                            size_t *offset) {
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1) {
+        return -1;
+    }
+
+    if (length > 0) {
+        if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+            return -1;
+        }
+
+        /* Filling holes, copying shared blocks, storing compressed chunks
+         * and deduplicating whole blocks needs the write lock */
+        size_t size =
+            __atomic_load_n(&fs->inode_table[inumber].i_size, __ATOMIC_ACQUIRE);
+        size_t aligned = (*offset + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        bool whole_block = aligned + BLOCK_SIZE <= *offset + (size_t)length;
+        if (*offset < size && (size_t)length <= size - *offset &&
+            fs->inode_table[inumber].i_hole_count == 0 &&
+            !fs->inode_table[inumber].i_shared &&
+            !fs->inode_table[inumber].i_compressed &&
+            !(fs->dedup_writes && whole_block)) {
+            range_lock_t range = {
+                .rl_first = *offset / BLOCK_SIZE,
+                .rl_last = (*offset + (size_t)length - 1) / BLOCK_SIZE,
+                .rl_exclusive = true,
+            };
+            if (inode_range_lock(inumber, &range) == -1) {
+                pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+                return -1;
+            }
+
+            /* Without the write lock: the blocks are in place and not
+             * shared, and the size does not change */
+            iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+            size_t copied = inode_copy_in_unsafe(
+                inumber, &cursor, (size_t)length, *offset, false);
+            ssize_t written = copied == 0 ? -1 : (ssize_t)copied;
+            *offset += copied;
+
+            if (inode_range_unlock(inumber, &range) == -1) {
+                pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+                return -1;
+            }
+
+            if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+                return -1;
+            }
+
+            return written;
+        }
+
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+            return -1;
+        }
+    }
+
+    if (inode_wrlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    ssize_t written = inode_writev_unsafe(inumber, iov, iovcnt, *offset);
+    if (written != -1) {
+        *offset += (size_t)written;
+    }
+
+    if (inode_wrunlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    return written;
+}
+
+/*
+ * Publishes the bytes of an append in the file size, once every append
+ * reserved before it is published, and ends the append.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - start and end of the bytes reserved by the append
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_append_publish(int inumber, size_t start, size_t end) {
+    if (pthread_mutex_lock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    while (fs->inode_append_published[inumber] != start) {
+        if (pthread_cond_wait(&fs->inode_append_cond[inumber],
+                              &fs->inode_range_mutex[inumber])) {
+            pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+            return -1;
+        }
+    }
+
+    /* Readers holding the i-node's read lock may load the size meanwhile */
+    __atomic_store_n(&fs->inode_table[inumber].i_size, end, __ATOMIC_RELEASE);
+    inode_logged(inumber);
+    fs->inode_append_published[inumber] = end;
+    atomic_fetch_sub(&fs->inode_append_inflight[inumber], 1);
+
+    if (pthread_cond_broadcast(&fs->inode_append_cond[inumber])) {
+        pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_range_mutex[inumber])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Appends an I/O vector to an i-node's data. Concurrent appends run in
+ * parallel: each reserves a range of bytes by advancing the i-node's append
+ * cursor, copies its data into that range with the i-node only locked
+ * shared, and then publishes the range in the file size, in reservation
+ * order. An exclusive lock is only taken, briefly, to allocate blocks when
+ * the reserved range does not fit in the i-node's blocks. Appends to
+ * compressed files, which store whole chunks, and appends that may be
+ * deduplicated hold the exclusive lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to write and its number of elements
+ *  - set to the offset where the write ended
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+static ssize_t inode_appendv(int inumber, struct iovec const *iov, int iovcnt,
+                             size_t *offset) {
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    if (fs->inode_table[inumber].i_compressed ||
+        (fs->dedup_writes && (size_t)length >= BLOCK_SIZE)) {
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber]) ||
+            inode_wrlock_quiesced(inumber) == -1) {
+            return -1;
+        }
+
+        size_t start = fs->inode_table[inumber].i_size;
+        ssize_t written = inode_writev_unsafe(inumber, iov, iovcnt, start);
+        if (written != -1) {
+            *offset = start + (size_t)written;
+        }
+
+        if (inode_wrunlock_quiesced(inumber) == -1) {
+            return -1;
+        }
+
+        return written;
+    }
+
+    /* Holding the read lock keeps the cursor valid from here on */
+    atomic_fetch_add(&fs->inode_append_inflight[inumber], 1);
+
+    /* Reserve the range if the blocks already hold it (and, as the file has
+     * neither holes nor shared blocks, are allocated and its own) */
+    size_t capacity = fs->inode_table[inumber].i_data_block_count * BLOCK_SIZE;
+    bool shared = fs->inode_table[inumber].i_shared ||
+                  fs->inode_table[inumber].i_hole_count > 0;
+    size_t start = atomic_load(&fs->inode_append_cursor[inumber]);
+    size_t len;
+    bool reserved = false;
+    do {
+        len = (size_t)length;
+        if (len > MAX_FILE_SIZE - start) {
+            len = MAX_FILE_SIZE - start;
+        }
+
+        if (start + len > capacity || shared) {
+            break;
+        }
+
+        reserved = atomic_compare_exchange_weak(
+            &fs->inode_append_cursor[inumber], &start, start + len);
+    } while (!reserved);
+
+    /* Otherwise, reserve it while allocating (or copying) the blocks for it */
+    if (!reserved) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        if (pthread_rwlock_wrlock(&fs->inode_lock_table[inumber])) {
+            atomic_fetch_sub(&fs->inode_append_inflight[inumber], 1);
+            return -1;
+        }
+
+        start = atomic_load(&fs->inode_append_cursor[inumber]);
+        len = (size_t)length;
+        if (len > MAX_FILE_SIZE - start) {
+            len = MAX_FILE_SIZE - start;
+        }
+
+        size_t block_count = fs->inode_table[inumber].i_data_block_count;
+        if (inode_reserve_unsafe(inumber, start + len) == -1 ||
+            inode_make_writable_unsafe(inumber, start, len) == -1) {
+            inode_release_blocks_unsafe(inumber, block_count);
+            pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+            pthread_mutex_lock(&fs->inode_range_mutex[inumber]);
+            atomic_fetch_sub(&fs->inode_append_inflight[inumber], 1);
+            pthread_cond_broadcast(&fs->inode_append_cond[inumber]);
+            pthread_mutex_unlock(&fs->inode_range_mutex[inumber]);
+            return -1;
+        }
+
+        atomic_store(&fs->inode_append_cursor[inumber], start + len);
+
+        /* Truncations wait for this append, so the range stays reserved */
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber]) ||
+            pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+            inode_append_publish(inumber, start, start + len);
+            return -1;
+        }
+    }
+
+    /* No one else reads or writes past the file size */
+    iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+    size_t copied = inode_copy_in_unsafe(inumber, &cursor, len, start, false);
+    int result = copied == len ? 0 : -1;
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        result = -1;
+    }
+
+    if (inode_append_publish(inumber, start, start + len) == -1 ||
+        result == -1) {
+        return -1;
+    }
+
+    *offset = start + len;
+    return (ssize_t)len;
+}
+
+/*
+ * Makes an i-node a copy of another, unsafely. The copy shares the data
+ * blocks of the original, each i-node copying a shared block only when
+ * writing to it, so no data is copied here.
+ * The caller must hold both i-nodes' write locks.
+ * Inputs:
+ *  - src: identifier of the i-node to copy
+ *  - dst: identifier of the i-node whose data is replaced by the copy
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_clone_unsafe(int src, int dst) {
+    inode_t *src_inode = &fs->inode_table[src];
+    inode_t *dst_inode = &fs->inode_table[dst];
+    if (fs->free_inode_ts[src] == FREE || fs->free_inode_ts[dst] == FREE ||
+        src_inode->i_node_type != T_FILE || dst_inode->i_node_type != T_FILE) {
+        return -1;
+    }
+
+    /* Drop the destination's data */
+    if (inode_wait_unpinned_unsafe(dst) == -1 ||
+        inode_release_blocks_unsafe(dst, 0) == -1) {
+        return -1;
+    }
+    dst_inode->i_size = 0;
+
+    if (data_blocks_share(src_inode->i_data_block, INODE_DIRECT_REFS) == -1) {
+        return -1;
+    }
+
+    /* The indirect references are shared through a copy of their block */
+    if (src_inode->i_data_extension_block != -1) {
+        int ext = data_block_alloc();
+        int *dst_refs = ext == -1 ? NULL : (int *)data_block_get(ext);
+        int const *src_refs =
+            (int *)data_block_get(src_inode->i_data_extension_block);
+        if (dst_refs == NULL || src_refs == NULL ||
+            data_blocks_share(src_refs, MAX_INDIRECT_REFS) == -1) {
+            /* Drop the references to the direct blocks shared above */
+            data_block_free(ext);
+            for (size_t i = 0; i < INODE_DIRECT_REFS; i++) {
+                if (src_inode->i_data_block[i] != -1) {
+                    data_block_free(src_inode->i_data_block[i]);
+                }
+            }
+            return -1;
+        }
+
+        block_copy(dst_refs, src_refs, BLOCK_SIZE);
+        image_logged(dst_refs, BLOCK_SIZE);
+        dst_inode->i_data_extension_block = ext;
+    }
+
+    memcpy(dst_inode->i_data_block, src_inode->i_data_block,
+           sizeof(dst_inode->i_data_block));
+    dst_inode->i_data_block_count = src_inode->i_data_block_count;
+    dst_inode->i_hole_count = src_inode->i_hole_count;
+    dst_inode->i_size = src_inode->i_size;
+    dst_inode->i_compressed = src_inode->i_compressed;
+    memcpy(dst_inode->i_chunk_len, src_inode->i_chunk_len,
+           sizeof(dst_inode->i_chunk_len));
+    src_inode->i_shared = 1;
+    dst_inode->i_shared = 1;
+
+    return 0;
+}
+
+/*
+ * Makes an i-node a copy of another, sharing its data blocks (see
+ * inode_clone_unsafe).
+ * Inputs:
+ *  - src: identifier of the i-node to copy
+ *  - dst: identifier of the i-node whose data is replaced by the copy
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_clone(int src, int dst) {
+    if (!valid_inumber(src) || !valid_inumber(dst) || src == dst) {
+        return -1;
+    }
+
+    // simulate storage access delay (to both i-nodes)
+    insert_delay();
+    insert_delay();
+
+    /* Lock the i-nodes in order, so that concurrent clones do not deadlock */
+    int first = src < dst ? src : dst;
+    int second = src < dst ? dst : src;
+    if (inode_wrlock_quiesced(first) == -1) {
+        return -1;
+    }
+
+    if (inode_wrlock_quiesced(second) == -1) {
+        inode_wrunlock_quiesced(first);
+        return -1;
+    }
+
+    int result = inode_clone_unsafe(src, dst);
+
+    if (inode_wrunlock_quiesced(second) == -1) {
+        inode_wrunlock_quiesced(first);
+        return -1;
+    }
+
+    if (inode_wrunlock_quiesced(first) == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Copies a range of an i-node's data into another i-node (or elsewhere in the
+ * same one), unsafely. Blocks wholly within the range, and aligned in both
+ * i-nodes, are shared (see inode_clone_unsafe) instead of copied; the rest of
+ * the data is copied block to block.
+ * The caller must hold both i-nodes' write locks.
+ * Inputs:
+ *  - src: identifier of the i-node to copy from
+ *  - src_offset: offset of the range in the source
+ *  - dst: identifier of the i-node to copy to
+ *  - dst_offset: offset to copy the range to
+ *  - len: length of the range
+ * Returns the number of bytes copied, or -1 if the operation failed.
+ */
+static ssize_t inode_copy_range_unsafe(int src, size_t src_offset, int dst,
+                                       size_t dst_offset, size_t len) {
+    inode_t *src_inode = &fs->inode_table[src];
+    inode_t *dst_inode = &fs->inode_table[dst];
+    if (fs->free_inode_ts[src] == FREE || fs->free_inode_ts[dst] == FREE ||
+        src_inode->i_node_type != T_FILE || dst_inode->i_node_type != T_FILE) {
+        return -1;
+    }
+
+    /* Check if the offsets are out of bounds */
+    if (src_offset > src_inode->i_size || dst_offset > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    /* Determine how many bytes to copy */
+    if (len > src_inode->i_size - src_offset) {
+        len = src_inode->i_size - src_offset;
+    }
+    if (len > MAX_FILE_SIZE - dst_offset) {
+        len = MAX_FILE_SIZE - dst_offset;
+    }
+
+    /* Ranges of the same file must not overlap */
+    if (src == dst && src_offset < dst_offset + len &&
+        dst_offset < src_offset + len) {
+        return -1;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    /* Compressed chunks do not map to blocks: the data goes through a buffer */
+    if (src_inode->i_compressed || dst_inode->i_compressed) {
+        char *buf = malloc(len);
+        if (buf == NULL) {
+            return -1;
+        }
+
+        struct iovec iov = {.iov_base = buf, .iov_len = len};
+        ssize_t copied = inode_readv_unsafe(src, &iov, 1, src_offset);
+        if (copied != -1) {
+            iov.iov_len = (size_t)copied;
+            copied = inode_writev_unsafe(dst, &iov, 1, dst_offset);
+        }
+
+        free(buf);
+        return copied;
+    }
+
+    size_t block_count = dst_inode->i_data_block_count;
+    if (inode_reserve_unsafe(dst, dst_offset + len) == -1) {
+        return -1;
+    }
+
+    size_t copied = 0;
+    while (copied < len) {
+        size_t from = src_offset + copied;
+        size_t to = dst_offset + copied;
+        int sb = inode_get_block_unsafe(src, (int)(from / BLOCK_SIZE));
+
+        size_t n;
+        if (from % BLOCK_SIZE == 0 && to % BLOCK_SIZE == 0 &&
+            len - copied >= BLOCK_SIZE) {
+            /* Share the whole block (or hole) */
+            n = BLOCK_SIZE;
+            size_t dbi = to / BLOCK_SIZE;
+            if (inode_get_block_unsafe(dst, (int)dbi) == sb) {
+                copied += n;
+                continue;
+            }
+
+            if (sb != -1 && data_blocks_share(&sb, 1) == -1) {
+                break;
+            }
+
+            if (inode_set_block_unsafe(dst, dbi, sb) == -1) {
+                data_block_free(sb);
+                break;
+            }
+
+            if (sb != -1) {
+                src_inode->i_shared = 1;
+                dst_inode->i_shared = 1;
+            }
+        } else {
+            /* Copy up to the end of either block */
+            n = BLOCK_SIZE - from % BLOCK_SIZE;
+            if (n > BLOCK_SIZE - to % BLOCK_SIZE) {
+                n = BLOCK_SIZE - to % BLOCK_SIZE;
+            }
+            if (n > len - copied) {
+                n = len - copied;
+            }
+
+            char const *block = sb == -1 ? zero_block : data_block_get(sb);
+            if (block == NULL) {
+                break;
+            }
+
+            struct iovec iov = {
+                .iov_base = (void *)(block + from % BLOCK_SIZE),
+                .iov_len = n,
+            };
+            iov_cursor_t cursor = {.ic_iov = &iov, .ic_offset = 0};
+            if (inode_copy_in_unsafe(dst, &cursor, n, to, true) != n) {
+                break;
+            }
+        }
+
+        copied += n;
+    }
+
+    /* Update the size of the destination, keeping a partial copy */
+    if (copied > 0 && dst_offset + copied > dst_inode->i_size) {
+        dst_inode->i_size = dst_offset + copied;
+    }
+
+    if (copied < len) {
+        inode_trim_unsafe(dst, block_count);
+        if (copied == 0) {
+            return -1;
+        }
+    }
+
+    return (ssize_t)copied;
+}
+
+/*
+ * Replaces an i-node's data with the given bytes, unsafely. All the blocks
+ * needed are allocated at once, and the data is copied straight into them.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - the new data and its length (at most the maximum file size)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_replace_data_unsafe(int inumber, void const *data,
+                                     size_t len) {
+    inode_t *inode = &fs->inode_table[inumber];
+    if (fs->free_inode_ts[inumber] == FREE || inode->i_node_type != T_FILE ||
+        len > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    /* Drop the current data */
+    if (inode_wait_unpinned_unsafe(inumber) == -1 ||
+        inode_release_blocks_unsafe(inumber, 0) == -1) {
+        return -1;
+    }
+    inode->i_size = 0;
+
+    if (inode->i_compressed) {
+        struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+        if (len > 0 &&
+            inode_writev_unsafe(inumber, &iov, 1, 0) != (ssize_t)len) {
+            inode_release_blocks_unsafe(inumber, 0);
+            inode->i_size = 0;
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Allocate the data blocks, and the indirect block if needed */
+    size_t count = len / BLOCK_SIZE + (len % BLOCK_SIZE != 0);
+    size_t indirect = count > INODE_DIRECT_REFS ? 1 : 0;
+    int blocks[INODE_DIRECT_REFS + MAX_INDIRECT_REFS + 1];
+    if (count == 0) {
+        return 0;
+    }
+
+    if (data_blocks_alloc(blocks, count + indirect) == -1) {
+        return -1;
+    }
+
+    int *indirect_refs = NULL;
+    if (indirect) {
+        indirect_refs = (int *)data_block_get(blocks[count]);
+        if (indirect_refs == NULL) {
+            for (size_t i = 0; i < count + indirect; i++) {
+                data_block_free(blocks[i]);
+            }
+            return -1;
+        }
+
+        block_fill(indirect_refs, 0xff, BLOCK_SIZE); // all -1
+        image_logged(indirect_refs, BLOCK_SIZE);
+        inode->i_data_extension_block = blocks[count];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (i < INODE_DIRECT_REFS) {
+            inode->i_data_block[i] = blocks[i];
+        } else {
+            indirect_refs[i - INODE_DIRECT_REFS] = blocks[i];
+        }
+    }
+    inode->i_data_block_count = count;
+
+    /* Copy the data into the blocks, zeroing the end of the last one */
+    for (size_t i = 0; i < count; i++) {
+        char *block = data_block_get(blocks[i]);
+        if (block == NULL) {
+            inode_release_blocks_unsafe(inumber, 0);
+            return -1;
+        }
+
+        size_t n = len - i * BLOCK_SIZE < BLOCK_SIZE ? len - i * BLOCK_SIZE
+                                                     : BLOCK_SIZE;
+        if (len >= KERNELS_STREAM_MIN_SIZE) {
+            block_copy_stream(block, (char const *)data + i * BLOCK_SIZE, n);
+        } else {
+            block_copy(block, (char const *)data + i * BLOCK_SIZE, n);
+        }
+        block_zero(block + n, BLOCK_SIZE - n);
+        data_block_seal(blocks[i], block);
+    }
+
+    inode->i_size = len;
+    return 0;
+}
+
+/*
+ * Replaces an i-node's data with the given bytes (see
+ * inode_replace_data_unsafe).
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - the new data and its length
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_replace_data(int inumber, void const *data, size_t len) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (inode_wrlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    int result = inode_replace_data_unsafe(inumber, data, len);
+
+    if (inode_wrunlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Sets an i-node's size, unsafely. Shrinking frees exactly the blocks past the
+ * new size (and the indirect block, once no reference in it is used) and
+ * zeros the rest of the new last block; growing leaves a hole.
+ * The caller must hold the i-node's write lock.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - the new size (at most the maximum file size)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_truncate_unsafe(int inumber, size_t len) {
+    inode_t *inode = &fs->inode_table[inumber];
+    if (fs->free_inode_ts[inumber] == FREE || inode->i_node_type != T_FILE ||
+        len > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    if (len >= inode->i_size) {
+        /* The bytes past the old size are already zeros */
+        if (inode_reserve_unsafe(inumber, len) == -1) {
+            return -1;
+        }
+        __atomic_store_n(&inode->i_size, len, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    /* A compressed chunk cut short is stored again without its tail */
+    size_t chunk_offset = len % COMPRESS_CHUNK_SIZE;
+    if (inode->i_compressed && chunk_offset != 0) {
+        char buf[COMPRESS_CHUNK_SIZE];
+        size_t chunk = len / COMPRESS_CHUNK_SIZE;
+        if (inode_chunk_load_unsafe(inumber, chunk, buf) == -1) {
+            return -1;
+        }
+        block_zero(buf + chunk_offset, COMPRESS_CHUNK_SIZE - chunk_offset);
+        if (inode_chunk_store_unsafe(inumber, chunk, buf, chunk_offset) ==
+            -1) {
+            return -1;
+        }
+    }
+
+    size_t count = len / BLOCK_SIZE + (len % BLOCK_SIZE != 0);
+    if (inode_wait_unpinned_unsafe(inumber) == -1 ||
+        inode_release_blocks_unsafe(inumber, count) == -1) {
+        return -1;
+    }
+
+    /* Zero the tail of the last block, so that growing the file again reads
+     * zeros there; a shared block gets its own copy first */
+    int b = count == 0 ? -1 : inode_get_block_unsafe(inumber, (int)count - 1);
+    if (b != -1 && len % BLOCK_SIZE != 0 && !inode->i_compressed) {
+        if (data_block_shared(b)) {
+            b = inode_unshare_block_unsafe(inumber, count - 1, b, true);
+        }
+        char *block = b == -1 ? NULL : data_block_get(b);
+        if (block == NULL) {
+            return -1;
+        }
+        block_zero(block + len % BLOCK_SIZE, BLOCK_SIZE - len % BLOCK_SIZE);
+        data_block_seal(b, block);
+    }
+
+    __atomic_store_n(&inode->i_size, len, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Sets an i-node's size (see inode_truncate_unsafe).
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - the new size
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_truncate(int inumber, size_t len) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (inode_wrlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    int result = inode_truncate_unsafe(inumber, len);
+
+    if (inode_wrunlock_quiesced(inumber) == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Writes an I/O vector to a host file descriptor, resuming after partial
+ * writes, in as few system calls as the host allows.
+ * Inputs:
+ *  - fd: host file descriptor
+ *  - I/O vector to write (modified) and its number of elements
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int fd_writev_all(int fd, struct iovec *iov, size_t iovcnt) {
+    long iov_max = sysconf(_SC_IOV_MAX);
+    if (iov_max <= 0) {
+        iov_max = 16; // the minimum POSIX guarantees
+    }
+
+    while (iovcnt > 0) {
+        int batch = iovcnt < (size_t)iov_max ? (int)iovcnt : (int)iov_max;
+        ssize_t written = writev(fd, iov, batch);
+        if (written == -1) {
+            return -1;
+        }
+
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes an I/O vector to a host file descriptor at a given offset, one
+ * positional write per element, resuming after partial writes.
+ * Inputs:
+ *  - fd: host file descriptor
+ *  - I/O vector to write and its number of elements
+ *  - offset in the host file to write the first element at
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int fd_pwritev_all(int fd, struct iovec const *iov, size_t iovcnt,
+                          off_t offset) {
+    for (size_t i = 0; i < iovcnt; i++) {
+        char const *buffer = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            ssize_t written = pwrite(fd, buffer, left, offset);
+            if (written == -1) {
+                return -1;
+            }
+            buffer += written;
+            left -= (size_t)written;
+            offset += written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads from a host file descriptor at a given offset, resuming after partial
+ * reads.
+ * Inputs:
+ *  - fd: host file descriptor
+ *  - buffer to read into and its length
+ *  - offset in the host file to read from
+ * Returns 0 if successful, -1 otherwise (or if the file ends before).
+ */
+static int fd_pread_all(int fd, void *buffer, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buffer, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer = (char *)buffer + n;
+        len -= (size_t)n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes a range of an i-node's data to a host file descriptor, straight from
+ * its data blocks (holes are written as zeros). The i-node and the blocks in
+ * the range are locked shared for the whole export, so the data written is a
+ * consistent snapshot of the range.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - fd: host file descriptor
+ *  - offset and length of the range (clamped to the size of the i-node)
+ *  - positional: whether to write at the same offset in the host file,
+ *    instead of at the descriptor's current offset
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_export_range(int inumber, int fd, size_t offset, size_t len,
+                              bool positional) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    inode_t *inode = &fs->inode_table[inumber];
+    size_t size = __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+    if (fs->free_inode_ts[inumber] == FREE || inode->i_node_type != T_FILE) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    if (offset >= size || len == 0) {
+        return pthread_rwlock_unlock(&fs->inode_lock_table[inumber]) ? -1 : 0;
+    }
+
+    size_t end = len > size - offset ? size : offset + len;
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (end - 1) / BLOCK_SIZE;
+    range_lock_t range = {
+        .rl_first = first, .rl_last = last, .rl_exclusive = false};
+
+    /* Compressed data is decompressed into a buffer first */
+    if (inode->i_compressed) {
+        int result = -1;
+        char *buf = malloc(end - offset);
+        struct iovec iov = {.iov_base = buf, .iov_len = end - offset};
+        if (buf != NULL &&
+            inode_readv_unsafe(inumber, &iov, 1, offset) != -1) {
+            result = positional
+                         ? fd_pwritev_all(fd, &iov, 1, (off_t)offset)
+                         : fd_writev_all(fd, &iov, 1);
+        }
+
+        free(buf);
+        if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+            result = -1;
+        }
+        return result;
+    }
+
+    struct iovec *iov = malloc((last - first + 1) * sizeof(struct iovec));
+    if (iov == NULL) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    if (inode_range_lock(inumber, &range) == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        free(iov);
+        return -1;
+    }
+
+    /* Point the vector at the blocks, merging adjacent ones */
+    int result = 0;
+    size_t iovcnt = 0;
+    for (size_t bi = first; bi <= last; bi++) {
+        int b = inode_get_block_unsafe(inumber, (int)bi);
+        char const *block = b == -1 ? zero_block : data_block_get(b);
+        if (block == NULL) {
+            result = -1;
+            break;
+        }
+
+        size_t from = bi == first ? offset % BLOCK_SIZE : 0;
+        size_t to = bi == last ? end - bi * BLOCK_SIZE : BLOCK_SIZE;
+        struct iovec *prev = iovcnt > 0 ? &iov[iovcnt - 1] : NULL;
+        if (prev != NULL &&
+            (char *)prev->iov_base + prev->iov_len == block + from) {
+            prev->iov_len += to - from;
+        } else {
+            iov[iovcnt].iov_base = (void *)(block + from);
+            iov[iovcnt].iov_len = to - from;
+            iovcnt++;
+        }
+    }
+
+    if (result == 0) {
+        result = positional ? fd_pwritev_all(fd, iov, iovcnt, (off_t)offset)
+                            : fd_writev_all(fd, iov, iovcnt);
+    }
+
+    if (inode_range_unlock(inumber, &range) == -1) {
+        result = -1;
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        result = -1;
+    }
+
+    free(iov);
+    return result;
+}
+
+/*
+ * Writes an i-node's data to a host file descriptor, straight from its data
+ * blocks (holes are written as zeros). The i-node and its blocks are locked
+ * shared for the whole export, so the data written is a consistent snapshot.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - fd: host file descriptor, written from its current offset
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_export(int inumber, int fd) {
+    return inode_export_range(inumber, fd, 0, SIZE_MAX, false);
+}
+
+/*
+ * Writes a range of an i-node's data to the same offset of a host file, with
+ * positional writes, so several ranges of a file can be exported in parallel.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - fd: host file descriptor
+ *  - offset and length of the range (clamped to the size of the i-node)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_export_at(int inumber, int fd, size_t offset, size_t len) {
+    return inode_export_range(inumber, fd, offset, len, true);
+}
+
+/*
+ * Checks the data blocks in a range of an i-node's data against their
+ * checksums. The i-node and the blocks in the range are locked shared.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - offset and length of the range (clamped to the size of the i-node)
+ * Returns the number of blocks that do not match their checksums, or -1 if the
+ * operation failed.
+ */
+ssize_t inode_verify(int inumber, size_t offset, size_t len) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    inode_t *inode = &fs->inode_table[inumber];
+    size_t size = __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+    if (fs->free_inode_ts[inumber] == FREE || inode->i_node_type != T_FILE) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    if (offset >= size || len == 0) {
+        return pthread_rwlock_unlock(&fs->inode_lock_table[inumber]) ? -1 : 0;
+    }
+
+    size_t end = len > size - offset ? size : offset + len;
+    range_lock_t range = {.rl_first = offset / BLOCK_SIZE,
+                          .rl_last = (end - 1) / BLOCK_SIZE,
+                          .rl_exclusive = false};
+
+    /* Compressed bytes may lie in any block of the chunks touched */
+    if (inode->i_compressed) {
+        range.rl_first -= range.rl_first % COMPRESS_CHUNK_BLOCKS;
+        range.rl_last += COMPRESS_CHUNK_BLOCKS - 1 -
+                         range.rl_last % COMPRESS_CHUNK_BLOCKS;
+        if (range.rl_last >= inode->i_data_block_count) {
+            range.rl_last = inode->i_data_block_count - 1;
+        }
+    }
+
+    if (inode_range_lock(inumber, &range) == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    ssize_t corrupted = 0;
+    for (size_t bi = range.rl_first; bi <= range.rl_last; bi++) {
+        int b = inode_get_block_unsafe(inumber, (int)bi);
+        if (b == -1) {
+            continue;
+        }
+
+        void const *block = data_block_get(b);
+        if (block == NULL) {
+            corrupted = -1;
+            break;
+        }
+        if (data_block_verify(b, block) == -1) {
+            corrupted++;
+        }
+    }
+
+    if (inode_range_unlock(inumber, &range) == -1) {
+        corrupted = -1;
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        corrupted = -1;
+    }
+
+    return corrupted;
+}
+
+/*
+ * Returns the size of an i-node's data, or -1 if the i-node is not in use.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ */
+ssize_t inode_size(int inumber) {
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    ssize_t size = fs->free_inode_ts[inumber] == FREE
+                       ? -1
+                       : (ssize_t)__atomic_load_n(
+                             &fs->inode_table[inumber].i_size,
+                             __ATOMIC_ACQUIRE);
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    return size;
+}
+
+/*
+ * Reads from an i-node's data into an I/O vector. The i-node is locked shared
+ * and the range of blocks read is locked shared, so the read never observes
+ * a write partially applied.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - I/O vector to read to and its number of elements
+ *  - offset to start reading at, updated to where the read ended
+ *  - whether to read from the end of the file instead
+ * Returns the number of bytes read, or -1 if the operation failed.
+ */
+static ssize_t inode_readv(int inumber, struct iovec const *iov, int iovcnt,
+                           size_t *offset, bool to_end) {
+    ssize_t length = iov_length(iov, iovcnt);
+    if (length == -1) {
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    size_t size =
+        __atomic_load_n(&fs->inode_table[inumber].i_size, __ATOMIC_ACQUIRE);
+    if (to_end) {
+        *offset = size;
+    }
+
+    /* Only the blocks within the file are read */
+    range_lock_t range = {.rl_exclusive = false};
+    bool locked = length > 0 && *offset < size;
+    if (locked) {
+        size_t to_read = (size_t)length;
+        if (to_read > size - *offset) {
+            to_read = size - *offset;
+        }
+
+        range.rl_first = *offset / BLOCK_SIZE;
+        range.rl_last = (*offset + to_read - 1) / BLOCK_SIZE;
+        if (inode_range_lock(inumber, &range) == -1) {
+            pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+            return -1;
+        }
+    }
+
+    ssize_t read = inode_readv_unsafe(inumber, iov, iovcnt, *offset);
+    if (read != -1) {
+        *offset += (size_t)read;
+    }
+
+    if (locked && inode_range_unlock(inumber, &range) == -1) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        return -1;
+    }
+
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
+        return -1;
+    }
+
+    return read;
+}
+
+/*
+ * Writes back the contents of an open file's write-back buffer unsafely.
+ * The caller must hold the file entry mutex.
+ * Input:
+ *  - the open file entry
+ * Returns 0 if successful, -1 otherwise (the buffered data is dropped).
+ */
+static int open_file_flush_unsafe(open_file_entry_t *file) {
+    if (file->of_wbuf_len == 0) {
+        return 0;
+    }
+
+    size_t len = file->of_wbuf_len;
+    file->of_wbuf_len = 0;
+
+    struct iovec iov = {.iov_base = file->of_wbuf, .iov_len = len};
+    size_t offset = file->of_wbuf_offset;
+    ssize_t written = inode_writev(file->of_inumber, &iov, 1, &offset);
+
+    return written == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Writes back the write-back buffers of every open file handle of an i-node,
+ * except one, so that an access through that handle observes them.
+ * Must not be called while holding a file entry mutex.
+ * Inputs:
+ *  - inumber: identifier of the i-node
+ *  - file handle to skip (-1 for none)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int flush_other_buffers(int inumber, int except_fhandle) {
+    int own = valid_file_handle(except_fhandle) &&
+              fs->open_file_table[except_fhandle].of_buffered;
+    if (atomic_load(&fs->inode_buffered_count[inumber]) <= own) {
+        return 0;
+    }
+
+    int result = 0;
+    for (int i = 0; i < (int)fs->max_open_files; i++) {
+        open_file_entry_t *file = &fs->open_file_table[i];
+        if (i == except_fhandle) {
+            continue;
+        }
+
+        if (pthread_mutex_lock(&file->of_mutex)) {
+            return -1;
+        }
+
+        if (file->of_inumber == inumber &&
+            open_file_flush_unsafe(file) == -1) {
+            result = -1;
+        }
+
+        if (pthread_mutex_unlock(&file->of_mutex)) {
+            return -1;
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Writes back the write-back buffers of every open file handle of an i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns 0 if successful, -1 otherwise.
+ */
+int flush_file_buffers(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    return flush_other_buffers(inumber, -1);
+}
+
+/*
+ * Writes back the write-back buffer of an open file handle.
+ * Input:
+ *  - file handle to flush
+ * Returns 0 if successful, -1 otherwise.
+ */
+int flush_open_file(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
+
+    open_file_entry_t *file = &fs->open_file_table[fhandle];
+    if (pthread_mutex_lock(&file->of_mutex)) {
+        return -1;
+    }
+
+    int result = open_file_flush_unsafe(file);
+
+    if (pthread_mutex_unlock(&file->of_mutex)) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Buffers a small write to an open file unsafely, writing back the buffer
+ * whenever it reaches the end of a block.
+ * The caller must hold the file entry mutex.
+ * Inputs:
+ *  - the open file entry
+ *  - I/O vector to write and its total length
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+static ssize_t open_file_buffer_unsafe(open_file_entry_t *file,
+                                       struct iovec const *iov,
+                                       size_t length) {
+    /* The buffer only holds contiguous data */
+    if (file->of_wbuf_len > 0 &&
+        file->of_wbuf_offset + file->of_wbuf_len != file->of_offset) {
+        if (open_file_flush_unsafe(file) == -1) {
+            return -1;
+        }
+    }
+
+    iov_cursor_t cursor = {.ic_iov = iov, .ic_offset = 0};
+    for (size_t buffered = 0; buffered < length;) {
+        if (file->of_wbuf_len == 0) {
+            file->of_wbuf_offset = file->of_offset;
+        }
+
+        /* The buffer ends where the block of its first byte does */
+        size_t capacity = BLOCK_SIZE - file->of_wbuf_offset % BLOCK_SIZE;
+        size_t n = capacity - file->of_wbuf_len;
+        if (n > length - buffered) {
+            n = length - buffered;
+        }
+
+        iov_gather(file->of_wbuf + file->of_wbuf_len, &cursor, n, false);
+        file->of_wbuf_len += n;
+        file->of_offset += n;
+        buffered += n;
+
+        if (file->of_wbuf_len == capacity) {
+            if (open_file_flush_unsafe(file) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return (ssize_t)length;
+}
+
+/* Writes an I/O vector to an open file handle, as a single operation.
+ * Inputs:
+ *  - file handle to write to
+ *  - I/O vector to write and its number of elements
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+ssize_t writev_to_open_file(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
+
+    open_file_entry_t *file = &fs->open_file_table[fhandle];
+    if (flush_other_buffers(file->of_inumber, fhandle) == -1) {
+        return -1;
+    }
+
+    /* Lock the file entry mutex */
+    if (pthread_mutex_lock(&file->of_mutex)) {
+        return -1;
+    }
+
+    int inumber = file->of_inumber;
+
+    /* Small writes within the maximum file size go to the buffer, if any */
+    ssize_t length = iov_length(iov, iovcnt);
+    if (file->of_buffered && !file->of_append && length != -1 &&
+        length < BLOCK_SIZE && file->of_offset <= MAX_FILE_SIZE - length) {
+        ssize_t written = open_file_buffer_unsafe(file, iov, (size_t)length);
+        if (pthread_mutex_unlock(&file->of_mutex)) {
+            return -1;
+        }
+        return written;
+    }
+
+    /* Otherwise, the buffer must be written first */
+    if (open_file_flush_unsafe(file) == -1) {
+        pthread_mutex_unlock(&file->of_mutex);
+        return -1;
+    }
+
+    /* From the open file table entry, we get the inode */
+    if (inode_get(inumber) == NULL) {
+        pthread_mutex_unlock(&file->of_mutex);
+        return -1;
+    }
+
+    /* If opened in append mode, the offset is set to the end of file */
+    ssize_t written =
+        file->of_append
+            ? inode_appendv(inumber, iov, iovcnt, &file->of_offset)
+            : inode_writev(inumber, iov, iovcnt, &file->of_offset);
+
+    if (pthread_mutex_unlock(&file->of_mutex)) {
+        return -1;
+    }
+
+    return written;
+}
+
+/* Reads from an open file handle into an I/O vector, as a single operation.
+ * Inputs:
+ *  - file handle to read from
+ *  - I/O vector to read to and its number of elements
+ * Returns the number of bytes read, or -1 if the operation failed.
+ */
+ssize_t readv_from_open_file(int fhandle, struct iovec const *iov,
+                             int iovcnt) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
+
+    open_file_entry_t *file = &fs->open_file_table[fhandle];
+    if (flush_other_buffers(file->of_inumber, fhandle) == -1) {
+        return -1;
+    }
+
+    /* Lock the file entry mutex */
+    if (pthread_mutex_lock(&file->of_mutex)) {
+        return -1;
+    }
+
+    int inumber = file->of_inumber;
+
+    /* Reads must observe this handle's own buffered writes */
+    if (open_file_flush_unsafe(file) == -1) {
+        pthread_mutex_unlock(&file->of_mutex);
+        return -1;
+    }
+
+    /* From the open file table entry, we get the inode */
+    if (inode_get(inumber) == NULL) {
+        pthread_mutex_unlock(&file->of_mutex);
+        return -1;
+    }
+
+    /* If opened in append mode, the offset is set to the end of file */
+    ssize_t read = inode_readv(inumber, iov, iovcnt, &file->of_offset,
+                               file->of_append);
+    if (read > 0) {
+        open_file_readahead_unsafe(file, file->of_offset - (size_t)read,
+                                   (size_t)read);
+    }
+
+    if (pthread_mutex_unlock(&file->of_mutex)) {
+        return -1;
+    }
+
+    return read;
+}
+
+/* Writes to an open file handle.
+ * Inputs:
+ *  - file handle to write to
+ *  - buffer to write
+ *  - number of bytes to be written
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+ssize_t write_to_open_file(int fhandle, void const *buffer, size_t to_write) {
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+    return writev_to_open_file(fhandle, &iov, 1);
+}
+
+/* Reads from an open file handle.
+ * Inputs:
+ *  - file handle to read from
+ *  - buffer to read to
+ *  - number of bytes read
+ * Returns the number of bytes read, or -1 if the operation failed.
+ */
+ssize_t read_from_open_file(int fhandle, void *buffer, size_t to_read) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = to_read};
+    return readv_from_open_file(fhandle, &iov, 1);
+}
+
+/* Writes to an open file handle at a given offset, without using or changing
+ * the handle's current offset (the append flag is ignored). Writing past the
+ * end of file leaves a hole.
+ * Inputs:
+ *  - file handle to write to
+ *  - buffer to write
+ *  - number of bytes to be written
+ *  - offset to start writing at
+ * Returns the number of bytes written, or -1 if the operation failed.
+ */
+ssize_t pwrite_to_open_file(int fhandle, void const *buffer, size_t to_write,
+                            size_t offset) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
+
+    /* The i-node of an open file handle never changes, so there is no need to
+     * lock the file entry mutex */
+    int inumber = fs->open_file_table[fhandle].of_inumber;
+    if (inode_get(inumber) == NULL) {
+        return -1;
+    }
+
+    if (flush_other_buffers(inumber, -1) == -1) {
+        return -1;
+    }
+
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+    return inode_writev(inumber, &iov, 1, &offset);
+}
 
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+/* Reads from an open file handle at a given offset, without using or changing
+ * the handle's current offset.
+ * Inputs:
+ *  - file handle to read from
+ *  - buffer to read to
+ *  - number of bytes to read
+ *  - offset to start reading at
+ * Returns the number of bytes read, or -1 if the operation failed.
+ */
+ssize_t pread_from_open_file(int fhandle, void *buffer, size_t to_read,
+                             size_t offset) {
+    if (!valid_file_handle(fhandle)) {
         return -1;
     }
 
-    if (strlen(sub_name) == 0) {
+    /* The i-node of an open file handle never changes, so there is no need to
+     * lock the file entry mutex */
+    int inumber = fs->open_file_table[fhandle].of_inumber;
+    if (inode_get(inumber) == NULL) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
+    if (flush_other_buffers(inumber, -1) == -1) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            return 0;
-        }
-    }
-
-    return -1;
+    struct iovec iov = {.iov_base = buffer, .iov_len = to_read};
+    return inode_readv(inumber, &iov, 1, &offset, false);
 }
 
-/* Looks for a given name inside a directory, unsafely
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+/* Copies a range of an open file's data into another open file (or another
+ * range of the same file), at given offsets, without using or changing the
+ * handles' offsets (see inode_copy_range_unsafe).
+ * Inputs:
+ *  - file handle to copy from, and offset of the range in it
+ *  - file handle to copy to, and offset to copy the range to
+ *  - length of the range
+ * Returns the number of bytes copied, or -1 if the operation failed.
  */
-static int find_in_dir_unsafe(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
+ssize_t copy_between_open_files(int src_fhandle, size_t src_offset,
+                                int dst_fhandle, size_t dst_offset,
+                                size_t len) {
+    if (!valid_file_handle(src_fhandle) || !valid_file_handle(dst_fhandle)) {
+        return -1;
+    }
 
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+    /* The i-node of an open file handle never changes, so there is no need to
+     * lock the file entry mutexes */
+    int src = fs->open_file_table[src_fhandle].of_inumber;
+    int dst = fs->open_file_table[dst_fhandle].of_inumber;
+    if (inode_get(src) == NULL || inode_get(dst) == NULL) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
+    if (flush_other_buffers(src, -1) == -1 ||
+        (dst != src && flush_other_buffers(dst, -1) == -1)) {
         return -1;
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            return dir_entry[i].d_inumber;
-        }
+    /* Lock the i-nodes in order, so that concurrent copies do not deadlock */
+    int first = src < dst ? src : dst;
+    int second = src < dst ? dst : src;
+    if (inode_wrlock_quiesced(first) == -1) {
+        return -1;
     }
 
-    return -1;
-}
+    if (second != first && inode_wrlock_quiesced(second) == -1) {
+        inode_wrunlock_quiesced(first);
+        return -1;
+    }
 
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
- */
-int find_in_dir(int inumber, char const *sub_name) {
-    if (!valid_inumber(inumber)) {
+    ssize_t copied =
+        inode_copy_range_unsafe(src, src_offset, dst, dst_offset, len);
+
+    if (second != first && inode_wrunlock_quiesced(second) == -1) {
+        inode_wrunlock_quiesced(first);
         return -1;
     }
 
-    if (pthread_rwlock_rdlock(&inode_lock_table[inumber])) {
+    if (inode_wrunlock_quiesced(first) == -1) {
         return -1;
     }
 
-    int result = find_in_dir_unsafe(inumber, sub_name);
-    if (result == -1) {
-        pthread_rwlock_unlock(&inode_lock_table[inumber]);
+    return copied;
+}
+
+/* Sets the size of an open file, with any buffered writes to it applied first
+ * (see inode_truncate_unsafe). The file handle's offset is left unchanged.
+ * Inputs:
+ *  - file handle of the file
+ *  - the new size
+ * Returns 0 if successful, -1 otherwise.
+ */
+int truncate_open_file(int fhandle, size_t len) {
+    if (!valid_file_handle(fhandle)) {
         return -1;
     }
 
-    if (pthread_rwlock_unlock(&inode_lock_table[inumber])) {
+    /* The i-node of an open file handle never changes */
+    int inumber = fs->open_file_table[fhandle].of_inumber;
+    if (flush_file_buffers(inumber) == -1) {
         return -1;
     }
 
-    return result;
+    return inode_truncate(inumber, len);
 }
 
-/* Looks for a given name inside a directory, and if not found, creates a new
- * i-node for it.
- * Input:
- * 	- parent directory's i-node number
- *  - i-node type
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+/* Moves the offset of an open file handle.
+ * Inputs:
+ *  - file handle to seek
+ *  - offset to move to, relative to the reference point
+ *  - reference point: the start of the file, the current offset or the end of
+ *    the file; or, to find the first byte at or after the offset (which must
+ *    be within the file) that is data or part of a hole (the end of file
+ *    counting as a hole), respectively TFS_SEEK_DATA and TFS_SEEK_HOLE
+ * Returns the new offset, or -1 if the operation failed.
  */
-int create_in_dir(int inumber, inode_type type, char const *sub_name) {
-    if (!valid_inumber(inumber)) {
+off_t seek_open_file(int fhandle, off_t offset, seek_whence_t whence) {
+    if (!valid_file_handle(fhandle)) {
         return -1;
     }
 
-    if (pthread_mutex_lock(&inode_table_mutex)) {
+    open_file_entry_t *file = &fs->open_file_table[fhandle];
+    bool needs_size = whence != TFS_SEEK_SET && whence != TFS_SEEK_CUR;
+    if (needs_size && flush_other_buffers(file->of_inumber, fhandle) == -1) {
         return -1;
     }
 
-    if (pthread_rwlock_wrlock(&inode_lock_table[inumber])) {
-        pthread_mutex_unlock(&inode_table_mutex);
+    /* Lock the file entry mutex */
+    if (pthread_mutex_lock(&file->of_mutex)) {
         return -1;
     }
 
-    int sub_inumber = find_in_dir_unsafe(inumber, sub_name);
-    if (sub_inumber >= 0) {
-        if (pthread_rwlock_unlock(&inode_lock_table[inumber])) {
-            pthread_mutex_unlock(&inode_table_mutex);
-            return -1;
-        }
-
-        if (pthread_mutex_unlock(&inode_table_mutex)) {
-            return -1;
-        }
+    int inumber = file->of_inumber;
 
-        return sub_inumber;
+    /* The size must account for this handle's own buffered writes */
+    if (needs_size && open_file_flush_unsafe(file) == -1) {
+        pthread_mutex_unlock(&file->of_mutex);
+        return -1;
     }
 
-    /* If the target name is not found, creates a new i-node for it */
-    sub_inumber = inode_create_unsafe(type);
-    if (sub_inumber == -1) {
-        pthread_rwlock_unlock(&inode_lock_table[inumber]);
-        pthread_mutex_unlock(&inode_table_mutex);
+    if (inode_get(inumber) == NULL ||
+        pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
+        pthread_mutex_unlock(&file->of_mutex);
         return -1;
     }
 
-    if (add_dir_entry_unsafe(inumber, sub_inumber, sub_name) == -1) {
-        pthread_rwlock_unlock(&inode_lock_table[inumber]);
-        pthread_mutex_unlock(&inode_table_mutex);
-        return -1;
+    size_t size =
+        __atomic_load_n(&fs->inode_table[inumber].i_size, __ATOMIC_ACQUIRE);
+    off_t result = -1;
+    switch (whence) {
+    case TFS_SEEK_SET:
+        result = offset;
+        break;
+    case TFS_SEEK_CUR:
+        result = (off_t)file->of_offset + offset;
+        break;
+    case TFS_SEEK_END:
+        result = (off_t)size + offset;
+        break;
+    case TFS_SEEK_DATA:
+    case TFS_SEEK_HOLE:
+        if (offset < 0 || (size_t)offset >= size) {
+            break;
+        }
+
+        /* Look for the first block of the kind sought; the whole of a
+         * compressed chunk is data */
+        bool hole = whence == TFS_SEEK_HOLE;
+        result = hole ? (off_t)size : -1;
+        uint16_t const *chunk_len = fs->inode_table[inumber].i_chunk_len;
+        for (size_t bi = (size_t)offset / BLOCK_SIZE; bi * BLOCK_SIZE < size;
+             bi++) {
+            if ((inode_get_block_unsafe(inumber, (int)bi) == -1 &&
+                 chunk_len[bi / COMPRESS_CHUNK_BLOCKS] == 0) == hole) {
+                size_t found = bi * BLOCK_SIZE;
+                result = found > (size_t)offset ? (off_t)found : offset;
+                break;
+            }
+        }
+        break;
+    default:
+        break;
     }
 
-    if (pthread_rwlock_unlock(&inode_lock_table[inumber])) {
-        pthread_mutex_unlock(&inode_table_mutex);
-        return -1;
+    pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+
+    if (result < 0 || (size_t)result > MAX_FILE_SIZE) {
+        result = -1;
+    } else {
+        file->of_offset = (size_t)result;
     }
 
-    if (pthread_mutex_unlock(&inode_table_mutex)) {
+    if (pthread_mutex_unlock(&file->of_mutex)) {
         return -1;
     }
 
-    return sub_inumber;
+    return result;
 }
 
-/* Add new entry to the open file table
+/* Maps a range of an open file's data in place, without copying it.
+ * The blocks backing the mapping are pinned: they are not released (by
+ * truncating or deleting the file, or by writes replacing them) until the
+ * mapping is unmapped. Data overwritten in place by concurrent writes is,
+ * however, visible through the mapping, but not data written to a block
+ * shared with a clone (copied on write to a new block) or as a whole block
+ * deduplicated (see inode_dedup_block_unsafe), nor data filling a hole, as
+ * holes map to zero_block.
+ * Compressed files cannot be mapped, as their data is not stored in place.
  * Inputs:
- * 	- I-node number of the file to open
- * 	- Non-zero if file was opened in append mode
- * Returns: file handle if successful, -1 otherwise
+ *  - file handle to map
+ *  - offset of the first byte to map
+ *  - number of bytes to map
+ *  - mapping to fill in
+ * Returns 0 if successful (even if no bytes were mapped), -1 otherwise.
  */
-int add_to_open_file_table(int inumber, int append) {
-    if (pthread_mutex_lock(&open_file_table_mutex)) {
+int map_open_file(int fhandle, size_t offset, size_t len, file_map_t *map) {
+    if (!valid_file_handle(fhandle) || map == NULL) {
         return -1;
     }
 
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_append = append;
-            open_file_table[i].of_offset = 0;
-            open_file_count += 1;
-            if (pthread_mutex_unlock(&open_file_table_mutex)) {
-                return -1;
-            }
-            return i;
-        }
+    /* The i-node of an open file handle never changes, so there is no need to
+     * lock the file entry mutex */
+    int inumber = fs->open_file_table[fhandle].of_inumber;
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        return -1;
     }
 
-    pthread_mutex_unlock(&open_file_table_mutex);
-    return -1;
-}
+    if (flush_other_buffers(inumber, -1) == -1) {
+        return -1;
+    }
 
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
- */
-int remove_from_open_file_table(int fhandle) {
-    if (pthread_mutex_lock(&open_file_table_mutex)) {
+    if (pthread_rwlock_rdlock(&fs->inode_lock_table[inumber])) {
         return -1;
     }
 
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
-        pthread_mutex_unlock(&open_file_table_mutex);
+    /* Check if offset is out of bounds */
+    size_t size = __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+    if (offset > size || inode->i_compressed) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
         return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
-    open_file_count -= 1;
-    if (open_file_count == 0) {
-        if (pthread_cond_signal(&open_file_table_cond)) {
+
+    /* Determine how many bytes to map */
+    if (len > size - offset) {
+        len = size - offset;
+    }
+
+    /* A span per block touched is enough, as contiguous blocks are merged */
+    size_t max_spans = 0;
+    if (len > 0) {
+        max_spans = (offset + len - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1;
+    }
+    data_span_t *spans = NULL;
+    if (max_spans > 0) {
+        spans = malloc(max_spans * sizeof(data_span_t));
+        if (spans == NULL) {
+            pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+            return -1;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t mapped = 0; mapped < len;) {
+        /* Get block index and offset */
+        int bi = (int)(offset / BLOCK_SIZE);
+        size_t block_offset = offset % BLOCK_SIZE;
+
+        /* Get the block; holes map to zeros, even once filled */
+        int b = inode_get_block_unsafe(inumber, bi);
+        char const *block = b == -1 ? zero_block : data_block_get(b);
+        if (block == NULL) {
+            pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+            free(spans);
             return -1;
         }
+
+        size_t to_map_in_block = block_offset + len - mapped < BLOCK_SIZE
+                                     ? len - mapped
+                                     : BLOCK_SIZE - block_offset;
+
+        /* Extend the previous span if this block directly follows it */
+        char const *data = block + block_offset;
+        data_span_t *last = count > 0 ? &spans[count - 1] : NULL;
+        if (last != NULL && (char const *)last->s_data + last->s_len == data) {
+            last->s_len += to_map_in_block;
+        } else {
+            spans[count].s_data = data;
+            spans[count].s_len = to_map_in_block;
+            count++;
+        }
+
+        offset += to_map_in_block;
+        mapped += to_map_in_block;
+    }
+
+    /* Pin the blocks before letting writers in */
+    if (pthread_mutex_lock(&fs->inode_pin_mutex)) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[inumber]);
+        free(spans);
+        return -1;
     }
+    fs->inode_pin_count[inumber] += 1;
+    pthread_mutex_unlock(&fs->inode_pin_mutex);
 
-    if (pthread_mutex_unlock(&open_file_table_mutex)) {
+    if (pthread_rwlock_unlock(&fs->inode_lock_table[inumber])) {
         return -1;
     }
+
+    map->fm_spans = spans;
+    map->fm_count = count;
+    map->fm_inumber = inumber;
     return 0;
 }
 
-/* Writes to an open file handle.
+/* Releases a mapping created by map_open_file, unpinning its blocks (and
+ * releasing those replaced meanwhile, once no mapping of the file is left).
  * Inputs:
- *  - file handle to write to
- *  - buffer to write
- *  - number of bytes to be written
- * Returns the number of bytes written, or -1 if the operation failed.
+ *  - mapping to release
+ * Returns 0 if successful, -1 otherwise.
  */
-ssize_t write_to_open_file(int fhandle, void const *buffer, size_t to_write) {
-    if (!valid_file_handle(fhandle)) {
+int unmap_file(file_map_t *map) {
+    if (map == NULL || !valid_inumber(map->fm_inumber)) {
         return -1;
     }
 
-    open_file_entry_t *file = &open_file_table[fhandle];
-
-    /* Lock the file entry mutex */
-    if (pthread_mutex_lock(&file->of_mutex)) {
+    if (pthread_mutex_lock(&fs->inode_pin_mutex)) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
-        pthread_mutex_unlock(&file->of_mutex);
+    if (fs->inode_pin_count[map->fm_inumber] == 0) {
+        pthread_mutex_unlock(&fs->inode_pin_mutex);
         return -1;
     }
 
-    /* Lock the inode */
-    if (pthread_rwlock_wrlock(&inode_lock_table[file->of_inumber])) {
-        pthread_mutex_unlock(&file->of_mutex);
+    int deferred = -1;
+    fs->inode_pin_count[map->fm_inumber] -= 1;
+    if (fs->inode_pin_count[map->fm_inumber] == 0) {
+        deferred = fs->inode_deferred_blocks[map->fm_inumber];
+        fs->inode_deferred_blocks[map->fm_inumber] = -1;
+        if (pthread_cond_broadcast(&fs->inode_pin_cond)) {
+            pthread_mutex_unlock(&fs->inode_pin_mutex);
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_unlock(&fs->inode_pin_mutex)) {
         return -1;
     }
 
-    /* If opened in append mode, set offset to end of file */
-    if (file->of_append) {
-        file->of_offset = inode->i_size;
+    /* Release the blocks replaced while the i-node was mapped, which no file
+     * points to anymore */
+    int result = 0;
+    while (deferred != -1) {
+        int next = fs->block_deferred_next[deferred];
+        if (data_block_free(deferred) == -1) {
+            result = -1;
+        }
+        deferred = next;
     }
 
-    /* Check if offset is out of bounds */
-    if (file->of_offset > inode->i_size) {
-        pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-        pthread_mutex_unlock(&file->of_mutex);
-        return -1;
+    free(map->fm_spans);
+    map->fm_spans = NULL;
+    map->fm_count = 0;
+    map->fm_inumber = -1;
+    return result;
+}
+
+/*
+ * Takes the changes since the last checkpoint out of the bitmaps, and copies
+ * them into a checkpoint (see checkpoint_header_t), whose CRC is left to
+ * compute. Every i-node and the blocks mutex must be locked.
+ * Inputs:
+ *  - set to the i-nodes and data blocks changed
+ *  - set to the length of the checkpoint
+ * Returns the checkpoint (to be freed), or NULL if it cannot be allocated (the
+ * changes are then left in the bitmaps).
+ */
+static char *checkpoint_take(uint64_t *inodes, uint64_t *blocks,
+                             size_t *len) {
+    size_t inode_count = 0;
+    for (size_t i = 0; i < BITMAP_WORDS(fs->inode_table_size); i++) {
+        inodes[i] = atomic_exchange_explicit(&fs->inodes_changed[i], 0,
+                                             memory_order_relaxed);
+    }
+    for (size_t i = 0; i < fs->inode_table_size; i++) {
+        inode_count += inodes[i / 64] >> (i % 64) & 1;
     }
 
-    /* Determine how many bytes to write */
-    if (to_write > MAX_FILE_SIZE - file->of_offset) {
-        to_write = MAX_FILE_SIZE - file->of_offset;
+    /* Blocks freed since need not be kept */
+    size_t block_count = 0;
+    for (size_t i = 0; i < BITMAP_WORDS(fs->data_blocks); i++) {
+        blocks[i] = atomic_exchange_explicit(&fs->blocks_changed[i], 0,
+                                             memory_order_relaxed);
+    }
+    for (size_t i = 0; i < fs->data_blocks; i++) {
+        block_count += (blocks[i / 64] >> (i % 64) & 1) &&
+                       fs->free_blocks[i] == TAKEN;
     }
 
-    /* Write the data for each necessary block */
-    for (size_t written = 0; written < to_write;) {
-        /* Get block index and offset */
-        int bi = (int)(file->of_offset / BLOCK_SIZE);
-        size_t offset = file->of_offset % BLOCK_SIZE;
-
-        /* Check if an extra block is necessary */
-        if (inode->i_data_block_count == bi) {
-            if (inode_extend_unsafe(file->of_inumber) == -1) {
-                pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-                pthread_mutex_unlock(&file->of_mutex);
-                return -1;
-            }
+    *len = sizeof(checkpoint_header_t) +
+           inode_count * sizeof(checkpoint_inode_t) +
+           CHECKPOINT_MAPS_SIZE(&fs->layout) +
+           block_count * sizeof(checkpoint_block_t);
+    char *checkpoint = malloc(*len);
+    if (checkpoint == NULL) {
+        for (size_t i = 0; i < BITMAP_WORDS(fs->inode_table_size); i++) {
+            atomic_fetch_or(&fs->inodes_changed[i], inodes[i]);
         }
-
-        /* Get the block */
-        int b = inode_get_block_unsafe(file->of_inumber, bi);
-        if (b == -1) {
-            pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-            pthread_mutex_unlock(&file->of_mutex);
-            return -1;
+        for (size_t i = 0; i < BITMAP_WORDS(fs->data_blocks); i++) {
+            atomic_fetch_or(&fs->blocks_changed[i], blocks[i]);
         }
+        return NULL;
+    }
 
-        void *block = data_block_get(b);
-        if (block == NULL) {
-            pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-            pthread_mutex_unlock(&file->of_mutex);
-            return -1;
+    checkpoint_header_t header = {.ck_magic = CHECKPOINT_MAGIC,
+                                  .ck_super = *(superblock_t *)fs->image,
+                                  .ck_volume = fs->checkpoint_volume,
+                                  .ck_seq = ++fs->checkpoint_seq,
+                                  .ck_inodes = inode_count,
+                                  .ck_blocks = block_count,
+                                  .ck_crc = 0,
+                                  .ck_unused = 0};
+    memcpy(checkpoint, &header, sizeof(header));
+    size_t pos = sizeof(header);
+
+    for (size_t i = 0; i < fs->inode_table_size; i++) {
+        if (inodes[i / 64] >> (i % 64) & 1) {
+            checkpoint_inode_t record;
+            memset(&record, 0, sizeof(record));
+            record.ci_inumber = i;
+            record.ci_state = (uint64_t)fs->free_inode_ts[i];
+            record.ci_inode = fs->inode_table[i];
+            memcpy(checkpoint + pos, &record, sizeof(record));
+            pos += sizeof(record);
         }
-
-        /* Write the data */
-        size_t to_write_in_block = offset + to_write - written < BLOCK_SIZE
-                                       ? to_write - written
-                                       : BLOCK_SIZE - offset;
-        memcpy(block + offset, buffer + written, to_write_in_block);
-        file->of_offset += to_write_in_block;
-        written += to_write_in_block;
     }
 
-    /* Update the size of the file */
-    if (file->of_offset > inode->i_size) {
-        inode->i_size = file->of_offset;
+    memcpy(checkpoint + pos, fs->image + CHECKPOINT_MAPS_OFFSET(&fs->layout),
+           CHECKPOINT_MAPS_SIZE(&fs->layout));
+    pos += CHECKPOINT_MAPS_SIZE(&fs->layout);
+
+    for (uint64_t i = 0; i < fs->data_blocks; i++) {
+        if ((blocks[i / 64] >> (i % 64) & 1) && fs->free_blocks[i] == TAKEN) {
+            memcpy(checkpoint + pos, &i, sizeof(i));
+            block_copy(checkpoint + pos + offsetof(checkpoint_block_t, cb_data),
+                       &fs->fs_data[i * BLOCK_SIZE], BLOCK_SIZE);
+            pos += sizeof(checkpoint_block_t);
+        }
     }
 
-    if (pthread_rwlock_unlock(&inode_lock_table[file->of_inumber])) {
-        pthread_mutex_unlock(&file->of_mutex);
+    return checkpoint;
+}
+
+/*
+ * Writes an incremental checkpoint of the volume to a host file: the i-nodes
+ * and data blocks changed since the last checkpoint (since state_init, for
+ * the first of the chain), and the block maps. Writers only wait while the
+ * changes are copied, with every i-node locked (in order, like clones do), so
+ * that the checkpoint is of a point in time; the host file is written once
+ * they are unlocked. Data still in write-back buffers is not in it.
+ * Input:
+ *  - fd: host file descriptor, written from its start
+ * Returns 0 if successful, -1 otherwise (the changes are then left for the
+ * next checkpoint).
+ */
+int state_checkpoint(int fd) {
+    uint64_t *inodes =
+        calloc(BITMAP_WORDS(fs->inode_table_size), sizeof(uint64_t));
+    uint64_t *blocks = calloc(BITMAP_WORDS(fs->data_blocks), sizeof(uint64_t));
+    if (inodes == NULL || blocks == NULL ||
+        pthread_mutex_lock(&fs->checkpoint_mutex)) {
+        free(inodes);
+        free(blocks);
         return -1;
     }
 
-    if (pthread_mutex_unlock(&file->of_mutex)) {
+    if (pthread_mutex_lock(&fs->inode_table_mutex)) {
+        pthread_mutex_unlock(&fs->checkpoint_mutex);
+        free(inodes);
+        free(blocks);
         return -1;
     }
 
-    return (ssize_t)to_write;
-}
+    size_t locked = 0;
+    while (locked < fs->inode_table_size &&
+           inode_wrlock_quiesced((int)locked) != -1) {
+        locked++;
+    }
 
-/* Reads from an open file handle.
- * Inputs:
- *  - file handle to read from
- *  - buffer to read to
- *  - number of bytes read
- * Returns the number of bytes read, or -1 if the operation failed.
- */
-ssize_t read_from_open_file(int fhandle, void *buffer, size_t to_read) {
-    if (!valid_file_handle(fhandle)) {
-        return -1;
+    size_t len = 0;
+    char *checkpoint = NULL;
+    if (locked == fs->inode_table_size &&
+        pthread_mutex_lock(&fs->data_blocks_mutex) == 0) {
+        checkpoint = checkpoint_take(inodes, blocks, &len);
+        pthread_mutex_unlock(&fs->data_blocks_mutex);
     }
 
-    open_file_entry_t *file = &open_file_table[fhandle];
+    while (locked > 0) {
+        pthread_rwlock_unlock(&fs->inode_lock_table[--locked]);
+    }
+    pthread_mutex_unlock(&fs->inode_table_mutex);
 
-    /* Lock the file entry mutex */
-    if (pthread_mutex_lock(&file->of_mutex)) {
+    if (checkpoint == NULL) {
+        pthread_mutex_unlock(&fs->checkpoint_mutex);
+        free(inodes);
+        free(blocks);
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
-        return -1;
+    checkpoint_header_t header;
+    memcpy(&header, checkpoint, sizeof(header));
+    header.ck_crc = ~block_crc32c(~0u, checkpoint + sizeof(header),
+                                  len - sizeof(header));
+    memcpy(checkpoint, &header, sizeof(header));
+
+    struct iovec iov = {.iov_base = checkpoint, .iov_len = len};
+    int result = fd_pwritev_all(fd, &iov, 1, 0) == -1 || fdatasync(fd) == -1
+                     ? -1
+                     : 0;
+    free(checkpoint);
+
+    /* The next checkpoint takes this one's place in the chain */
+    if (result == -1) {
+        for (size_t i = 0; i < BITMAP_WORDS(fs->inode_table_size); i++) {
+            atomic_fetch_or(&fs->inodes_changed[i], inodes[i]);
+        }
+        for (size_t i = 0; i < BITMAP_WORDS(fs->data_blocks); i++) {
+            atomic_fetch_or(&fs->blocks_changed[i], blocks[i]);
+        }
+        fs->checkpoint_seq--;
     }
+    free(inodes);
+    free(blocks);
 
-    /* Lock the inode */
-    if (pthread_rwlock_rdlock(&inode_lock_table[file->of_inumber])) {
-        pthread_mutex_unlock(&file->of_mutex);
+    if (pthread_mutex_unlock(&fs->checkpoint_mutex)) {
         return -1;
     }
 
-    /* If opened in append mode, set offset to end of file */
-    if (file->of_append) {
-        file->of_offset = inode->i_size;
-    }
+    return result;
+}
 
-    /* Check if offset is out of bounds */
-    if (file->of_offset > inode->i_size) {
-        pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-        pthread_mutex_unlock(&file->of_mutex);
+/*
+ * Applies a checkpoint to an image being restored, which the first checkpoint
+ * of the chain allocates and lays out for its geometry.
+ * Inputs:
+ *  - the image (NULL before the first checkpoint), and its layout
+ *  - path of the checkpoint file on the host
+ *  - header of the checkpoint applied before (zeroed if none), set to this
+ *    one's
+ * Returns 0 if successful, -1 if it cannot be read, is corrupted, or does not
+ * follow the one before in its chain.
+ */
+static int checkpoint_apply(char **im, image_layout_t *il, char const *path,
+                            checkpoint_header_t *last) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
         return -1;
     }
 
-    /* Determine how many bytes to read */
-    if (to_read > inode->i_size - file->of_offset) {
-        to_read = inode->i_size - file->of_offset;
+    struct stat st;
+    checkpoint_header_t header;
+    char *body = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header)) {
+        len = (size_t)st.st_size - sizeof(header);
+        body = malloc(len + 1);
+    }
+    if (body == NULL || fd_pread_all(fd, &header, sizeof(header), 0) == -1 ||
+        fd_pread_all(fd, body, len, sizeof(header)) == -1) {
+        free(body);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* The chain's geometry is the first checkpoint's */
+    if (*im == NULL && header.ck_super.sb_data_blocks > 0 &&
+        header.ck_super.sb_data_blocks <= INT_MAX &&
+        header.ck_super.sb_inode_table_size > 0 &&
+        header.ck_super.sb_inode_table_size <= INT_MAX) {
+        image_layout_init(il, header.ck_super.sb_data_blocks,
+                          header.ck_super.sb_inode_table_size);
+        if (superblock_valid(&header.ck_super, il) &&
+            (*im = aligned_alloc(IMAGE_PAGE_SIZE, il->il_size)) != NULL) {
+            memset(*im, 0, il->il_size);
+            image_format(*im, il);
+        }
     }
 
-    /* Read the data from each necessary block */
-    for (size_t read = 0; read < to_read;) {
-        /* Get block index and offset */
-        int bi = (int)(file->of_offset / BLOCK_SIZE);
-        size_t offset = file->of_offset % BLOCK_SIZE;
+    if (*im == NULL || header.ck_magic != CHECKPOINT_MAGIC ||
+        !superblock_valid(&header.ck_super, il) ||
+        header.ck_seq != last->ck_seq + 1 ||
+        (header.ck_seq > 1 && header.ck_volume != last->ck_volume) ||
+        header.ck_inodes > il->il_inode_table_size ||
+        header.ck_blocks > il->il_data_blocks ||
+        len != header.ck_inodes * sizeof(checkpoint_inode_t) +
+                   CHECKPOINT_MAPS_SIZE(il) +
+                   header.ck_blocks * sizeof(checkpoint_block_t) ||
+        ~block_crc32c(~0u, body, len) != header.ck_crc) {
+        free(body);
+        return -1;
+    }
 
-        /* Get the block */
-        int b = inode_get_block_unsafe(file->of_inumber, bi);
-        if (b == -1) {
-            pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-            pthread_mutex_unlock(&file->of_mutex);
+    size_t pos = 0;
+    inode_t *inodes = (inode_t *)(*im + il->il_inode_table);
+    for (size_t i = 0; i < header.ck_inodes; i++) {
+        checkpoint_inode_t record;
+        memcpy(&record, body + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.ci_inumber >= il->il_inode_table_size ||
+            (record.ci_state != FREE && record.ci_state != TAKEN)) {
+            free(body);
             return -1;
         }
+        (*im + il->il_free_inode_ts)[record.ci_inumber] =
+            (char)record.ci_state;
+        inodes[record.ci_inumber] = record.ci_inode;
+    }
 
-        void *block = data_block_get(b);
-        if (block == NULL) {
-            pthread_rwlock_unlock(&inode_lock_table[file->of_inumber]);
-            pthread_mutex_unlock(&file->of_mutex);
+    memcpy(*im + CHECKPOINT_MAPS_OFFSET(il), body + pos,
+           CHECKPOINT_MAPS_SIZE(il));
+    pos += CHECKPOINT_MAPS_SIZE(il);
+
+    for (size_t i = 0; i < header.ck_blocks; i++) {
+        uint64_t block_number;
+        memcpy(&block_number, body + pos, sizeof(block_number));
+        if (block_number >= il->il_data_blocks) {
+            free(body);
             return -1;
         }
+        memcpy(*im + il->il_data + block_number * BLOCK_SIZE,
+               body + pos + offsetof(checkpoint_block_t, cb_data), BLOCK_SIZE);
+        pos += sizeof(checkpoint_block_t);
+    }
 
-        /* Read the data */
-        size_t to_read_in_block = offset + to_read - read < BLOCK_SIZE
-                                      ? to_read - read
-                                      : BLOCK_SIZE - offset;
-        memcpy(buffer + read, block + offset, to_read_in_block);
-        file->of_offset += to_read_in_block;
-        read += to_read_in_block;
+    free(body);
+    *last = header;
+    return 0;
+}
+
+/*
+ * Rebuilds a volume from a chain of checkpoints (see state_checkpoint), as of
+ * the last one, into an image file that is not mounted, with the geometry the
+ * volume had. Any image at the path is replaced, and its journal removed.
+ * Inputs:
+ *  - path of the image file on the host
+ *  - paths of the checkpoint files, in the order they were taken, starting
+ *    with the first of their chain
+ *  - number of checkpoints
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_restore(char const *image_path, char const *const *checkpoint_paths,
+                  size_t count) {
+    char *im = NULL;
+    image_layout_t il;
+    checkpoint_header_t last;
+    memset(&last, 0, sizeof(last));
+    int result = count > 0 ? 0 : -1;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        result = checkpoint_apply(&im, &il, checkpoint_paths[i], &last);
     }
 
-    if (pthread_rwlock_unlock(&inode_lock_table[file->of_inumber])) {
-        pthread_mutex_unlock(&file->of_mutex);
+    /* The old image's journal must not be replayed into the new one */
+    char *journal_path = result == 0 ? image_journal_path(image_path) : NULL;
+    if (journal_path == NULL ||
+        (unlink(journal_path) == -1 && errno != ENOENT)) {
+        free(journal_path);
+        free(im);
         return -1;
     }
+    free(journal_path);
 
-    if (pthread_mutex_unlock(&file->of_mutex)) {
-        return -1;
+    int fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    struct iovec iov = {.iov_base = im, .iov_len = il.il_size};
+    if (fd == -1 || fd_pwritev_all(fd, &iov, 1, 0) == -1 ||
+        fdatasync(fd) == -1) {
+        result = -1;
+    }
+    if (fd != -1 && close(fd) == -1) {
+        result = -1;
     }
 
-    return (ssize_t)to_read;
-}
\ No newline at end of file
+    free(im);
+    return result;
+}
@@ -2,11 +2,14 @@
 #define STATE_H
 
 #include "config.h"
+#include "journal.h"
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /*
  * Directory entry
@@ -18,13 +21,27 @@ typedef struct {
 
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+#define MAX_INDIRECT_REFS (BLOCK_SIZE / sizeof(int))
+#define INODE_MAX_CHUNKS                                                       \
+    ((INODE_DIRECT_REFS + MAX_INDIRECT_REFS + COMPRESS_CHUNK_BLOCKS - 1) /     \
+     COMPRESS_CHUNK_BLOCKS)
+
 /*
  * I-node
+ * Blocks never written (holes) are not allocated: their reference is -1, and
+ * so is i_data_extension_block while every indirect reference is a hole.
+ * A compressed file's data is split in chunks of COMPRESS_CHUNK_BLOCKS blocks,
+ * each stored as is (i_chunk_len is 0) or compressed: the compressed bytes,
+ * i_chunk_len of them, fill the chunk's first blocks and the rest are holes.
  */
 typedef struct {
     inode_type i_node_type;
     size_t i_size;
-    size_t i_data_block_count;
+    size_t i_data_block_count; // blocks covering the data, holes included
+    size_t i_hole_count;       // holes among those blocks
+    int i_shared;              // non-zero if blocks may be shared (clones)
+    int i_compressed;          // non-zero if data is stored compressed
+    uint16_t i_chunk_len[INODE_MAX_CHUNKS];
     int i_data_block[INODE_DIRECT_REFS];
     int i_data_extension_block;
     /* in a real FS, more fields would exist here */
@@ -32,6 +49,17 @@ typedef struct {
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Reference point of a seek (see seek_open_file)
+ */
+typedef enum {
+    TFS_SEEK_SET,
+    TFS_SEEK_CUR,
+    TFS_SEEK_END,
+    TFS_SEEK_DATA,
+    TFS_SEEK_HOLE,
+} seek_whence_t;
+
 /*
  * Open file entry (in open file table)
  */
@@ -40,26 +68,104 @@ typedef struct {
     int of_append;
     size_t of_offset;
     pthread_mutex_t of_mutex;
+    /* write-back buffer, holding the file's bytes starting at
+     * of_wbuf_offset (up to the end of that block) not yet written */
+    int of_buffered;
+    size_t of_wbuf_offset;
+    size_t of_wbuf_len;
+    char of_wbuf[BLOCK_SIZE];
+    /* sequential access detection: offset the next read is expected at,
+     * readahead window (in blocks) and first block not yet prefetched */
+    size_t of_ra_next;
+    size_t of_ra_window;
+    size_t of_ra_issued;
 } open_file_entry_t;
 
+/*
+ * Contiguous range of file data, stored in place in the data blocks
+ */
+typedef struct {
+    void const *s_data;
+    size_t s_len;
+} data_span_t;
+
+/*
+ * Read mapping of a file range (see map_open_file)
+ */
+typedef struct {
+    data_span_t *fm_spans;
+    size_t fm_count;
+    int fm_inumber;
+} file_map_t;
+
+/*
+ * Parameters of a file system (see tfs_params_init for the defaults)
+ */
+typedef struct {
+    size_t tp_block_size;       // must be BLOCK_SIZE
+    size_t tp_data_blocks;      // size of the volume, in blocks
+    size_t tp_inode_table_size; // maximum number of files
+    size_t tp_max_open_files;   // maximum number of files open at a time
+    int tp_delay;               // iterations simulating each storage access
+    int tp_huge_pages;          // whether to keep the state in huge pages
+    char const *tp_image_path;  // image file holding the state, or NULL
+    int tp_flags;               // mount flags
+} tfs_params_t;
+
+/*
+ * File system instance (see state_select)
+ */
+typedef struct tfs tfs_t;
+
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
-#define MAX_INDIRECT_REFS (BLOCK_SIZE / sizeof(int))
 #define MAX_FILE_SIZE (BLOCK_SIZE * (INODE_DIRECT_REFS + MAX_INDIRECT_REFS))
 
-int state_init();
+tfs_t *state_create();
+void state_free(tfs_t *instance);
+tfs_t *state_select(tfs_t *instance);
+tfs_t *state_current();
+journal_t *state_journal();
+int state_init(tfs_params_t const *params, int verify, int dedup);
 int state_destroy();
 int state_destroy_after_all_closed();
+int state_checkpoint(int fd);
+int state_restore(char const *image_path, char const *const *checkpoint_paths,
+                  size_t count);
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 int inode_clear(int inumber);
+int inode_clone(int src, int dst);
+int inode_replace_data(int inumber, void const *data, size_t len);
+int inode_truncate(int inumber, size_t len);
+int inode_export(int inumber, int fd);
+int inode_export_at(int inumber, int fd, size_t offset, size_t len);
+ssize_t inode_size(int inumber);
+ssize_t inode_verify(int inumber, size_t offset, size_t len);
 
 int find_in_dir(int inumber, char const *sub_name);
-int create_in_dir(int inumber, inode_type type, char const *sub_name);
+int list_dir(int inumber, dir_entry_t *entries);
+int create_in_dir(int inumber, inode_type type, char const *sub_name,
+                  int compressed);
 
-int add_to_open_file_table(int inumber, int append);
+int add_to_open_file_table(int inumber, int append, int buffered);
 int remove_from_open_file_table(int fhandle);
 ssize_t write_to_open_file(int fhandle, void const *buffer, size_t to_write);
 ssize_t read_from_open_file(int fhandle, void *buffer, size_t to_read);
+ssize_t writev_to_open_file(int fhandle, struct iovec const *iov, int iovcnt);
+ssize_t readv_from_open_file(int fhandle, struct iovec const *iov, int iovcnt);
+ssize_t pwrite_to_open_file(int fhandle, void const *buffer, size_t to_write,
+                            size_t offset);
+ssize_t pread_from_open_file(int fhandle, void *buffer, size_t to_read,
+                             size_t offset);
+ssize_t copy_between_open_files(int src_fhandle, size_t src_offset,
+                                int dst_fhandle, size_t dst_offset,
+                                size_t len);
+int truncate_open_file(int fhandle, size_t len);
+off_t seek_open_file(int fhandle, off_t offset, seek_whence_t whence);
+int flush_open_file(int fhandle);
+int flush_file_buffers(int inumber);
+int map_open_file(int fhandle, size_t offset, size_t len, file_map_t *map);
+int unmap_file(file_map_t *map);
 
 #endif // STATE_H
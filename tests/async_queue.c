@@ -0,0 +1,148 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A single thread opens, writes, reads back and closes several files through
+ * an asynchronous queue, keeping many requests in flight at once.
+ */
+
+#define NUM_FILES 4
+#define BLOCKS_PER_FILE 8
+#define FILE_SIZE (BLOCKS_PER_FILE * BLOCK_SIZE)
+#define QUEUE_ENTRIES 16
+#define QUEUE_WORKERS 8
+
+static tfs_queue_t *queue;
+
+/* Submits the requests and reaps their completions, indexed by user data */
+static void run_all(tfs_request_t *requests, size_t count, ssize_t *results) {
+    size_t submitted = 0, reaped = 0;
+    while (reaped < count) {
+        ssize_t s = tfs_submit(queue, requests + submitted, count - submitted);
+        assert(s != -1);
+        submitted += (size_t)s;
+
+        tfs_completion_t completions[QUEUE_ENTRIES];
+        ssize_t r = tfs_reap(queue, completions, QUEUE_ENTRIES, 1);
+        assert(r >= 1);
+        for (ssize_t i = 0; i < r; i++) {
+            results[(uintptr_t)completions[i].cq_user_data] =
+                completions[i].cq_result;
+        }
+        reaped += (size_t)r;
+    }
+}
+
+int main() {
+    char const *paths[NUM_FILES] = {"/f1", "/f2", "/f3", "/f4"};
+    static char data[NUM_FILES][FILE_SIZE];
+    static char read_back[NUM_FILES][BLOCKS_PER_FILE][BLOCK_SIZE];
+    int fds[NUM_FILES];
+
+    tfs_request_t requests[NUM_FILES * BLOCKS_PER_FILE];
+    ssize_t results[NUM_FILES * BLOCKS_PER_FILE];
+
+    assert(tfs_init() != -1);
+
+    /* Invalid queues */
+    assert(tfs_queue_create(0, 1) == NULL);
+    assert(tfs_queue_create(QUEUE_MAX_ENTRIES + 1, 1) == NULL);
+    assert(tfs_queue_create(1, 0) == NULL);
+
+    queue = tfs_queue_create(QUEUE_ENTRIES, QUEUE_WORKERS);
+    assert(queue != NULL);
+
+    /* Nothing in flight: reaping does not wait */
+    tfs_completion_t completion;
+    assert(tfs_reap(queue, &completion, 1, 1) == 0);
+
+    /* Open (creating) every file */
+    for (int i = 0; i < NUM_FILES; i++) {
+        requests[i] = (tfs_request_t){.rq_op = TFS_OP_OPEN,
+                                      .rq_name = paths[i],
+                                      .rq_flags = TFS_O_CREAT,
+                                      .rq_user_data = (void *)(uintptr_t)i};
+    }
+    run_all(requests, NUM_FILES, results);
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert(results[i] != -1);
+        fds[i] = (int)results[i];
+    }
+
+    /* Write every file with a single request */
+    for (int i = 0; i < NUM_FILES; i++) {
+        for (int j = 0; j < FILE_SIZE; j++) {
+            data[i][j] = (char)('A' + (i * 7 + j) % 26);
+        }
+        requests[i] = (tfs_request_t){.rq_op = TFS_OP_WRITE,
+                                      .rq_fhandle = fds[i],
+                                      .rq_buffer = data[i],
+                                      .rq_len = FILE_SIZE,
+                                      .rq_user_data = (void *)(uintptr_t)i};
+    }
+    run_all(requests, NUM_FILES, results);
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert(results[i] == FILE_SIZE);
+    }
+
+    /* Read every block back with its own request; more requests than fit in
+     * the queue at once */
+    for (int i = 0; i < NUM_FILES; i++) {
+        for (int j = 0; j < BLOCKS_PER_FILE; j++) {
+            size_t k = (size_t)(i * BLOCKS_PER_FILE + j);
+            requests[k] =
+                (tfs_request_t){.rq_op = TFS_OP_PREAD,
+                                .rq_fhandle = fds[i],
+                                .rq_buffer = read_back[i][j],
+                                .rq_len = BLOCK_SIZE,
+                                .rq_offset = (size_t)j * BLOCK_SIZE,
+                                .rq_user_data = (void *)(uintptr_t)k};
+        }
+    }
+    assert(tfs_submit(queue, requests, NUM_FILES * BLOCKS_PER_FILE) ==
+           QUEUE_ENTRIES);
+    assert(tfs_submit(queue, requests, 1) == 0);
+    assert(tfs_reap(queue, NULL, 0, 1) == -1);
+    ssize_t done = 0;
+    while (done < QUEUE_ENTRIES) {
+        tfs_completion_t completions[QUEUE_ENTRIES];
+        ssize_t r = tfs_reap(queue, completions, QUEUE_ENTRIES,
+                             (size_t)(QUEUE_ENTRIES - done));
+        assert(r == QUEUE_ENTRIES - done);
+        done += r;
+    }
+    run_all(requests + QUEUE_ENTRIES,
+            NUM_FILES * BLOCKS_PER_FILE - QUEUE_ENTRIES,
+            results);
+    for (int i = QUEUE_ENTRIES; i < NUM_FILES * BLOCKS_PER_FILE; i++) {
+        assert(results[i] == BLOCK_SIZE);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert(memcmp(read_back[i], data[i], FILE_SIZE) == 0);
+    }
+
+    /* Close every file; invalid handles fail */
+    for (int i = 0; i < NUM_FILES; i++) {
+        requests[i] = (tfs_request_t){.rq_op = TFS_OP_CLOSE,
+                                      .rq_fhandle = fds[i],
+                                      .rq_user_data = (void *)(uintptr_t)i};
+    }
+    requests[NUM_FILES] =
+        (tfs_request_t){.rq_op = TFS_OP_CLOSE,
+                        .rq_fhandle = -1,
+                        .rq_user_data = (void *)(uintptr_t)NUM_FILES};
+    run_all(requests, NUM_FILES + 1, results);
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert(results[i] == 0);
+    }
+    assert(results[NUM_FILES] == -1);
+
+    assert(tfs_queue_destroy(queue) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "fs/kernels.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+/*
+ * Data blocks keep a CRC32C checksum through every kind of write (including
+ * concurrent appends to the same blocks): a scrub finds no corruption until
+ * a block is corrupted behind the file system's back, after which reads of
+ * the block fail when verifying and the scrub finds it.
+ */
+
+#define NUM_THREADS 4
+#define APPENDS 200
+#define RECORD_SIZE 37
+
+static void *append_records(void *arg) {
+    char record[RECORD_SIZE];
+    memset(record, *(char *)arg, sizeof(record));
+
+    int fd = tfs_open("/log", TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < APPENDS; i++) {
+        assert(tfs_write(fd, record, sizeof(record)) == sizeof(record));
+    }
+    assert(tfs_close(fd) != -1);
+
+    return NULL;
+}
+
+int main() {
+    char data[3 * BLOCK_SIZE];
+    char buf[3 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init_flags(TFS_MOUNT_VERIFY) != -1);
+
+    /* The standard check value of CRC32C */
+    assert(~block_crc32c(~0u, "123456789", 9) == 0xe3069283);
+
+    /* Whole, partial, sparse and copy-on-write writes, and a truncation */
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, sizeof(data)) == sizeof(data));
+    assert(tfs_pwrite(fd, "XYZ", 3, BLOCK_SIZE + 10) == 3);
+    assert(tfs_pwrite(fd, "!", 1, 20 * BLOCK_SIZE + 5) == 1);
+    assert(tfs_clone("/f1", "/f2") == 0);
+    assert(tfs_pwrite(fd, "Q", 1, 7) == 1);
+    assert(tfs_ftruncate(fd, 2 * BLOCK_SIZE + 100) == 0);
+    assert(tfs_close(fd) != -1);
+
+    /* Concurrent appends to the same blocks */
+    fd = tfs_open("/log", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    pthread_t threads[NUM_THREADS];
+    char marks[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        marks[i] = (char)('A' + i);
+        assert(pthread_create(&threads[i], NULL, append_records, &marks[i]) ==
+               0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_verify(0) == -1);
+    assert(tfs_verify(BULK_MAX_THREADS + 1) == -1);
+    assert(tfs_verify(4) == 0);
+
+    /* Corrupt a byte of the second block, which the clone shares */
+    fd = tfs_open("/f2", 0);
+    assert(fd != -1);
+    file_map_t map;
+    assert(tfs_read_map(fd, BLOCK_SIZE + 1, 1, &map) == 0);
+    assert(map.fm_count == 1);
+    *(char *)map.fm_spans[0].s_data ^= 0x40;
+    assert(tfs_read_unmap(&map) == 0);
+
+    /* Only reads of the corrupted block fail, in both files */
+    assert(tfs_pread(fd, buf, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(tfs_pread(fd, buf, 1, BLOCK_SIZE + 1) == -1);
+    assert(tfs_pread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+    int fd1 = tfs_open("/f1", 0);
+    assert(fd1 != -1);
+    assert(tfs_pread(fd1, buf, 1, 2 * BLOCK_SIZE - 1) == -1);
+
+    assert(tfs_verify(1) == 2);
+    assert(tfs_verify(BULK_MAX_THREADS) == 2);
+
+    /* Rewriting the block in each file repairs it */
+    assert(tfs_pwrite(fd, data + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) ==
+           BLOCK_SIZE);
+    assert(tfs_pread(fd, buf, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buf, data + BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(tfs_verify(2) == 1);
+    assert(tfs_pwrite(fd1, data + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) ==
+           BLOCK_SIZE);
+    assert(tfs_verify(2) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_close(fd1) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
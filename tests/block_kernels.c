@@ -0,0 +1,93 @@
+#include "fs/kernels.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Checks the block kernels of every instruction set the processor supports,
+ * at sizes and alignments around the vector widths, and that the file system
+ * works with the kernels it selects.
+ */
+
+#define BUFFER_SIZE (4 * BLOCK_SIZE)
+
+static char src[BUFFER_SIZE + 64];
+static char dst[BUFFER_SIZE + 64];
+static char expected[BUFFER_SIZE + 64];
+
+static size_t const sizes[] = {0,   1,   15,  16,  17,  63,   64,
+                               65,  127, 128, 255, 256, 1000, BLOCK_SIZE,
+                               BUFFER_SIZE};
+
+static void check_kernels() {
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (char)(i * 7 + 3);
+    }
+
+    for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+        size_t size = sizes[si];
+        for (size_t align = 0; align < 64; align += 13) {
+            /* Copies, regular and streaming */
+            for (int stream = 0; stream <= 1; stream++) {
+                memset(dst, '#', sizeof(dst));
+                memcpy(expected, dst, sizeof(dst));
+                memcpy(expected + align, src + (64 - align), size);
+                if (stream) {
+                    block_copy_stream(dst + align, src + (64 - align), size);
+                } else {
+                    block_copy(dst + align, src + (64 - align), size);
+                }
+                assert(memcmp(dst, expected, sizeof(dst)) == 0);
+            }
+
+            /* Fills */
+            memset(dst, '#', sizeof(dst));
+            memcpy(expected, dst, sizeof(dst));
+            memset(expected + align, 0xa5, size);
+            block_fill(dst + align, 0xa5, size);
+            assert(memcmp(dst, expected, sizeof(dst)) == 0);
+
+            memset(expected + align, 0, size);
+            block_zero(dst + align, size);
+            assert(memcmp(dst, expected, sizeof(dst)) == 0);
+        }
+    }
+}
+
+static void check_file_system() {
+    char const *path = "/f1";
+    char buf[BUFFER_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, src, BUFFER_SIZE, BLOCK_SIZE + 5) == BUFFER_SIZE);
+    assert(tfs_pread(fd, buf, BLOCK_SIZE + 5, 0) == BLOCK_SIZE + 5);
+    for (size_t i = 0; i < BLOCK_SIZE + 5; i++) {
+        assert(buf[i] == 0);
+    }
+    assert(tfs_pread(fd, buf, BUFFER_SIZE, BLOCK_SIZE + 5) == BUFFER_SIZE);
+    assert(memcmp(buf, src, BUFFER_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    for (int isa = KERNELS_GENERIC; isa <= KERNELS_AVX512; isa++) {
+        if (kernels_select((kernels_isa_t)isa) == -1) {
+            assert(!kernels_supported((kernels_isa_t)isa));
+            continue;
+        }
+        assert(kernels_current() == (kernels_isa_t)isa);
+        check_kernels();
+    }
+
+    /* The file system selects the kernels when initialized */
+    check_file_system();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define COUNT 40
+#define SIZE 250
+
+/**
+   This test fills in a new file up to 10 blocks via multiple small buffered
+   writes, checking that the buffered data is observed by reads through other
+   handles, and then checks if the file contents are as expected
+ */
+
+int main() {
+
+    char *path = "/f1";
+
+    char input[SIZE];
+    memset(input, 'A', SIZE);
+
+    char output[SIZE];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fd != -1);
+    int r_fd = tfs_open(path, 0);
+    assert(r_fd != -1);
+
+    for (int i = 0; i < COUNT; i++) {
+        input[0] = (char)('a' + i % 26);
+        assert(tfs_write(fd, input, SIZE) == SIZE);
+
+        /* Reading through another handle writes the buffer back first */
+        assert(tfs_read(r_fd, output, SIZE) == SIZE);
+        assert(memcmp(input, output, SIZE) == 0);
+    }
+    assert(tfs_read(r_fd, output, SIZE) == 0);
+
+    /* Buffered bytes are written back by tfs_fsync */
+    assert(tfs_write(fd, input, 1) == 1);
+    assert(tfs_fsync(fd) == 0);
+    assert(tfs_read(r_fd, output, SIZE) == 1);
+    assert(tfs_close(r_fd) != -1);
+
+    assert(tfs_close(fd) != -1);
+
+    /* Open again to check if contents are as expected */
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+
+    for (int i = 0; i < COUNT; i++) {
+        input[0] = (char)('a' + i % 26);
+        assert(tfs_read(fd, output, SIZE) == SIZE);
+        assert(memcmp(input, output, SIZE) == 0);
+    }
+
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Clones a large file many times (more than the data blocks could hold if
+ * copied), then writes to the original and to the clones, checking that each
+ * write is only visible in the file written.
+ */
+
+#define FILE_BLOCKS 200
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE)
+#define NUM_CLONES 10
+
+static char expected(int file, size_t offset) {
+    return (char)('a' + (file + (int)(offset / BLOCK_SIZE)) % 26);
+}
+
+static char contents[FILE_SIZE];
+
+static void check_file(char const *path, int file, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, contents, FILE_SIZE) == size);
+    assert(tfs_close(fd) != -1);
+
+    for (size_t i = 0; i < size; i++) {
+        assert(contents[i] == expected(file, i));
+    }
+}
+
+int main() {
+    char const *path = "/f1";
+    char clone_path[] = "/clone_x";
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = expected(0, i);
+    }
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    /* The source must exist */
+    assert(tfs_clone("/missing", "/f2") == -1);
+
+    for (int i = 0; i < NUM_CLONES; i++) {
+        clone_path[strlen(clone_path) - 1] = (char)('a' + i);
+        assert(tfs_clone(path, clone_path) == 0);
+    }
+
+    for (int i = 0; i < NUM_CLONES; i++) {
+        clone_path[strlen(clone_path) - 1] = (char)('a' + i);
+        check_file(clone_path, 0, FILE_SIZE);
+    }
+
+    /* Overwrite the whole of the first clone, a block at a time */
+    clone_path[strlen(clone_path) - 1] = 'a';
+    fd = tfs_open(clone_path, 0);
+    assert(fd != -1);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = expected(1, i);
+    }
+    for (size_t off = 0; off < FILE_SIZE; off += BLOCK_SIZE) {
+        assert(tfs_write(fd, contents + off, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(fd) != -1);
+    check_file(clone_path, 1, FILE_SIZE);
+    check_file(path, 0, FILE_SIZE);
+
+    /* Small writes (into the middle of shared blocks) and appends to the
+     * original */
+    fd = tfs_open(path, TFS_O_APPEND);
+    assert(fd != -1);
+    char c = expected(0, FILE_SIZE);
+    assert(tfs_write(fd, &c, 1) == 1);
+    assert(tfs_pwrite(fd, "Z", 1, BLOCK_SIZE + 3) == 1);
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open(path, 0);
+    assert(tfs_read(fd, contents, FILE_SIZE) == FILE_SIZE);
+    assert(contents[BLOCK_SIZE + 3] == 'Z');
+    assert(contents[BLOCK_SIZE + 2] == expected(0, BLOCK_SIZE + 2));
+    assert(tfs_read(fd, contents, 1) == 1);
+    assert(contents[0] == c);
+    assert(tfs_close(fd) != -1);
+
+    clone_path[strlen(clone_path) - 1] = 'b';
+    check_file(clone_path, 0, FILE_SIZE);
+
+    /* Cloning over an existing file replaces it */
+    assert(tfs_clone("/clone_a", clone_path) == 0);
+    check_file(clone_path, 1, FILE_SIZE);
+
+    /* Truncating a clone leaves the others intact */
+    clone_path[strlen(clone_path) - 1] = 'c';
+    fd = tfs_open(clone_path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    check_file(clone_path, 0, 0);
+    clone_path[strlen(clone_path) - 1] = 'd';
+    check_file(clone_path, 0, FILE_SIZE);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Stores log-like files compressed: more of them fit than the data blocks
+ * could hold as is, and reads at any offset, overwrites (of incompressible
+ * data, across chunks), appends, truncation, holes, clones, copies and
+ * exports all see the same bytes an uncompressed file would hold.
+ */
+
+#define LOG_FILES (6)
+#define CHUNK_SIZE (COMPRESS_CHUNK_SIZE)
+
+static char logs[MAX_FILE_SIZE];
+static char noise[3 * CHUNK_SIZE];
+static char expected[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void check(int fd, char const *data, size_t size) {
+    assert(tfs_pread(fd, buf, sizeof(buf), 0) == size);
+    assert(memcmp(buf, data, size) == 0);
+}
+
+int main() {
+    char path[] = "/log0";
+    char const *host_path = "compressed_files.out";
+
+    for (size_t len = 0, i = 0; len < sizeof(logs); i++) {
+        char line[80];
+        int n = snprintf(line, sizeof(line),
+                         "2026-10-17 12:%02zu:%02zu INFO request %zu served "
+                         "in %zu ms\n",
+                         i / 60 % 60, i % 60, i, i % 7);
+        for (int j = 0; j < n && len < sizeof(logs); j++) {
+            logs[len++] = line[j];
+        }
+    }
+    unsigned seed = 1;
+    for (size_t i = 0; i < sizeof(noise); i++) {
+        seed = seed * 1103515245 + 12345;
+        noise[i] = (char)(seed >> 16);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* As is, the files would need more blocks than the file system has */
+    assert(LOG_FILES * MAX_FILE_SIZE > DATA_BLOCKS * BLOCK_SIZE);
+    for (int i = 0; i < LOG_FILES; i++) {
+        path[4] = (char)('0' + i);
+        int fd = tfs_open(path, TFS_O_CREAT | TFS_O_COMPRESS);
+        assert(fd != -1);
+        assert(tfs_write(fd, logs, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+
+    int fd = tfs_open("/log0", 0);
+    assert(fd != -1);
+    check(fd, logs, MAX_FILE_SIZE);
+
+    /* Reads within a chunk and across chunks */
+    for (size_t offset = 1; offset < MAX_FILE_SIZE; offset += 3 * 1000 + 7) {
+        size_t len = offset % (2 * CHUNK_SIZE) + 1;
+        if (len > MAX_FILE_SIZE - offset) {
+            len = MAX_FILE_SIZE - offset;
+        }
+        assert(tfs_pread(fd, buf, len, offset) == len);
+        assert(memcmp(buf, logs + offset, len) == 0);
+    }
+
+    /* Compressed files cannot be mapped */
+    file_map_t map;
+    assert(tfs_read_map(fd, 0, BLOCK_SIZE, &map) == -1);
+
+    /* Overwrite incompressible data in the middle of a chunk, spanning the
+     * next one */
+    memcpy(expected, logs, MAX_FILE_SIZE);
+    size_t at = CHUNK_SIZE + 100;
+    assert(tfs_pwrite(fd, noise, 2 * CHUNK_SIZE, at) == 2 * CHUNK_SIZE);
+    memcpy(expected + at, noise, 2 * CHUNK_SIZE);
+    check(fd, expected, MAX_FILE_SIZE);
+
+    /* Shrink to the middle of a chunk, then grow: the tail reads as zeros */
+    size_t size = 5 * CHUNK_SIZE + 3 * BLOCK_SIZE + 17;
+    assert(tfs_ftruncate(fd, size) == 0);
+    check(fd, expected, size);
+    assert(tfs_ftruncate(fd, size + CHUNK_SIZE) == 0);
+    memset(expected + size, 0, CHUNK_SIZE);
+    check(fd, expected, size + CHUNK_SIZE);
+    size += CHUNK_SIZE;
+    assert(tfs_close(fd) != -1);
+
+    /* Appends */
+    fd = tfs_open("/log0", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, logs, 1000) == 1000);
+    assert(tfs_write(fd, noise, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE);
+    memcpy(expected + size, logs, 1000);
+    memcpy(expected + size + 1000, noise, 3 * BLOCK_SIZE);
+    size += 1000 + 3 * BLOCK_SIZE;
+    check(fd, expected, size);
+    assert(tfs_close(fd) != -1);
+
+    /* The chunks of a hole are not stored */
+    for (int i = 1; i < LOG_FILES; i++) {
+        path[4] = (char)('0' + i);
+        assert(tfs_truncate(path, 0) == 0);
+    }
+    fd = tfs_open("/sparse", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(fd != -1);
+    size_t data_at = 4 * CHUNK_SIZE + 10;
+    assert(tfs_pwrite(fd, "data", 4, data_at) == 4);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_DATA) == 4 * CHUNK_SIZE);
+    assert(tfs_lseek(fd, 4 * CHUNK_SIZE, TFS_SEEK_HOLE) == data_at + 4);
+    memset(buf, 'x', data_at);
+    assert(tfs_pread(fd, buf, sizeof(buf), 0) == data_at + 4);
+    for (size_t i = 0; i < data_at; i++) {
+        assert(buf[i] == 0);
+    }
+    assert(memcmp(buf + data_at, "data", 4) == 0);
+    assert(tfs_close(fd) != -1);
+
+    /* A clone is compressed too, and written apart from the original */
+    assert(tfs_clone("/log0", "/clone") == 0);
+    fd = tfs_open("/clone", 0);
+    assert(fd != -1);
+    check(fd, expected, size);
+    assert(tfs_pwrite(fd, "changed", 7, 3) == 7);
+    assert(tfs_pread(fd, buf, 10, 0) == 10);
+    assert(memcmp(buf, expected, 3) == 0 && memcmp(buf + 3, "changed", 7) == 0);
+    assert(tfs_close(fd) != -1);
+
+    /* Copies between compressed and uncompressed files */
+    int src = tfs_open("/log0", 0);
+    int dst = tfs_open("/plain", TFS_O_CREAT);
+    assert(src != -1 && dst != -1);
+    assert(tfs_copy_file_range(src, 0, dst, 0, size) == size);
+    check(dst, expected, size);
+    assert(tfs_copy_file_range(dst, 0, src, 7, 1000) == 1000);
+    memmove(expected + 7, expected, 1000);
+    check(src, expected, size);
+    assert(tfs_close(src) != -1);
+    assert(tfs_close(dst) != -1);
+
+    /* Exports write the data, not how it is stored */
+    assert(tfs_copy_to_external_fs("/log0", host_path) == 0);
+    FILE *fp = fopen(host_path, "r");
+    assert(fp != NULL);
+    assert(fread(buf, 1, sizeof(buf), fp) == size);
+    assert(memcmp(buf, expected, size) == 0);
+    assert(fclose(fp) == 0);
+    unlink(host_path);
+
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Multiple threads append fixed-size records to the same file while other
+ * threads repeatedly read it from the start. Readers must only ever see whole
+ * records, as appends become visible in the order they were reserved and only
+ * once their data is in place.
+ */
+
+#define NUM_WRITERS 8
+#define NUM_READERS 4
+#define RECORDS_PER_WRITER 40
+#define RECORD_SIZE 100
+#define FILE_SIZE (NUM_WRITERS * RECORDS_PER_WRITER * RECORD_SIZE)
+
+static char const *path = "/f1";
+static atomic_int writers_done = 0;
+
+void *writer_func(void *params_v) {
+    char id = *(char *)params_v;
+    char record[RECORD_SIZE];
+    memset(record, id, sizeof(record));
+
+    int fd = tfs_open(path, TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < RECORDS_PER_WRITER; i++) {
+        assert(tfs_write(fd, record, sizeof(record)) == sizeof(record));
+    }
+    assert(tfs_close(fd) == 0);
+
+    atomic_fetch_add(&writers_done, 1);
+    return NULL;
+}
+
+void *reader_func(void *params_v) {
+    (void)params_v;
+    char *buffer = malloc(FILE_SIZE);
+    assert(buffer != NULL);
+
+    bool done;
+    do {
+        done = atomic_load(&writers_done) == NUM_WRITERS;
+
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        ssize_t r = tfs_read(fd, buffer, FILE_SIZE);
+        assert(r >= 0 && r % RECORD_SIZE == 0);
+        assert(tfs_close(fd) == 0);
+
+        for (ssize_t i = 0; i < r; i += RECORD_SIZE) {
+            assert(buffer[i] >= 'a' && buffer[i] < 'a' + NUM_WRITERS);
+            for (int j = 1; j < RECORD_SIZE; j++) {
+                assert(buffer[i + j] == buffer[i]);
+            }
+        }
+
+        if (done) {
+            assert(r == FILE_SIZE);
+        }
+    } while (!done);
+
+    free(buffer);
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    char ids[NUM_WRITERS];
+    pthread_t writers[NUM_WRITERS], readers[NUM_READERS];
+
+    for (int i = 0; i < NUM_READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, reader_func, NULL) == 0);
+    }
+    for (int i = 0; i < NUM_WRITERS; i++) {
+        ids[i] = 'a' + (char)i;
+        assert(pthread_create(&writers[i], NULL, writer_func, &ids[i]) == 0);
+    }
+
+    for (int i = 0; i < NUM_WRITERS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    for (int i = 0; i < NUM_READERS; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    /* Every writer's records are in the file */
+    char record[RECORD_SIZE];
+    int count[NUM_WRITERS] = {0};
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (int i = 0; i < NUM_WRITERS * RECORDS_PER_WRITER; i++) {
+        assert(tfs_read(fd, record, sizeof(record)) == sizeof(record));
+        count[record[0] - 'a']++;
+    }
+    assert(tfs_read(fd, record, sizeof(record)) == 0);
+    assert(tfs_close(fd) != -1);
+
+    for (int i = 0; i < NUM_WRITERS; i++) {
+        assert(count[i] == RECORDS_PER_WRITER);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Copies ranges between files (aligned, so that whole blocks are shared, and
+ * unaligned), and within a file, checking the data copied and that later
+ * writes to either file are not visible in the other. Then copies between two
+ * files in both directions concurrently.
+ */
+
+#define SRC_SIZE (5 * BLOCK_SIZE + 100)
+#define NUM_THREADS 4
+#define COPIES_PER_THREAD 20
+
+static char expected(size_t offset) { return (char)('a' + offset % 23); }
+
+static char buf[2 * SRC_SIZE];
+
+typedef struct {
+    int from;
+    int to;
+} thread_params_t;
+
+void *thread_func(void *params_v) {
+    thread_params_t *params = (thread_params_t *)params_v;
+    for (int i = 0; i < COPIES_PER_THREAD; i++) {
+        assert(tfs_copy_file_range(params->from, 0, params->to, 0, SRC_SIZE) ==
+               SRC_SIZE);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < SRC_SIZE; i++) {
+        buf[i] = expected(i);
+    }
+
+    int src = tfs_open("/src", TFS_O_CREAT);
+    int dst = tfs_open("/dst", TFS_O_CREAT);
+    assert(src != -1 && dst != -1);
+    assert(tfs_write(src, buf, SRC_SIZE) == SRC_SIZE);
+
+    /* Out of bounds */
+    assert(tfs_copy_file_range(src, SRC_SIZE + 1, dst, 0, 1) == -1);
+    assert(tfs_copy_file_range(src, 0, dst, MAX_FILE_SIZE + 1, 1) == -1);
+    assert(tfs_copy_file_range(src, 0, -1, 0, 1) == -1);
+    assert(tfs_copy_file_range(src, SRC_SIZE, dst, 0, 1) == 0);
+
+    /* Aligned copy of the whole file, clamped to its size */
+    assert(tfs_copy_file_range(src, 0, dst, 0, 2 * SRC_SIZE) == SRC_SIZE);
+    assert(tfs_pread(dst, buf, sizeof(buf), 0) == SRC_SIZE);
+    for (size_t i = 0; i < SRC_SIZE; i++) {
+        assert(buf[i] == expected(i));
+    }
+
+    /* Writes to either file do not show in the other */
+    assert(tfs_pwrite(src, "X", 1, BLOCK_SIZE) == 1);
+    assert(tfs_pwrite(dst, "Y", 1, 2 * BLOCK_SIZE) == 1);
+    assert(tfs_pread(src, buf, 1, 2 * BLOCK_SIZE) == 1);
+    assert(buf[0] == expected(2 * BLOCK_SIZE));
+    assert(tfs_pread(dst, buf, 1, BLOCK_SIZE) == 1);
+    assert(buf[0] == expected(BLOCK_SIZE));
+
+    /* Undo the writes */
+    char c = expected(BLOCK_SIZE);
+    assert(tfs_pwrite(src, &c, 1, BLOCK_SIZE) == 1);
+    c = expected(2 * BLOCK_SIZE);
+    assert(tfs_pwrite(dst, &c, 1, 2 * BLOCK_SIZE) == 1);
+
+    /* Unaligned copy, past the end of the destination */
+    size_t dst_off = SRC_SIZE + BLOCK_SIZE + 7;
+    assert(tfs_copy_file_range(src, 10, dst, dst_off, 3 * BLOCK_SIZE) ==
+           3 * BLOCK_SIZE);
+    assert(tfs_pread(dst, buf, sizeof(buf), SRC_SIZE) ==
+           BLOCK_SIZE + 7 + 3 * BLOCK_SIZE);
+    for (size_t i = 0; i < BLOCK_SIZE + 7; i++) {
+        assert(buf[i] == 0);
+    }
+    for (size_t i = 0; i < 3 * BLOCK_SIZE; i++) {
+        assert(buf[BLOCK_SIZE + 7 + i] == expected(10 + i));
+    }
+
+    /* Within the same file: overlapping ranges are rejected */
+    assert(tfs_copy_file_range(src, 0, src, 10, 20) == -1);
+    assert(tfs_copy_file_range(src, 0, src, SRC_SIZE, SRC_SIZE) == SRC_SIZE);
+    assert(tfs_pread(src, buf, sizeof(buf), 0) == 2 * SRC_SIZE);
+    for (size_t i = 0; i < 2 * SRC_SIZE; i++) {
+        assert(buf[i] == expected(i % SRC_SIZE));
+    }
+
+    /* Concurrent copies in both directions */
+    thread_params_t params[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        params[i].from = i % 2 == 0 ? src : dst;
+        params[i].to = i % 2 == 0 ? dst : src;
+        assert(pthread_create(&threads[i], NULL, thread_func, &params[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* Both files start with the original data */
+    int fds[] = {src, dst};
+    for (int f = 0; f < 2; f++) {
+        assert(tfs_pread(fds[f], buf, SRC_SIZE, 0) == SRC_SIZE);
+        for (size_t i = 0; i < SRC_SIZE; i++) {
+            assert(buf[i] == expected(i));
+        }
+    }
+
+    assert(tfs_close(src) != -1);
+    assert(tfs_close(dst) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
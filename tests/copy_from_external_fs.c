@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Imports external files (empty, small and spanning indirect blocks) into
+ * TecnicoFS, overwriting an existing file, and checks their contents. Files
+ * too large for TecnicoFS are rejected.
+ */
+
+#define LARGE_SIZE (INODE_DIRECT_REFS * BLOCK_SIZE * 3 + 123)
+
+static char data[MAX_FILE_SIZE + 1];
+static char to_read[MAX_FILE_SIZE + 1];
+
+static void write_external(char const *path, size_t len) {
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    assert(fwrite(data, 1, len, fp) == len);
+    assert(fclose(fp) != -1);
+}
+
+static void check_file(char const *path, size_t len) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, to_read, sizeof(to_read)) == len);
+    assert(memcmp(to_read, data, len) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    char *path = "/f1";
+    char *external = "external_import.bin";
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 31 % 251);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* The source must exist */
+    assert(tfs_copy_from_external_fs("missing_file.bin", path) == -1);
+
+    /* Overwrites an existing (longer) file */
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "garbage", 7) == 7);
+    assert(tfs_close(fd) != -1);
+
+    write_external(external, 5);
+    assert(tfs_copy_from_external_fs(external, path) == 0);
+    check_file(path, 5);
+
+    write_external(external, 0);
+    assert(tfs_copy_from_external_fs(external, path) == 0);
+    check_file(path, 0);
+
+    write_external(external, LARGE_SIZE);
+    assert(tfs_copy_from_external_fs(external, "/f2") == 0);
+    check_file("/f2", LARGE_SIZE);
+
+    /* Round trip through an export */
+    assert(tfs_copy_to_external_fs("/f2", external) == 0);
+    assert(tfs_copy_from_external_fs(external, path) == 0);
+    check_file(path, LARGE_SIZE);
+
+    /* Too large */
+    write_external(external, MAX_FILE_SIZE + 1);
+    assert(tfs_copy_from_external_fs(external, path) == -1);
+    check_file(path, LARGE_SIZE);
+
+    write_external(external, MAX_FILE_SIZE);
+    assert(tfs_copy_from_external_fs(external, path) == 0);
+    check_file(path, MAX_FILE_SIZE);
+
+    unlink(external);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Exports a file spanning indirect blocks, with a hole and with writes still
+ * buffered by an open file handle, and checks the external file's contents.
+ */
+
+#define DATA_SIZE (INODE_DIRECT_REFS * BLOCK_SIZE * 2 + 77)
+#define HOLE_SIZE (3 * BLOCK_SIZE)
+#define FILE_SIZE (DATA_SIZE + HOLE_SIZE + 1)
+
+static char data[FILE_SIZE];
+static char to_read[FILE_SIZE + 1];
+
+int main() {
+    char *path = "/f1";
+    char *external = "external_export.bin";
+
+    for (size_t i = 0; i < DATA_SIZE; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+    data[FILE_SIZE - 1] = '!';
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, DATA_SIZE) == DATA_SIZE);
+    assert(tfs_lseek(fd, HOLE_SIZE, TFS_SEEK_CUR) == DATA_SIZE + HOLE_SIZE);
+    assert(tfs_write(fd, "!", 1) == 1);
+
+    /* The last byte is still buffered by the handle */
+    assert(tfs_copy_to_external_fs(path, external) == 0);
+    assert(tfs_close(fd) != -1);
+
+    FILE *fp = fopen(external, "r");
+    assert(fp != NULL);
+    assert(fread(to_read, 1, sizeof(to_read), fp) == FILE_SIZE);
+    assert(fclose(fp) != -1);
+    assert(memcmp(to_read, data, FILE_SIZE) == 0);
+
+    /* Exporting an empty file truncates the external file */
+    fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_copy_to_external_fs(path, external) == 0);
+
+    fp = fopen(external, "r");
+    assert(fp != NULL);
+    assert(fread(to_read, 1, sizeof(to_read), fp) == 0);
+    assert(fclose(fp) != -1);
+
+    unlink(external);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Writes the same blocks to many files with deduplication enabled: more
+ * files fit than the data blocks could hold, blocks of zeros are left as
+ * holes, changing a shared block leaves the other files as they were, and the
+ * blocks are freed with the last file using them, so distinct data fills the
+ * file system again. A whole block written over a mapped file does not wait
+ * for the mapping. Threads write identical files concurrently.
+ */
+
+#define DUP_FILES (8)
+#define UNIQUE_FILES (3)
+#define THREADS (4)
+#define TEMPLATE_BLOCKS (4)
+
+static char data[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void check(char const *path, char const *expected, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, sizeof(buf)) == size);
+    assert(memcmp(buf, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void *write_file(void *arg) {
+    char path[] = "/t0";
+    path[2] = (char)('0' + (int)(size_t)arg);
+
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    for (size_t i = 0; i < MAX_FILE_SIZE; i += BLOCK_SIZE) {
+        assert(tfs_write(fd, data + i, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+int main() {
+    char path[] = "/f0";
+
+    /* A few distinct blocks, repeated */
+    for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+        size_t block = i / BLOCK_SIZE % TEMPLATE_BLOCKS;
+        data[i] = (char)('a' + (i * (block + 1)) % 26);
+    }
+
+    assert(tfs_init_flags(TFS_MOUNT_DEDUP) != -1);
+
+    /* As is, the files would need more blocks than the file system has */
+    assert(DUP_FILES * MAX_FILE_SIZE > DATA_BLOCKS * BLOCK_SIZE);
+    for (int i = 0; i < DUP_FILES; i++) {
+        path[2] = (char)('0' + i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+    for (int i = 0; i < DUP_FILES; i++) {
+        path[2] = (char)('0' + i);
+        check(path, data, MAX_FILE_SIZE);
+    }
+
+    /* Changing part of a shared block copies it */
+    int fd = tfs_open("/f0", 0);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, "changed", 7, BLOCK_SIZE + 3) == 7);
+    assert(tfs_close(fd) != -1);
+    memcpy(buf, data, MAX_FILE_SIZE);
+    check("/f1", data, MAX_FILE_SIZE);
+    memcpy(data + BLOCK_SIZE + 3, "changed", 7);
+    check("/f0", data, MAX_FILE_SIZE);
+    memcpy(data + BLOCK_SIZE + 3, buf + BLOCK_SIZE + 3, 7);
+
+    /* Blocks of zeros are holes */
+    static char const zeros[2 * BLOCK_SIZE];
+    fd = tfs_open("/zeros", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, zeros, sizeof(zeros)) == sizeof(zeros));
+    assert(tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_HOLE) == 0);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_DATA) == sizeof(zeros));
+    assert(tfs_close(fd) != -1);
+
+    /* A whole block written over a mapping swaps the block, which the
+     * mapping keeps */
+    file_map_t map;
+    fd = tfs_open("/mapped", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_read_map(fd, 0, BLOCK_SIZE, &map) == 0);
+    assert(map.fm_count == 1 && map.fm_spans[0].s_len == BLOCK_SIZE);
+    assert(tfs_pwrite(fd, data + BLOCK_SIZE, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(memcmp(map.fm_spans[0].s_data, data, BLOCK_SIZE) == 0);
+    assert(tfs_read_unmap(&map) == 0);
+    assert(tfs_close(fd) != -1);
+    check("/mapped", data + BLOCK_SIZE, BLOCK_SIZE);
+
+    /* Threads writing the same blocks share them too */
+    pthread_t tids[THREADS];
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, write_file, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        char thread_path[] = "/t0";
+        thread_path[2] = (char)('0' + i);
+        check(thread_path, data, MAX_FILE_SIZE);
+    }
+    assert(tfs_verify(2) == 0);
+
+    /* Once no file uses them, the blocks hold distinct data */
+    for (int i = 0; i < DUP_FILES; i++) {
+        path[2] = (char)('0' + i);
+        assert(tfs_truncate(path, 0) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        char thread_path[] = "/t0";
+        thread_path[2] = (char)('0' + i);
+        assert(tfs_truncate(thread_path, 0) == 0);
+    }
+    assert(tfs_truncate("/zeros", 0) == 0);
+    assert(tfs_truncate("/mapped", 0) == 0);
+
+    for (int i = 0; i < UNIQUE_FILES; i++) {
+        for (size_t j = 0; j < MAX_FILE_SIZE; j += BLOCK_SIZE) {
+            snprintf(data + j, BLOCK_SIZE, "file %d block %zu", i, j);
+        }
+        path[2] = (char)('0' + i);
+        fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        assert(tfs_close(fd) != -1);
+        check(path, data, MAX_FILE_SIZE);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Exports the whole file system to a host directory with several workers:
+ * a file much larger than the others (split into many ranges), small files,
+ * an empty file and a sparse file, and checks every exported file. Files
+ * named so as to escape the directory make the export fail, without writing
+ * outside it.
+ */
+
+#define FILE_COUNT (6)
+#define LARGE_SIZE (MAX_FILE_SIZE - 123)
+#define SPARSE_SIZE (40 * BLOCK_SIZE + 1)
+
+static char large[LARGE_SIZE];
+static char to_read[LARGE_SIZE + 1];
+
+static char const *names[FILE_COUNT] = {"large", "small1", "small2",
+                                        "empty", "sparse", "tiny"};
+
+static void expected(int i, char const **data, size_t *size) {
+    static char sparse[SPARSE_SIZE];
+    switch (i) {
+    case 0:
+        *data = large;
+        *size = LARGE_SIZE;
+        break;
+    case 3:
+        *data = "";
+        *size = 0;
+        break;
+    case 4:
+        sparse[SPARSE_SIZE - 1] = 's';
+        *data = sparse;
+        *size = SPARSE_SIZE;
+        break;
+    case 5:
+        *data = "t";
+        *size = 1;
+        break;
+    default:
+        *data = large + i;
+        *size = 3 * BLOCK_SIZE + (size_t)i;
+        break;
+    }
+}
+
+int main() {
+    char const *host_dir = "export_all_dir";
+    char path[MAX_FILE_NAME + 2];
+    char host_path[64];
+
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('a' + i % 23);
+    }
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char const *data;
+        size_t size;
+        expected(i, &data, &size);
+        snprintf(path, sizeof(path), "/%s", names[i]);
+
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        if (i == 4) {
+            /* Only the last byte is written, the rest is a hole */
+            assert(tfs_lseek(fd, SPARSE_SIZE - 1, TFS_SEEK_SET) ==
+                   SPARSE_SIZE - 1);
+            assert(tfs_write(fd, "s", 1) == 1);
+        } else if (size > 0) {
+            assert(tfs_write(fd, data, size) == size);
+        }
+        assert(tfs_close(fd) != -1);
+    }
+
+    /* Invalid worker counts and a missing directory are rejected */
+    assert(tfs_export_all(host_dir, 0) == -1);
+    assert(tfs_export_all(host_dir, BULK_MAX_THREADS + 1) == -1);
+    rmdir(host_dir);
+    assert(tfs_export_all(host_dir, 4) == -1);
+
+    assert(mkdir(host_dir, 0777) == 0);
+    assert(tfs_export_all(host_dir, 4) == 0);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char const *data;
+        size_t size;
+        expected(i, &data, &size);
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, names[i]);
+
+        FILE *fp = fopen(host_path, "r");
+        assert(fp != NULL);
+        assert(fread(to_read, 1, sizeof(to_read), fp) == size);
+        assert(fclose(fp) != -1);
+        assert(memcmp(to_read, data, size) == 0);
+        unlink(host_path);
+    }
+
+    /* A name with a '/' (only the leading one is the root's) or ".." */
+    FILE *fp = fopen("escape", "w");
+    assert(fp != NULL);
+    assert(fputs("keep", fp) != EOF);
+    assert(fclose(fp) != -1);
+    int fd = tfs_open("/../escape", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "overwritten", 11) == 11);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_export_all(host_dir, 4) == -1);
+
+    fp = fopen("escape", "r");
+    assert(fp != NULL);
+    assert(fread(to_read, 1, sizeof(to_read), fp) == 4);
+    assert(fclose(fp) != -1);
+    assert(memcmp(to_read, "keep", 4) == 0);
+    unlink("escape");
+
+    assert(tfs_destroy() != -1);
+    assert(tfs_init() != -1);
+    fd = tfs_open("/..", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_export_all(host_dir, 4) == -1);
+
+    /* Files exported before the export failed */
+    for (int i = 0; i < FILE_COUNT; i++) {
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, names[i]);
+        unlink(host_path);
+    }
+
+    assert(rmdir(host_dir) == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
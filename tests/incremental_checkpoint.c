@@ -0,0 +1,145 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Takes incremental checkpoints: the first holds the whole volume, later ones
+ * only what changed, a checkpoint taken while a file is appended to holds
+ * whole appends, and a chain of checkpoints is restored into an image as of
+ * its last one, while broken or corrupted chains are rejected.
+ */
+
+#define RECORD (300)
+#define RECORDS (600)
+
+static char const *image_path = "incremental_checkpoint.img";
+static char const *paths[] = {"incremental_checkpoint.1",
+                              "incremental_checkpoint.2",
+                              "incremental_checkpoint.3",
+                              "incremental_checkpoint.4",
+                              "incremental_checkpoint.5"};
+static char data[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void check(char const *path, char const *expected, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, sizeof(buf)) == size);
+    assert(memcmp(buf, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void write_file(char const *path, char const *contents, size_t size) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, size) == size);
+    assert(tfs_close(fd) != -1);
+}
+
+static off_t file_size(char const *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+static void *append_records(void *arg) {
+    (void)arg;
+    int fd = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(fd != -1);
+    for (size_t i = 0; i < RECORDS; i++) {
+        assert(tfs_write(fd, data + i * RECORD, RECORD) == RECORD);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 19 + i / 3000);
+    }
+
+    /* The first checkpoint holds every file */
+    assert(tfs_init() != -1);
+    write_file("/a", data, MAX_FILE_SIZE);
+    write_file("/b", data + 5, MAX_FILE_SIZE / 2);
+    assert(tfs_checkpoint(paths[0]) == 0);
+    assert(file_size(paths[0]) > (off_t)(MAX_FILE_SIZE * 3 / 2));
+
+    /* Later ones only what changed */
+    int fd = tfs_open("/a", 0);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, "changed", 7, 3 * BLOCK_SIZE + 10) == 7);
+    assert(tfs_close(fd) != -1);
+    write_file("/c", "small", 5);
+    assert(tfs_checkpoint(paths[1]) == 0);
+    assert(file_size(paths[1]) < file_size(paths[0]) / 4);
+
+    assert(tfs_checkpoint(paths[2]) == 0);
+    assert(file_size(paths[2]) < file_size(paths[1]) - 2 * BLOCK_SIZE);
+
+    /* Appends are either in a checkpoint or not */
+    write_file("/log", data, 0);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, append_records, NULL) == 0);
+    assert(tfs_checkpoint(paths[3]) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(tfs_truncate("/b", BLOCK_SIZE) == 0);
+    assert(tfs_checkpoint(paths[4]) == 0);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_restore(image_path, paths, 4) == 0);
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    fd = tfs_open("/log", 0);
+    assert(fd != -1);
+    ssize_t size = tfs_read(fd, buf, sizeof(buf));
+    assert(size >= 0 && size % RECORD == 0);
+    assert(memcmp(buf, data, (size_t)size) == 0);
+    assert(tfs_close(fd) != -1);
+    check("/b", data + 5, MAX_FILE_SIZE / 2);
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    /* The whole chain restores the volume as of its last checkpoint */
+    assert(tfs_restore(image_path, paths, 5) == 0);
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    memcpy(data + 3 * BLOCK_SIZE + 10, "changed", 7);
+    check("/a", data, MAX_FILE_SIZE);
+    check("/b", data + 5, BLOCK_SIZE);
+    check("/c", "small", 5);
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    /* Chains with a checkpoint missing, or not starting with the first, are
+     * rejected, and so are corrupted checkpoints */
+    char const *gap[] = {paths[0], paths[2]};
+    assert(tfs_restore(image_path, gap, 2) == -1);
+    assert(tfs_restore(image_path, paths + 1, 2) == -1);
+
+    int host_fd = open(paths[1], O_WRONLY);
+    assert(host_fd != -1);
+    assert(pwrite(host_fd, "x", 1, file_size(paths[1]) - 1) == 1);
+    assert(close(host_fd) == 0);
+    assert(tfs_restore(image_path, paths, 2) == -1);
+
+    /* A new chain starts with every mount */
+    assert(tfs_init() != -1);
+    assert(tfs_checkpoint(paths[2]) == 0);
+    assert(tfs_destroy() != -1);
+    char const *mixed[] = {paths[0], paths[2]};
+    assert(tfs_restore(image_path, mixed, 2) == -1);
+    assert(tfs_restore(image_path, paths + 2, 1) == 0);
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        unlink(paths[i]);
+    }
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
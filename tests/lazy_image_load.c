@@ -0,0 +1,102 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Loads an image lazily: right after mounting it (with its pages dropped from
+ * the host's cache), files are read and written while the readahead thread
+ * loads the rest of the image in the background, and the changes persist.
+ */
+
+#define FILES (3)
+
+static char const *image_path = "lazy_image_load.img";
+static char data[FILES][MAX_FILE_SIZE];
+static char buf[FILES][MAX_FILE_SIZE];
+
+static void check(char const *path, char const *expected, char *buffer) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(memcmp(buffer, expected, MAX_FILE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void *check_file(void *arg) {
+    size_t f = (size_t)arg;
+    char path[] = "/f0";
+    path[2] = (char)('0' + f);
+    check(path, data[f], buf[f]);
+    return NULL;
+}
+
+/* Drops the image's pages from the host's cache, as after a reboot */
+static void drop_cache() {
+    int fd = open(image_path, O_RDONLY);
+    assert(fd != -1);
+    assert(fdatasync(fd) == 0);
+    assert(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+    assert(close(fd) == 0);
+}
+
+int main() {
+    char path[] = "/f0";
+    unlink(image_path);
+
+    assert(tfs_init_image(image_path, 0) != -1);
+    for (size_t f = 0; f < FILES; f++) {
+        for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+            data[f][i] = (char)('A' + f + i % 31);
+        }
+        path[2] = (char)('0' + f);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, data[f], MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    /* Files are served at once, while the rest of the image loads */
+    drop_cache();
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    pthread_t tids[FILES - 1];
+    for (size_t f = 1; f < FILES; f++) {
+        assert(pthread_create(&tids[f - 1], NULL, check_file, (void *)f) ==
+               0);
+    }
+
+    memset(data[0] + BLOCK_SIZE / 2, 'z', 3 * BLOCK_SIZE);
+    int fd = tfs_open("/f0", 0);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, data[0] + BLOCK_SIZE / 2, 3 * BLOCK_SIZE,
+                      BLOCK_SIZE / 2) == 3 * BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+    check("/f0", data[0], buf[0]);
+
+    for (size_t f = 1; f < FILES; f++) {
+        assert(pthread_join(tids[f - 1], NULL) == 0);
+    }
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    /* The writes made while loading persist */
+    drop_cache();
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    for (size_t f = 0; f < FILES; f++) {
+        path[2] = (char)('0' + f);
+        check(path, data[f], buf[f]);
+    }
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink("lazy_image_load.img.journal");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Journals the metadata of an image: files threads create, write and sync
+ * concurrently (sharing commits) are found intact after a crash, simulated by
+ * a child process that exits without destroying the file system; a record
+ * torn by a crash is ignored; and blocks freed by committed truncations are
+ * reused.
+ */
+
+#define THREADS (3)
+
+static char const *image_path = "metadata_journal.img";
+static char const *journal_path = "metadata_journal.img.journal";
+static char data[THREADS][MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void fill(char generation) {
+    for (size_t t = 0; t < THREADS; t++) {
+        for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+            data[t][i] = (char)(generation + t + i % 23);
+        }
+    }
+}
+
+static void check(char const *path, char const *expected, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, sizeof(buf)) == size);
+    assert(memcmp(buf, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static off_t journal_size() {
+    struct stat st;
+    assert(stat(journal_path, &st) == 0);
+    return st.st_size;
+}
+
+static void *write_file(void *arg) {
+    size_t t = (size_t)arg;
+    char path[] = "/f0";
+    path[2] = (char)('0' + t);
+
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    for (size_t i = 0; i < MAX_FILE_SIZE; i += 4 * BLOCK_SIZE + 3) {
+        size_t len = MAX_FILE_SIZE - i < 4 * BLOCK_SIZE + 3
+                         ? MAX_FILE_SIZE - i
+                         : 4 * BLOCK_SIZE + 3;
+        assert(tfs_write(fd, data[t] + i, len) == len);
+    }
+    assert(tfs_fsync(fd) != -1);
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+/* Writes the files from threads, and crashes */
+static void write_and_crash() {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init_image(image_path, 0) != -1);
+        pthread_t tids[THREADS];
+        for (size_t t = 0; t < THREADS; t++) {
+            assert(pthread_create(&tids[t], NULL, write_file, (void *)t) == 0);
+        }
+        for (size_t t = 0; t < THREADS; t++) {
+            assert(pthread_join(tids[t], NULL) == 0);
+        }
+        _exit(journal_size() > 0 ? 0 : 1);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+    char path[] = "/f0";
+    unlink(image_path);
+    unlink(journal_path);
+
+    /* The committed changes are replayed after a crash */
+    fill('a');
+    write_and_crash();
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    assert(journal_size() == 0);
+    for (int t = 0; t < THREADS; t++) {
+        path[2] = (char)('0' + t);
+        check(path, data[t], MAX_FILE_SIZE);
+    }
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    /* The files are rewritten (reusing the blocks the truncations freed), and
+     * a record torn by the crash is left at the end of the journal */
+    fill('k');
+    write_and_crash();
+    int fd = open(journal_path, O_WRONLY | O_APPEND);
+    assert(fd != -1);
+    assert(write(fd, "tjournal", 8) == 8);
+    assert(write(fd, data[0], 100) == 100);
+    assert(close(fd) == 0);
+
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    for (int t = 0; t < THREADS; t++) {
+        path[2] = (char)('0' + t);
+        check(path, data[t], MAX_FILE_SIZE);
+    }
+    assert(tfs_verify(2) == 0);
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
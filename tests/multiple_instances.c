@@ -0,0 +1,142 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Runs independent file system instances in one process: threads write files
+ * with the same names to each instance (and to the default one) concurrently,
+ * and each instance only holds its own; file handles and queues are per
+ * instance; and an instance on an image finds its files after being
+ * destroyed and initialized again.
+ */
+
+#define INSTANCES (3)
+#define FILES (4)
+#define FILE_SIZE (BLOCK_SIZE * (INODE_DIRECT_REFS + 3) + 17)
+
+static char const *image_path = "multiple_instances.img";
+static char const *journal_path = "multiple_instances.img.journal";
+static tfs_t *instances[INSTANCES];
+static char data[INSTANCES + 1][FILE_SIZE];
+
+/* Contents of the files of an instance (INSTANCES for the default one) */
+static void fill(size_t i) {
+    for (size_t j = 0; j < FILE_SIZE; j++) {
+        data[i][j] = (char)('a' + i + j % 19);
+    }
+}
+
+static void file_path(char *path, size_t f) { snprintf(path, 8, "/f%zu", f); }
+
+static void *write_files(void *arg) {
+    size_t i = (size_t)arg;
+    tfs_t *fs = i < INSTANCES ? instances[i] : NULL;
+    char path[8];
+    for (size_t f = 0; f < FILES; f++) {
+        file_path(path, f);
+        int fd = fs != NULL ? tfs_open_r(fs, path, TFS_O_CREAT)
+                            : tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        ssize_t written = fs != NULL ? tfs_write_r(fs, fd, data[i], FILE_SIZE)
+                                     : tfs_write(fd, data[i], FILE_SIZE);
+        assert(written == FILE_SIZE);
+        assert((fs != NULL ? tfs_close_r(fs, fd) : tfs_close(fd)) != -1);
+    }
+    return NULL;
+}
+
+static void check_files(tfs_t *fs, size_t i) {
+    static char buf[FILE_SIZE + 1];
+    char path[8];
+    for (size_t f = 0; f < FILES; f++) {
+        file_path(path, f);
+        int fd = tfs_open_r(fs, path, 0);
+        assert(fd != -1);
+        assert(tfs_read_r(fs, fd, buf, sizeof(buf)) == FILE_SIZE);
+        assert(memcmp(buf, data[i], FILE_SIZE) == 0);
+        assert(tfs_close_r(fs, fd) != -1);
+    }
+}
+
+int main() {
+    unlink(image_path);
+    unlink(journal_path);
+
+    tfs_params_t params;
+    tfs_params_init(&params);
+    params.tp_delay = 0;
+    for (size_t i = 0; i < INSTANCES; i++) {
+        instances[i] = tfs_instance_create();
+        assert(instances[i] != NULL);
+        params.tp_image_path = i == 0 ? image_path : NULL;
+        params.tp_data_blocks = DATA_BLOCKS * (i + 1);
+        assert(tfs_init_with_params_r(instances[i], &params) != -1);
+    }
+    assert(tfs_init() != -1);
+
+    pthread_t tids[INSTANCES + 1];
+    for (size_t i = 0; i <= INSTANCES; i++) {
+        fill(i);
+        assert(pthread_create(&tids[i], NULL, write_files, (void *)i) == 0);
+    }
+    for (size_t i = 0; i <= INSTANCES; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    for (size_t i = 0; i < INSTANCES; i++) {
+        check_files(instances[i], i);
+    }
+    check_files(NULL, INSTANCES);
+
+    /* A file only exists in the instance it was created in */
+    assert(tfs_open_r(instances[1], "/only", TFS_O_CREAT) != -1);
+    assert(tfs_lookup_r(instances[1], "/only") != -1);
+    assert(tfs_lookup_r(instances[2], "/only") == -1);
+    assert(tfs_lookup("/only") == -1);
+
+    /* Each instance has its own open file table: the handle left open in
+     * instance 1 is not open in instance 2 */
+    int fd = tfs_open_r(instances[2], "/f0", 0);
+    assert(fd != -1);
+    assert(tfs_close_r(instances[2], fd) != -1);
+    assert(tfs_close_r(instances[2], fd) == -1);
+    assert(tfs_close_r(instances[1], fd) != -1);
+
+    /* A queue executes its requests on the instance it was created on */
+    tfs_queue_t *queue = tfs_queue_create_r(instances[2], 4, 2);
+    assert(queue != NULL);
+    tfs_request_t request = {
+        .rq_op = TFS_OP_OPEN, .rq_name = "/queued", .rq_flags = TFS_O_CREAT};
+    assert(tfs_submit(queue, &request, 1) == 1);
+    tfs_completion_t completion;
+    assert(tfs_reap(queue, &completion, 1, 1) == 1);
+    assert(completion.cq_result != -1);
+    assert(tfs_queue_destroy(queue) != -1);
+    assert(tfs_lookup_r(instances[2], "/queued") != -1);
+    assert(tfs_lookup("/queued") == -1);
+    assert(tfs_close_r(instances[2], (int)completion.cq_result) != -1);
+
+    /* The instance on an image keeps its files */
+    params.tp_image_path = image_path;
+    params.tp_data_blocks = DATA_BLOCKS;
+    assert(tfs_destroy_r(instances[0]) != -1);
+    assert(tfs_init_with_params_r(instances[0], &params) != -1);
+    check_files(instances[0], 0);
+
+    for (size_t i = 0; i < INSTANCES; i++) {
+        assert(tfs_destroy_r(instances[i]) != -1);
+        tfs_instance_free(instances[i]);
+    }
+    check_files(NULL, INSTANCES);
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Multiple threads repeatedly overwrite disjoint chunks of the same file
+ * (each through its own file descriptor), while another thread reads whole
+ * chunks: a chunk read must never mix data from two different writes.
+ */
+
+#define NUM_THREADS 8
+#define CHUNK_SIZE (BLOCK_SIZE * 2)
+#define ROUNDS 20
+#define FILE_SIZE (NUM_THREADS * CHUNK_SIZE)
+
+static char const *path = "/f1";
+
+void *writer_func(void *id_v) {
+    int id = *(int *)id_v;
+    char buf[CHUNK_SIZE];
+
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(buf, 'a' + (i % 26), sizeof(buf));
+        assert(tfs_pwrite(fd, buf, sizeof(buf), (size_t)id * CHUNK_SIZE) ==
+               sizeof(buf));
+    }
+    assert(tfs_close(fd) == 0);
+    return NULL;
+}
+
+void *reader_func(void *arg) {
+    (void)arg;
+    char buf[CHUNK_SIZE];
+
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (int i = 0; i < ROUNDS * NUM_THREADS; i++) {
+        size_t offset = (size_t)(i % NUM_THREADS) * CHUNK_SIZE;
+        assert(tfs_pread(fd, buf, sizeof(buf), offset) == sizeof(buf));
+        for (size_t j = 1; j < sizeof(buf); j++) {
+            assert(buf[j] == buf[0]);
+        }
+    }
+    assert(tfs_close(fd) == 0);
+    return NULL;
+}
+
+int main() {
+    static char zeros[FILE_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, zeros, sizeof(zeros)) == sizeof(zeros));
+    assert(tfs_close(fd) == 0);
+
+    int ids[NUM_THREADS];
+    pthread_t writers[NUM_THREADS];
+    pthread_t reader;
+
+    assert(pthread_create(&reader, NULL, reader_func, NULL) == 0);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&writers[i], NULL, writer_func, &ids[i]) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(pthread_join(reader, NULL) == 0);
+
+    /* Every chunk holds the last round written to it */
+    char buf[FILE_SIZE];
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        assert(buf[i] == 'a' + (ROUNDS - 1) % 26);
+    }
+    assert(tfs_close(fd) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Keeps the file system in an image file: files written (plain, sparse,
+ * compressed and cloned) are found intact after remounting it, appends
+ * resume at their end, checksums still match, and images of another geometry
+ * or that are not images are rejected.
+ */
+
+#define LARGE_SIZE (MAX_FILE_SIZE - 77)
+#define HOLE_AT (20 * BLOCK_SIZE + 5)
+
+static char data[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void check(char const *path, char const *expected, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, sizeof(buf)) == size);
+    assert(memcmp(buf, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    char const *image_path = "persistent_image.img";
+    char const *bad_path = "persistent_image.bad";
+    unlink(image_path);
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 17 + i / 4096);
+    }
+
+    /* A new image is created */
+    assert(tfs_init_image(image_path, 0) != -1);
+    int fd = tfs_open("/large", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open("/sparse", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, "end", 3, HOLE_AT) == 3);
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open("/compressed", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_clone("/large", "/clone") == 0);
+    assert(tfs_destroy() != -1);
+
+    /* Remounting finds everything as it was */
+    assert(tfs_init_image(image_path, TFS_MOUNT_VERIFY) != -1);
+    check("/large", data, LARGE_SIZE);
+    check("/compressed", data, LARGE_SIZE);
+    check("/clone", data, LARGE_SIZE);
+    static char sparse[HOLE_AT + 3];
+    memcpy(sparse + HOLE_AT, "end", 3);
+    check("/sparse", sparse, sizeof(sparse));
+    assert(tfs_verify(2) == 0);
+
+    /* Appends resume at the end, and writes to the clone copy its blocks */
+    fd = tfs_open("/large", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, 77) == 77);
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open("/clone", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "changed", 7) == 7);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_image(image_path, 0) != -1);
+    memcpy(buf, data, LARGE_SIZE);
+    memcpy(data + LARGE_SIZE, buf, 77);
+    check("/large", data, LARGE_SIZE + 77);
+    memcpy(data, "changed", 7);
+    check("/clone", data, LARGE_SIZE);
+    assert(tfs_destroy() != -1);
+
+    /* Without the image, the file system starts empty */
+    assert(tfs_init() != -1);
+    assert(tfs_open("/large", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    /* Files that are not images of this file system are rejected */
+    int host_fd = open(bad_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    assert(host_fd != -1);
+    assert(write(host_fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(close(host_fd) == 0);
+    assert(tfs_init_image(bad_path, 0) == -1);
+
+    host_fd = open(image_path, O_RDWR);
+    assert(host_fd != -1);
+    assert(pwrite(host_fd, "x", 1, 0) == 1);
+    assert(close(host_fd) == 0);
+    assert(tfs_init_image(image_path, 0) == -1);
+
+    unlink(bad_path);
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
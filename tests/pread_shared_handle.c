@@ -0,0 +1,88 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Write a file with positional writes, then have multiple threads read it
+ * through one shared file descriptor with positional reads, and check that
+ * the descriptor's own offset was left untouched.
+ */
+
+#define NUM_THREADS 8
+#define CHUNK_SIZE (BLOCK_SIZE / 2)
+#define CHUNKS_PER_THREAD 4
+#define FILE_SIZE (NUM_THREADS * CHUNKS_PER_THREAD * CHUNK_SIZE)
+
+typedef struct {
+    int fd;
+    int id;
+} thread_params_t;
+
+static char expected(size_t offset) {
+    return (char)('a' + offset / CHUNK_SIZE % 26);
+}
+
+void *thread_func(void *params_v) {
+    thread_params_t *params = (thread_params_t *)params_v;
+    char buf[CHUNK_SIZE];
+
+    for (int i = 0; i < CHUNKS_PER_THREAD; i++) {
+        size_t offset =
+            (size_t)(params->id * CHUNKS_PER_THREAD + i) * CHUNK_SIZE;
+        assert(tfs_pread(params->fd, buf, sizeof(buf), offset) == sizeof(buf));
+        for (size_t j = 0; j < sizeof(buf); j++) {
+            assert(buf[j] == expected(offset + j));
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    char *path = "/f1";
+    char buf[CHUNK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+
+    for (size_t offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+        memset(buf, expected(offset), sizeof(buf));
+        assert(tfs_pwrite(fd, buf, sizeof(buf), offset) == sizeof(buf));
+    }
+
+    /* Positional writes past the maximum file size are rejected */
+    assert(tfs_pwrite(fd, buf, sizeof(buf), MAX_FILE_SIZE + 1) == -1);
+
+    /* The descriptor's offset is still at the beginning of the file */
+    assert(tfs_read(fd, buf, 1) == 1);
+    assert(buf[0] == expected(0));
+
+    thread_params_t params[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        params[i].fd = fd;
+        params[i].id = i;
+        assert(pthread_create(&threads[i], NULL, thread_func, &params[i]) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* Reading at the end of the file returns no bytes */
+    assert(tfs_pread(fd, buf, sizeof(buf), FILE_SIZE) == 0);
+
+    assert(tfs_read(fd, buf, 1) == 1);
+    assert(buf[0] == expected(1));
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
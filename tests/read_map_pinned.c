@@ -0,0 +1,99 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Write a file spanning several blocks and map a range of it in place.
+ * While mapped, another thread truncates the file: the truncation must wait
+ * until the mapping is released, so the mapped data stays intact. Then the
+ * thread holding a mapping of a cloned file writes to it: the write copies
+ * the shared block without waiting, and the mapping keeps the original data.
+ */
+
+#define FILE_SIZE (BLOCK_SIZE * 12 + 100)
+#define MAP_OFFSET (BLOCK_SIZE / 2)
+
+static int truncated;
+
+void *truncate_func(void *path) {
+    int fd = tfs_open((char const *)path, TFS_O_TRUNC);
+    assert(fd != -1);
+    __atomic_store_n(&truncated, 1, __ATOMIC_SEQ_CST);
+    assert(tfs_close(fd) == 0);
+    return NULL;
+}
+
+int main() {
+    char *path = "/f1";
+    static char input[FILE_SIZE];
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, input, sizeof(input)) == sizeof(input));
+
+    /* Mapping past the end of the file is clamped to the file size */
+    file_map_t map;
+    assert(tfs_read_map(fd, MAP_OFFSET, FILE_SIZE, &map) == 0);
+    assert(map.fm_count > 0);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, truncate_func, path) == 0);
+
+    struct timespec tim = {.tv_sec = 0, .tv_nsec = 50000000};
+    nanosleep(&tim, NULL);
+    assert(__atomic_load_n(&truncated, __ATOMIC_SEQ_CST) == 0);
+
+    size_t offset = MAP_OFFSET;
+    for (size_t i = 0; i < map.fm_count; i++) {
+        assert(memcmp(map.fm_spans[i].s_data, input + offset,
+                      map.fm_spans[i].s_len) == 0);
+        offset += map.fm_spans[i].s_len;
+    }
+    assert(offset == FILE_SIZE);
+
+    assert(tfs_read_unmap(&map) == 0);
+    assert(tfs_read_unmap(&map) == -1);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(__atomic_load_n(&truncated, __ATOMIC_SEQ_CST) == 1);
+
+    /* The file is now empty */
+    assert(tfs_read_map(fd, 0, FILE_SIZE, &map) == 0);
+    assert(map.fm_count == 0);
+    assert(tfs_read_unmap(&map) == 0);
+
+    assert(tfs_close(fd) != -1);
+
+    /* Writing to a mapped clone */
+    fd = tfs_open("/f2", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, input, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_clone("/f2", "/f3") == 0);
+    assert(tfs_read_map(fd, 0, 10, &map) == 0);
+    assert(map.fm_count == 1 && map.fm_spans[0].s_len == 10);
+    assert(tfs_pwrite(fd, "0123456789", 10, 0) == 10);
+    assert(memcmp(map.fm_spans[0].s_data, input, 10) == 0);
+    char buf[10];
+    assert(tfs_pread(fd, buf, 10, 0) == 10);
+    assert(memcmp(buf, "0123456789", 10) == 0);
+    assert(tfs_read_unmap(&map) == 0);
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open("/f3", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, 10) == 10);
+    assert(memcmp(buf, input, 10) == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
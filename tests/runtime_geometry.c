@@ -0,0 +1,144 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Chooses the geometry at run time: invalid parameters are rejected; a volume
+ * many times the default size (kept in huge pages if the host has them) holds
+ * more data than the default one could, with more files open at a time than
+ * the default; a small i-node table and open file table are enforced; and an
+ * image created with a geometry is only mounted again with it.
+ */
+
+#define BIG_BLOCKS (8 * DATA_BLOCKS)
+#define BIG_FILES (20)
+#define BIG_OPEN_FILES (4 * MAX_OPEN_FILES)
+#define SMALL_INODES (4)
+#define SMALL_OPEN_FILES (2)
+
+static char const *image_path = "runtime_geometry.img";
+static char const *journal_path = "runtime_geometry.img.journal";
+static char data[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+static void fill(size_t f) {
+    for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+        data[i] = (char)(f + i % 29);
+    }
+}
+
+static void write_file(char const *path, size_t f) {
+    fill(f);
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(tfs_close(fd) != -1);
+}
+
+static void check_file(char const *path, size_t f) {
+    fill(f);
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buf, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(memcmp(buf, data, MAX_FILE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void file_path(char *path, size_t f) {
+    snprintf(path, 8, "/f%zu", f);
+}
+
+int main() {
+    char path[8];
+    tfs_params_t params;
+    unlink(image_path);
+    unlink(journal_path);
+
+    /* Invalid parameters */
+    tfs_params_init(&params);
+    params.tp_block_size = BLOCK_SIZE / 2;
+    assert(tfs_init_with_params(&params) == -1);
+    tfs_params_init(&params);
+    params.tp_data_blocks = 0;
+    assert(tfs_init_with_params(&params) == -1);
+    tfs_params_init(&params);
+    params.tp_max_open_files = 0;
+    assert(tfs_init_with_params(&params) == -1);
+
+    /* A large volume holds more than the default one could */
+    assert(BIG_FILES * MAX_FILE_SIZE > DATA_BLOCKS * BLOCK_SIZE);
+    tfs_params_init(&params);
+    params.tp_data_blocks = BIG_BLOCKS;
+    params.tp_inode_table_size = BIG_FILES + 1;
+    params.tp_max_open_files = BIG_OPEN_FILES;
+    params.tp_delay = 0;
+    params.tp_huge_pages = 1;
+    assert(tfs_init_with_params(&params) != -1);
+    for (size_t f = 0; f < BIG_FILES; f++) {
+        file_path(path, f);
+        write_file(path, f);
+    }
+    for (size_t f = 0; f < BIG_FILES; f++) {
+        file_path(path, f);
+        check_file(path, f);
+    }
+
+    int fds[BIG_OPEN_FILES];
+    for (size_t f = 0; f < BIG_OPEN_FILES; f++) {
+        file_path(path, f % BIG_FILES);
+        assert((fds[f] = tfs_open(path, 0)) != -1);
+    }
+    assert(tfs_open("/f0", 0) == -1);
+    for (size_t f = 0; f < BIG_OPEN_FILES; f++) {
+        assert(tfs_close(fds[f]) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    /* Small tables are enforced */
+    tfs_params_init(&params);
+    params.tp_inode_table_size = SMALL_INODES;
+    params.tp_max_open_files = SMALL_OPEN_FILES;
+    assert(tfs_init_with_params(&params) != -1);
+    for (size_t f = 1; f < SMALL_INODES; f++) {
+        file_path(path, f);
+        assert((fds[f] = tfs_open(path, TFS_O_CREAT)) != -1);
+        assert(tfs_close(fds[f]) != -1);
+    }
+    assert(tfs_open("/extra", TFS_O_CREAT) == -1);
+    assert((fds[0] = tfs_open("/f1", 0)) != -1);
+    assert((fds[1] = tfs_open("/f2", 0)) != -1);
+    assert(tfs_open("/f3", 0) == -1);
+    assert(tfs_close(fds[0]) != -1);
+    assert(tfs_close(fds[1]) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* An image keeps its geometry */
+    tfs_params_init(&params);
+    params.tp_data_blocks = 2 * DATA_BLOCKS;
+    params.tp_inode_table_size = 2 * INODE_TABLE_SIZE;
+    params.tp_image_path = image_path;
+    params.tp_flags = TFS_MOUNT_VERIFY;
+    assert(tfs_init_with_params(&params) != -1);
+    for (size_t f = 0; f < 6; f++) {
+        file_path(path, f);
+        write_file(path, f);
+    }
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_image(image_path, 0) == -1);
+    assert(tfs_init_with_params(&params) != -1);
+    for (size_t f = 0; f < 6; f++) {
+        file_path(path, f);
+        check_file(path, f);
+    }
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
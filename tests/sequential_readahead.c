@@ -0,0 +1,67 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Write a large file and stream it sequentially, both with tfs_read and
+ * through tfs_copy_to_external_fs, checking that data read while the next
+ * blocks are being prefetched is correct. Then read it at scattered offsets.
+ */
+
+#define FILE_SIZE (BLOCK_SIZE * 200 + 17)
+#define READ_SIZE (BLOCK_SIZE / 4)
+
+int main() {
+    char *path = "/f1";
+    char *external_path = "external_file.txt";
+    static char input[FILE_SIZE];
+    static char output[FILE_SIZE];
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = (char)('a' + i * 7 % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, input, sizeof(input)) == sizeof(input));
+    assert(tfs_close(fd) != -1);
+
+    /* Sequential reads */
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (size_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+        size_t len = FILE_SIZE - offset < READ_SIZE ? FILE_SIZE - offset
+                                                     : READ_SIZE;
+        assert(tfs_read(fd, output + offset, READ_SIZE) == (ssize_t)len);
+    }
+    assert(tfs_read(fd, output, READ_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(memcmp(input, output, sizeof(input)) == 0);
+
+    /* Streaming export */
+    assert(tfs_copy_to_external_fs(path, external_path) != -1);
+    FILE *fp = fopen(external_path, "r");
+    assert(fp != NULL);
+    assert(fread(output, 1, sizeof(output), fp) == sizeof(output));
+    assert(fclose(fp) != -1);
+    assert(memcmp(input, output, sizeof(input)) == 0);
+    unlink(external_path);
+
+    /* Scattered reads */
+    for (size_t i = 0; i < 20; i++) {
+        size_t offset = (i * 37 % 200) * BLOCK_SIZE + i;
+        fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_pread(fd, output, READ_SIZE, offset) == READ_SIZE);
+        assert(memcmp(input + offset, output, READ_SIZE) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Files written past their end have holes, which read as zeros and take up
+ * no data blocks. Checks seeking (including to data and holes), reading and
+ * mapping holes, and that many sparse files of the maximum size fit in the
+ * file system, although their data would not.
+ */
+
+#define NUM_FILES 16
+#define HOLE_BLOCKS 5
+
+int main() {
+    char const *path = "/f1";
+    char buf[BLOCK_SIZE * (HOLE_BLOCKS + 1)];
+    char zeros[BLOCK_SIZE * HOLE_BLOCKS];
+    memset(zeros, 0, sizeof(zeros));
+
+    assert(tfs_init() != -1);
+
+    /* Dirty some data blocks, so that reused blocks are not zeroed already */
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    memset(buf, 'x', sizeof(buf));
+    assert(tfs_write(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+
+    /* Seek past the end and write a byte */
+    assert(tfs_lseek(fd, -1, TFS_SEEK_SET) == -1);
+    assert(tfs_lseek(fd, HOLE_BLOCKS * BLOCK_SIZE, TFS_SEEK_SET) ==
+           HOLE_BLOCKS * BLOCK_SIZE);
+    assert(tfs_write(fd, "a", 1) == 1);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_CUR) == HOLE_BLOCKS * BLOCK_SIZE + 1);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_END) == HOLE_BLOCKS * BLOCK_SIZE + 1);
+
+    /* The hole reads as zeros, up to the byte written */
+    assert(tfs_lseek(fd, -(HOLE_BLOCKS * BLOCK_SIZE + 1), TFS_SEEK_CUR) == 0);
+    assert(tfs_read(fd, buf, sizeof(buf)) == HOLE_BLOCKS * BLOCK_SIZE + 1);
+    assert(memcmp(buf, zeros, sizeof(zeros)) == 0);
+    assert(buf[HOLE_BLOCKS * BLOCK_SIZE] == 'a');
+
+    /* Finding data and holes */
+    assert(tfs_lseek(fd, 0, TFS_SEEK_DATA) == HOLE_BLOCKS * BLOCK_SIZE);
+    assert(tfs_lseek(fd, 10, TFS_SEEK_HOLE) == 10);
+    assert(tfs_lseek(fd, HOLE_BLOCKS * BLOCK_SIZE, TFS_SEEK_HOLE) ==
+           HOLE_BLOCKS * BLOCK_SIZE + 1);
+    assert(tfs_lseek(fd, HOLE_BLOCKS * BLOCK_SIZE + 1, TFS_SEEK_DATA) == -1);
+
+    /* Mapping the hole also yields zeros */
+    file_map_t map;
+    assert(tfs_read_map(fd, BLOCK_SIZE / 2, BLOCK_SIZE * 2, &map) == 0);
+    for (size_t i = 0; i < map.fm_count; i++) {
+        assert(memcmp(map.fm_spans[i].s_data, zeros, map.fm_spans[i].s_len) ==
+               0);
+    }
+    assert(tfs_read_unmap(&map) == 0);
+
+    /* Filling part of the hole keeps the rest zeroed */
+    assert(tfs_pwrite(fd, "b", 1, BLOCK_SIZE + 7) == 1);
+    assert(tfs_pread(fd, buf, BLOCK_SIZE * 2, 0) == BLOCK_SIZE * 2);
+    for (int i = 0; i < BLOCK_SIZE * 2; i++) {
+        assert(buf[i] == (i == BLOCK_SIZE + 7 ? 'b' : 0));
+    }
+    assert(tfs_lseek(fd, 0, TFS_SEEK_DATA) == BLOCK_SIZE);
+    assert(tfs_lseek(fd, BLOCK_SIZE, TFS_SEEK_HOLE) == BLOCK_SIZE * 2);
+    assert(tfs_close(fd) != -1);
+
+    /* Sparse files of the maximum size, with data only in their last byte */
+    for (int i = 0; i < NUM_FILES; i++) {
+        char name[] = "/sparse_x";
+        name[strlen(name) - 1] = (char)('a' + i);
+        fd = tfs_open(name, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_pwrite(fd, "z", 1, MAX_FILE_SIZE - 1) == 1);
+        assert(tfs_lseek(fd, 0, TFS_SEEK_END) == MAX_FILE_SIZE);
+        assert(tfs_pread(fd, buf, 2, MAX_FILE_SIZE - 2) == 2);
+        assert(buf[0] == 0 && buf[1] == 'z');
+        assert(tfs_close(fd) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Shrinks and grows files to arbitrary lengths: the data kept is intact, the
+ * partial last block reads as zeros past the new end when the file grows
+ * again, a clone sharing the blocks is not affected, and the blocks freed
+ * (including the indirect block) can be used by other files.
+ */
+
+#define FULL_FILES 3
+#define LONG_SIZE (INODE_DIRECT_REFS * BLOCK_SIZE + 5 * BLOCK_SIZE + 100)
+#define SHORT_SIZE (3 * BLOCK_SIZE + 10)
+
+static char data[MAX_FILE_SIZE];
+static char buf[MAX_FILE_SIZE];
+
+int main() {
+    char const *path = "/f1";
+    char const *clone_path = "/f2";
+    char zeros[BLOCK_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, LONG_SIZE) == LONG_SIZE);
+    assert(tfs_clone(path, clone_path) == 0);
+
+    /* Invalid lengths and files are rejected */
+    assert(tfs_truncate(path, MAX_FILE_SIZE + 1) == -1);
+    assert(tfs_truncate("/missing", 0) == -1);
+    assert(tfs_ftruncate(-1, 0) == -1);
+
+    /* Shrink below the direct blocks, in the middle of a block */
+    assert(tfs_truncate(path, SHORT_SIZE) == 0);
+    assert(tfs_lseek(fd, 0, TFS_SEEK_END) == SHORT_SIZE);
+    assert(tfs_pread(fd, buf, sizeof(buf), 0) == SHORT_SIZE);
+    assert(memcmp(buf, data, SHORT_SIZE) == 0);
+
+    /* Grow again: the old tail reads as zeros, up to the new end */
+    assert(tfs_ftruncate(fd, SHORT_SIZE + 2 * BLOCK_SIZE) == 0);
+    assert(tfs_pread(fd, buf, sizeof(buf), 0) == SHORT_SIZE + 2 * BLOCK_SIZE);
+    assert(memcmp(buf, data, SHORT_SIZE) == 0);
+    assert(memcmp(buf + SHORT_SIZE, zeros, BLOCK_SIZE) == 0);
+    assert(memcmp(buf + SHORT_SIZE + BLOCK_SIZE, zeros, BLOCK_SIZE) == 0);
+
+    /* The clone keeps its data */
+    int clone_fd = tfs_open(clone_path, 0);
+    assert(clone_fd != -1);
+    assert(tfs_pread(clone_fd, buf, sizeof(buf), 0) == LONG_SIZE);
+    assert(memcmp(buf, data, LONG_SIZE) == 0);
+    assert(tfs_close(clone_fd) != -1);
+    assert(tfs_truncate(clone_path, 0) == 0);
+
+    /* Buffered writes are applied before truncating */
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open(path, TFS_O_BUFFERED);
+    assert(fd != -1);
+    assert(tfs_write(fd, "xyz", 3) == 3);
+    assert(tfs_ftruncate(fd, 2) == 0);
+    assert(tfs_pread(fd, buf, sizeof(buf), 0) == 2);
+    assert(memcmp(buf, "xy", 2) == 0);
+    assert(tfs_close(fd) != -1);
+
+    /* Fill the file system with files of the maximum size, shrink one of
+     * them, and check its blocks are free for another one */
+    char full_path[] = "/full0";
+    for (int i = 0; i <= FULL_FILES; i++) {
+        full_path[5] = (char)('0' + i);
+        fd = tfs_open(full_path, TFS_O_CREAT);
+        assert(fd != -1);
+        ssize_t written = tfs_write(fd, data, MAX_FILE_SIZE);
+        assert(tfs_close(fd) != -1);
+        if (i < FULL_FILES) {
+            assert(written == MAX_FILE_SIZE);
+        } else {
+            assert(written < MAX_FILE_SIZE);
+        }
+    }
+
+    assert(tfs_truncate("/full0", BLOCK_SIZE / 2) == 0);
+    fd = tfs_open(full_path, 0);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, data, MAX_FILE_SIZE, 0) == MAX_FILE_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Multiple threads append records (header, payload and trailer) to the same
+ * file with tfs_writev. Each record must end up contiguous in the file, which
+ * is then read back record by record with tfs_readv.
+ */
+
+#define NUM_THREADS 10
+#define RECORDS_PER_THREAD 8
+#define HEADER_SIZE 4
+#define PAYLOAD_SIZE 300
+#define TRAILER_SIZE 4
+
+typedef struct {
+    const char *path;
+    char id;
+} thread_params_t;
+
+void *thread_func(void *params_v) {
+    thread_params_t *params = (thread_params_t *)params_v;
+    char header[HEADER_SIZE], payload[PAYLOAD_SIZE], trailer[TRAILER_SIZE];
+    memset(header, '<', sizeof(header));
+    memset(payload, params->id, sizeof(payload));
+    memset(trailer, '>', sizeof(trailer));
+
+    struct iovec iov[] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+        {.iov_base = trailer, .iov_len = sizeof(trailer)},
+    };
+
+    int fd = tfs_open(params->path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+        assert(tfs_writev(fd, iov, 3) ==
+               HEADER_SIZE + PAYLOAD_SIZE + TRAILER_SIZE);
+    }
+    assert(tfs_close(fd) == 0);
+    return NULL;
+}
+
+int main() {
+    char *path = "/f1";
+
+    assert(tfs_init() != -1);
+
+    thread_params_t params[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        params[i].path = path;
+        params[i].id = 'a' + (char)i;
+        assert(pthread_create(&threads[i], NULL, thread_func, &params[i]) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+
+    int count[NUM_THREADS] = {0};
+    char header[HEADER_SIZE], payload[PAYLOAD_SIZE], trailer[TRAILER_SIZE];
+    struct iovec iov[] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+        {.iov_base = trailer, .iov_len = sizeof(trailer)},
+    };
+
+    for (int i = 0; i < NUM_THREADS * RECORDS_PER_THREAD; i++) {
+        assert(tfs_readv(fd, iov, 3) ==
+               HEADER_SIZE + PAYLOAD_SIZE + TRAILER_SIZE);
+        for (int j = 0; j < HEADER_SIZE; j++) {
+            assert(header[j] == '<');
+        }
+        for (int j = 0; j < TRAILER_SIZE; j++) {
+            assert(trailer[j] == '>');
+        }
+        for (int j = 1; j < PAYLOAD_SIZE; j++) {
+            assert(payload[j] == payload[0]);
+        }
+        assert(payload[0] >= 'a' && payload[0] < 'a' + NUM_THREADS);
+        count[payload[0] - 'a']++;
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(count[i] == RECORDS_PER_THREAD);
+    }
+
+    /* End of file reached */
+    assert(tfs_readv(fd, iov, 3) == 0);
+    assert(tfs_readv(fd, iov, -1) == -1);
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "fs/operations.h"
+#include <stdio.h>
+
+/*
+ * Rebuilds a TecnicoFS image file from a chain of checkpoints written by
+ * tfs_checkpoint, given in the order they were written.
+ * Build together with the file system, e.g.:
+ *   gcc -std=c17 -O2 -pthread -I. -Ifs fs/journal.c fs/kernels.c fs/lz.c \
+ *       fs/operations.c fs/state.c tools/restore.c
+ */
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s IMAGE CHECKPOINT...\n", argv[0]);
+        return 2;
+    }
+
+    if (tfs_restore(argv[1], (char const *const *)argv + 2,
+                    (size_t)argc - 2) == -1) {
+        fprintf(stderr, "%s: cannot restore %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    return 0;
+}